@@ -13,12 +13,17 @@
 #include <linux/slab.h>
 #include <linux/wait.h>
 #include <linux/sched.h>
+#include <linux/cpu.h>
+#include <linux/percpu.h>
 
 #include "zcomp.h"
 #include "zcomp_lzo.h"
 #ifdef CONFIG_ZRAM_LZ4_COMPRESS
 #include "zcomp_lz4.h"
 #endif
+#ifdef CONFIG_ZRAM_LZ4HC_COMPRESS
+#include "zcomp_lz4hc.h"
+#endif
 
 /*
  * single zcomp_strm backend
@@ -43,10 +48,23 @@ struct zcomp_strm_multi {
 	wait_queue_head_t strm_wait;
 };
 
+/*
+ * per-cpu zcomp_strm backend
+ */
+struct zcomp_strm_percpu {
+	/* one stream per online cpu, allocated at cpu hotplug */
+	struct zcomp_strm * __percpu *strms;
+	struct notifier_block notifier;
+	struct zcomp *comp;
+};
+
 static struct zcomp_backend *backends[] = {
 	&zcomp_lzo,
 #ifdef CONFIG_ZRAM_LZ4_COMPRESS
 	&zcomp_lz4,
+#endif
+#ifdef CONFIG_ZRAM_LZ4HC_COMPRESS
+	&zcomp_lz4hc,
 #endif
 	NULL
 };
@@ -218,6 +236,125 @@ static int zcomp_strm_multi_create(struct zcomp *comp, int max_strm)
 	return 0;
 }
 
+/*
+ * get this cpu's stream; preemption stays disabled until the stream is
+ * released, so no lock is needed to own it
+ */
+static struct zcomp_strm *zcomp_strm_percpu_find(struct zcomp *comp)
+{
+	struct zcomp_strm_percpu *zs = comp->stream;
+
+	return *get_cpu_ptr(zs->strms);
+}
+
+static void zcomp_strm_percpu_release(struct zcomp *comp,
+		struct zcomp_strm *zstrm)
+{
+	struct zcomp_strm_percpu *zs = comp->stream;
+
+	put_cpu_ptr(zs->strms);
+}
+
+static bool zcomp_strm_percpu_set_max_streams(struct zcomp *comp, int num_strm)
+{
+	/* there is always one stream per cpu, fewer need a device reset */
+	return num_strm >= num_possible_cpus();
+}
+
+static int __zcomp_strm_percpu_notify(struct zcomp_strm_percpu *zs,
+		unsigned long action, unsigned int cpu)
+{
+	struct zcomp_strm *zstrm;
+
+	switch (action & ~CPU_TASKS_FROZEN) {
+	case CPU_UP_PREPARE:
+		if (WARN_ON(*per_cpu_ptr(zs->strms, cpu)))
+			break;
+		zstrm = zcomp_strm_alloc(zs->comp);
+		if (!zstrm) {
+			pr_err("Can't allocate a compression stream\n");
+			return NOTIFY_BAD;
+		}
+		*per_cpu_ptr(zs->strms, cpu) = zstrm;
+		break;
+	case CPU_DEAD:
+	case CPU_UP_CANCELED:
+		zstrm = *per_cpu_ptr(zs->strms, cpu);
+		if (zstrm)
+			zcomp_strm_free(zs->comp, zstrm);
+		*per_cpu_ptr(zs->strms, cpu) = NULL;
+		break;
+	default:
+		break;
+	}
+	return NOTIFY_OK;
+}
+
+static int zcomp_strm_percpu_notify(struct notifier_block *nb,
+		unsigned long action, void *hcpu)
+{
+	struct zcomp_strm_percpu *zs = container_of(nb,
+			struct zcomp_strm_percpu, notifier);
+
+	return __zcomp_strm_percpu_notify(zs, action, (unsigned long)hcpu);
+}
+
+static void zcomp_strm_percpu_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm_percpu *zs = comp->stream;
+	unsigned int cpu;
+
+	cpu_notifier_register_begin();
+	__unregister_cpu_notifier(&zs->notifier);
+	for_each_online_cpu(cpu)
+		__zcomp_strm_percpu_notify(zs, CPU_UP_CANCELED, cpu);
+	cpu_notifier_register_done();
+
+	free_percpu(zs->strms);
+	kfree(zs);
+}
+
+static int zcomp_strm_percpu_create(struct zcomp *comp)
+{
+	struct zcomp_strm_percpu *zs;
+	unsigned int cpu;
+
+	comp->destroy = zcomp_strm_percpu_destroy;
+	comp->strm_find = zcomp_strm_percpu_find;
+	comp->strm_release = zcomp_strm_percpu_release;
+	comp->set_max_streams = zcomp_strm_percpu_set_max_streams;
+	zs = kzalloc(sizeof(struct zcomp_strm_percpu), GFP_KERNEL);
+	if (!zs)
+		return -ENOMEM;
+
+	zs->strms = alloc_percpu(struct zcomp_strm *);
+	if (!zs->strms) {
+		kfree(zs);
+		return -ENOMEM;
+	}
+	zs->comp = comp;
+	zs->notifier.notifier_call = zcomp_strm_percpu_notify;
+	comp->stream = zs;
+
+	cpu_notifier_register_begin();
+	for_each_online_cpu(cpu) {
+		if (__zcomp_strm_percpu_notify(zs, CPU_UP_PREPARE, cpu) ==
+				NOTIFY_BAD)
+			goto cleanup;
+	}
+	__register_cpu_notifier(&zs->notifier);
+	cpu_notifier_register_done();
+	return 0;
+
+cleanup:
+	for_each_online_cpu(cpu)
+		__zcomp_strm_percpu_notify(zs, CPU_UP_CANCELED, cpu);
+	cpu_notifier_register_done();
+	free_percpu(zs->strms);
+	kfree(zs);
+	return -ENOMEM;
+}
+
 static struct zcomp_strm *zcomp_strm_single_find(struct zcomp *comp)
 {
 	struct zcomp_strm_single *zs = comp->stream;
@@ -331,7 +468,10 @@ void zcomp_destroy(struct zcomp *comp)
  * backend pointer or ERR_PTR if things went bad. ERR_PTR(-EINVAL)
  * if requested algorithm is not supported, ERR_PTR(-ENOMEM) in
  * case of allocation error, or any other error potentially
- * returned by functions zcomp_strm_{multi,single}_create.
+ * returned by functions zcomp_strm_{percpu,multi,single}_create.
+ *
+ * A limit of at least one stream per possible cpu selects the per-cpu
+ * backend, which hands out streams without any shared lock.
  */
 struct zcomp *zcomp_create(const char *compress, int max_strm)
 {
@@ -348,7 +488,9 @@ struct zcomp *zcomp_create(const char *compress, int max_strm)
 		return ERR_PTR(-ENOMEM);
 
 	comp->backend = backend;
-	if (max_strm > 1)
+	if (max_strm >= num_possible_cpus())
+		error = zcomp_strm_percpu_create(comp);
+	else if (max_strm > 1)
 		error = zcomp_strm_multi_create(comp, max_strm);
 	else
 		error = zcomp_strm_single_create(comp);
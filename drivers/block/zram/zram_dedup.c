@@ -0,0 +1,187 @@
+/*
+ * Compressed RAM block device object deduplication
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zram_dedup.h"
+
+/* One bucket for this many pages of disk size */
+#define ZRAM_DEDUP_PAGES_PER_BUCKET	16
+#define ZRAM_DEDUP_MIN_BITS		6
+
+/*
+ * The compressor is deterministic, so identical pages compress to
+ * identical objects and objects can be compared without decompressing
+ * them. Hashing the compressed bytes is also cheaper than hashing the
+ * page itself.
+ */
+static u32 zram_dedup_checksum(const unsigned char *mem, size_t len)
+{
+	return jhash(mem, len, 0);
+}
+
+static struct zram_dedup_bucket *zram_dedup_bucket(struct zram_meta *meta,
+						    u32 checksum)
+{
+	return &meta->dedup_table[hash_32(checksum, meta->dedup_bits)];
+}
+
+static bool zram_dedup_match(struct zram_meta *meta,
+			     struct zram_dedup_entry *entry,
+			     const unsigned char *mem, size_t len)
+{
+	unsigned char *cmem;
+	bool match;
+
+	cmem = zs_map_object(meta->mem_pool, entry->handle, ZS_MM_RO);
+	match = !memcmp(cmem, mem, len);
+	zs_unmap_object(meta->mem_pool, entry->handle);
+
+	return match;
+}
+
+/*
+ * Look up an object with the @len compressed bytes at @mem and take a
+ * reference on it. The checksum is returned in *@checksum either way, so
+ * that zram_dedup_insert() can reuse it on a miss. Does not sleep.
+ */
+struct zram_dedup_entry *zram_dedup_find(struct zram *zram,
+		const unsigned char *mem, size_t len, u32 *checksum)
+{
+	struct zram_meta *meta = zram->meta;
+	struct zram_dedup_bucket *bucket;
+	struct zram_dedup_entry *entry;
+
+	*checksum = zram_dedup_checksum(mem, len);
+	bucket = zram_dedup_bucket(meta, *checksum);
+
+	spin_lock(&bucket->lock);
+	hlist_for_each_entry(entry, &bucket->head, node) {
+		if (entry->checksum != *checksum || entry->len != len)
+			continue;
+		if (zram_dedup_match(meta, entry, mem, len)) {
+			entry->refcount++;
+			spin_unlock(&bucket->lock);
+			return entry;
+		}
+	}
+	spin_unlock(&bucket->lock);
+
+	return NULL;
+}
+
+/*
+ * Make the freshly stored object @handle findable. Returns the entry
+ * holding the first reference, or NULL if it could not be allocated, in
+ * which case the caller keeps using the plain handle.
+ */
+struct zram_dedup_entry *zram_dedup_insert(struct zram *zram,
+		unsigned long handle, size_t len, u32 checksum)
+{
+	struct zram_meta *meta = zram->meta;
+	struct zram_dedup_bucket *bucket;
+	struct zram_dedup_entry *entry;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO | __GFP_NOWARN);
+	if (!entry)
+		return NULL;
+
+	entry->handle = handle;
+	entry->len = len;
+	entry->checksum = checksum;
+	entry->refcount = 1;
+
+	bucket = zram_dedup_bucket(meta, checksum);
+	spin_lock(&bucket->lock);
+	hlist_add_head(&entry->node, &bucket->head);
+	spin_unlock(&bucket->lock);
+
+	atomic64_add(sizeof(*entry), &zram->stats.meta_data_size);
+	return entry;
+}
+
+/*
+ * Drop a slot's reference. The object is freed with the last one, until
+ * then the slot's share counts as saved.
+ */
+void zram_dedup_put(struct zram *zram, struct zram_dedup_entry *entry)
+{
+	struct zram_meta *meta = zram->meta;
+	struct zram_dedup_bucket *bucket;
+	bool last;
+
+	bucket = zram_dedup_bucket(meta, entry->checksum);
+	spin_lock(&bucket->lock);
+	last = !--entry->refcount;
+	if (last)
+		hlist_del(&entry->node);
+	spin_unlock(&bucket->lock);
+
+	if (!last) {
+		atomic64_sub(entry->len, &zram->stats.dup_data_size);
+		return;
+	}
+
+	zs_free(meta->mem_pool, entry->handle);
+	atomic64_sub(entry->len, &zram->stats.compr_data_size);
+	atomic64_sub(sizeof(*entry), &zram->stats.meta_data_size);
+	kfree(entry);
+}
+
+int zram_dedup_init(struct zram_meta *meta, size_t num_pages)
+{
+	unsigned int i, nr_buckets;
+
+	nr_buckets = num_pages / ZRAM_DEDUP_PAGES_PER_BUCKET;
+	meta->dedup_bits = max_t(unsigned int, ZRAM_DEDUP_MIN_BITS,
+				 order_base_2(nr_buckets));
+	nr_buckets = 1U << meta->dedup_bits;
+
+	meta->dedup_table = vmalloc(nr_buckets * sizeof(*meta->dedup_table));
+	if (!meta->dedup_table) {
+		pr_err("Error allocating dedup table\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr_buckets; i++) {
+		spin_lock_init(&meta->dedup_table[i].lock);
+		INIT_HLIST_HEAD(&meta->dedup_table[i].head);
+	}
+	return 0;
+}
+
+/* Free all objects still shared, the slots referencing them are gone */
+void zram_dedup_fini(struct zram_meta *meta)
+{
+	struct zram_dedup_entry *entry;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	if (!meta->dedup_table)
+		return;
+
+	for (i = 0; i < (1U << meta->dedup_bits); i++) {
+		hlist_for_each_entry_safe(entry, tmp,
+					  &meta->dedup_table[i].head, node) {
+			zs_free(meta->mem_pool, entry->handle);
+			kfree(entry);
+		}
+	}
+	vfree(meta->dedup_table);
+	meta->dedup_table = NULL;
+}
@@ -0,0 +1,88 @@
+/*
+ * Compressed RAM block device object deduplication
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+#include <linux/list.h>
+#include <linux/spinlock.h>
+
+#include "zram_drv.h"
+
+/*
+ * A compressed object shared by all slots with the same content. Slots
+ * flagged ZRAM_DEDUP keep a pointer to it instead of a zsmalloc handle.
+ */
+struct zram_dedup_entry {
+	struct hlist_node node;
+	unsigned long handle;
+	unsigned int len;
+	u32 checksum;
+	/* number of slots using the object, protected by the bucket lock */
+	unsigned int refcount;
+};
+
+struct zram_dedup_bucket {
+	spinlock_t lock;
+	struct hlist_head head;
+};
+
+#ifdef CONFIG_ZRAM_DEDUP
+static inline bool zram_dedup_enabled(struct zram_meta *meta)
+{
+	return meta->dedup_table;
+}
+
+static inline unsigned long zram_dedup_handle(unsigned long entry)
+{
+	return ((struct zram_dedup_entry *)entry)->handle;
+}
+
+int zram_dedup_init(struct zram_meta *meta, size_t num_pages);
+void zram_dedup_fini(struct zram_meta *meta);
+struct zram_dedup_entry *zram_dedup_find(struct zram *zram,
+		const unsigned char *mem, size_t len, u32 *checksum);
+struct zram_dedup_entry *zram_dedup_insert(struct zram *zram,
+		unsigned long handle, size_t len, u32 checksum);
+void zram_dedup_put(struct zram *zram, struct zram_dedup_entry *entry);
+#else
+static inline bool zram_dedup_enabled(struct zram_meta *meta)
+{
+	return false;
+}
+
+static inline unsigned long zram_dedup_handle(unsigned long entry)
+{
+	return 0;
+}
+
+static inline int zram_dedup_init(struct zram_meta *meta, size_t num_pages)
+{
+	return 0;
+}
+
+static inline void zram_dedup_fini(struct zram_meta *meta) {}
+
+static inline struct zram_dedup_entry *zram_dedup_find(struct zram *zram,
+		const unsigned char *mem, size_t len, u32 *checksum)
+{
+	return NULL;
+}
+
+static inline struct zram_dedup_entry *zram_dedup_insert(struct zram *zram,
+		unsigned long handle, size_t len, u32 checksum)
+{
+	return NULL;
+}
+
+static inline void zram_dedup_put(struct zram *zram,
+				  struct zram_dedup_entry *entry) {}
+#endif
+
+#endif /* _ZRAM_DEDUP_H_ */
@@ -30,8 +30,10 @@
 #include <linux/err.h>
 #include <linux/idr.h>
 #include <linux/sysfs.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
+#include "zram_dedup.h"
 
 static DEFINE_IDR(zram_index_idr);
 /* idr index must be protected */
@@ -164,31 +166,48 @@ static inline void update_used_max(struct zram *zram,
 	} while (old_max != cur_max);
 }
 
-static bool page_zero_filled(void *ptr)
+static bool page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return false;
 	}
 
+	*element = page[0];
 	return true;
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void zram_fill_page(void *ptr, unsigned long len,
+			   unsigned long value)
+{
+	unsigned long *page = ptr;
+	unsigned long i;
+
+	if (likely(!value)) {
+		memset(ptr, 0, len);
+		return;
+	}
+
+	for (i = 0; i < len / sizeof(*page); i++)
+		page[i] = value;
+}
+
+/*
+ * A partial read of a same filled page starts at a word boundary since
+ * zram I/O is aligned to sectors.
+ */
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
 	user_mem = kmap_atomic(page);
-	if (is_partial_io(bvec))
-		memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
-	else
-		clear_page(user_mem);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
 	kunmap_atomic(user_mem);
 
 	flush_dcache_page(page);
@@ -392,6 +411,135 @@ static ssize_t comp_algorithm_store(struct device *dev,
 	return len;
 }
 
+static ssize_t recomp_algorithm_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	size_t sz;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	if (zram->recomp_algorithm[0])
+		sz = zcomp_available_show(zram->recomp_algorithm, buf);
+	else
+		sz = scnprintf(buf, PAGE_SIZE, "none\n");
+	up_read(&zram->init_lock);
+
+	return sz;
+}
+
+static ssize_t recomp_algorithm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	bool none = sysfs_streq(buf, "none");
+	size_t sz;
+
+	if (!none && !zcomp_available_algorithm(buf))
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		up_write(&zram->init_lock);
+		pr_info("Can't change algorithm for initialized device\n");
+		return -EBUSY;
+	}
+	if (none) {
+		zram->recomp_algorithm[0] = 0x00;
+		up_write(&zram->init_lock);
+		return len;
+	}
+	strlcpy(zram->recomp_algorithm, buf, sizeof(zram->recomp_algorithm));
+
+	/* ignore trailing newline */
+	sz = strlen(zram->recomp_algorithm);
+	if (sz > 0 && zram->recomp_algorithm[sz - 1] == '\n')
+		zram->recomp_algorithm[sz - 1] = 0x00;
+
+	up_write(&zram->init_lock);
+	return len;
+}
+
+/*
+ * Writing "idle" recompresses all pages marked idle that are not on the
+ * backing device yet, "huge" all pages stored uncompressed. The pass runs
+ * in the background and only keeps results smaller than the original.
+ */
+static ssize_t recompress_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	enum zram_pageflags mode;
+	ssize_t ret = len;
+
+	if (sysfs_streq(buf, "idle"))
+		mode = ZRAM_IDLE;
+	else if (sysfs_streq(buf, "huge"))
+		mode = ZRAM_HUGE;
+	else
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram) || !zram->recomp) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (work_busy(&zram->recomp_work)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	zram->recomp_mode = mode;
+	queue_work(system_unbound_wq, &zram->recomp_work);
+out:
+	up_read(&zram->init_lock);
+	return ret;
+}
+
+#ifdef CONFIG_ZRAM_DEDUP
+static inline bool zram_use_dedup(struct zram *zram)
+{
+	return zram->use_dedup;
+}
+
+static ssize_t use_dedup_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	bool val;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	val = zram->use_dedup;
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", (int)val);
+}
+
+static ssize_t use_dedup_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	bool val;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		up_write(&zram->init_lock);
+		pr_info("Can't change dedup usage for initialized device\n");
+		return -EBUSY;
+	}
+	zram->use_dedup = val;
+	up_write(&zram->init_lock);
+	return len;
+}
+#else
+static inline bool zram_use_dedup(struct zram *zram)
+{
+	return false;
+}
+#endif
+
 static ssize_t compact_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t len)
 {
@@ -419,11 +567,14 @@ static ssize_t io_stat_show(struct device *dev,
 
 	down_read(&zram->init_lock);
 	ret = scnprintf(buf, PAGE_SIZE,
-			"%8llu %8llu %8llu %8llu\n",
+			"%8llu %8llu %8llu %8llu %8llu %8llu %8llu\n",
 			(u64)atomic64_read(&zram->stats.failed_reads),
 			(u64)atomic64_read(&zram->stats.failed_writes),
 			(u64)atomic64_read(&zram->stats.invalid_io),
-			(u64)atomic64_read(&zram->stats.notify_free));
+			(u64)atomic64_read(&zram->stats.notify_free),
+			(u64)atomic64_read(&zram->stats.writestall),
+			(u64)atomic64_read(&zram->stats.bd_reads),
+			(u64)atomic64_read(&zram->stats.bd_writes));
 	up_read(&zram->init_lock);
 
 	return ret;
@@ -450,14 +601,19 @@ static ssize_t mm_stat_show(struct device *dev,
 	max_used = atomic_long_read(&zram->stats.max_used_pages);
 
 	ret = scnprintf(buf, PAGE_SIZE,
-			"%8llu %8llu %8llu %8lu %8ld %8llu %8lu\n",
+			"%8llu %8llu %8llu %8lu %8ld %8llu %8lu %8llu %8llu %8llu %8llu %8llu\n",
 			orig_size << PAGE_SHIFT,
 			(u64)atomic64_read(&zram->stats.compr_data_size),
 			mem_used << PAGE_SHIFT,
 			zram->limit_pages << PAGE_SHIFT,
 			max_used << PAGE_SHIFT,
-			(u64)atomic64_read(&zram->stats.zero_pages),
-			pool_stats.pages_compacted);
+			(u64)atomic64_read(&zram->stats.same_pages),
+			pool_stats.pages_compacted,
+			(u64)atomic64_read(&zram->stats.huge_pages),
+			(u64)atomic64_read(&zram->stats.bd_count) << PAGE_SHIFT,
+			(u64)atomic64_read(&zram->stats.recomp_pages),
+			(u64)atomic64_read(&zram->stats.dup_data_size),
+			(u64)atomic64_read(&zram->stats.meta_data_size));
 	up_read(&zram->init_lock);
 
 	return ret;
@@ -471,9 +627,20 @@ ZRAM_ATTR_RO(failed_reads);
 ZRAM_ATTR_RO(failed_writes);
 ZRAM_ATTR_RO(invalid_io);
 ZRAM_ATTR_RO(notify_free);
-ZRAM_ATTR_RO(zero_pages);
 ZRAM_ATTR_RO(compr_data_size);
 
+/* zero pages are counted as same filled pages now */
+static ssize_t zero_pages_show(struct device *d,
+				struct device_attribute *attr, char *b)
+{
+	struct zram *zram = dev_to_zram(d);
+
+	deprecated_attr_warn("zero_pages");
+	return scnprintf(b, PAGE_SIZE, "%llu\n",
+		(u64)atomic64_read(&zram->stats.same_pages));
+}
+static DEVICE_ATTR_RO(zero_pages);
+
 static inline bool zram_meta_get(struct zram *zram)
 {
 	if (atomic_inc_not_zero(&zram->refcount))
@@ -495,21 +662,29 @@ static void zram_meta_free(struct zram_meta *meta, u64 disksize)
 	for (index = 0; index < num_pages; index++) {
 		unsigned long handle = meta->table[index].handle;
 
-		if (!handle)
+		/*
+		 * blocks on the backing device need no freeing, shared
+		 * objects are freed with the dedup table
+		 */
+		if (!handle || zram_test_flag(meta, index, ZRAM_SAME) ||
+		    zram_test_flag(meta, index, ZRAM_WB) ||
+		    zram_test_flag(meta, index, ZRAM_DEDUP))
 			continue;
 
 		zs_free(meta->mem_pool, handle);
 	}
 
+	zram_dedup_fini(meta);
 	zs_destroy_pool(meta->mem_pool);
 	vfree(meta->table);
 	kfree(meta);
 }
 
-static struct zram_meta *zram_meta_alloc(char *pool_name, u64 disksize)
+static struct zram_meta *zram_meta_alloc(char *pool_name, u64 disksize,
+					 bool use_dedup)
 {
 	size_t num_pages;
-	struct zram_meta *meta = kmalloc(sizeof(*meta), GFP_KERNEL);
+	struct zram_meta *meta = kzalloc(sizeof(*meta), GFP_KERNEL);
 
 	if (!meta)
 		return NULL;
@@ -521,6 +696,9 @@ static struct zram_meta *zram_meta_alloc(char *pool_name, u64 disksize)
 		goto out_error;
 	}
 
+	if (use_dedup && zram_dedup_init(meta, num_pages))
+		goto out_error;
+
 	meta->mem_pool = zs_create_pool(pool_name);
 	if (!meta->mem_pool) {
 		pr_err("Error creating memory pool\n");
@@ -530,11 +708,210 @@ static struct zram_meta *zram_meta_alloc(char *pool_name, u64 disksize)
 	return meta;
 
 out_error:
+	zram_dedup_fini(meta);
 	vfree(meta->table);
 	kfree(meta);
 	return NULL;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+static inline bool zram_wb_enabled(struct zram *zram)
+{
+	return zram->backing_dev;
+}
+
+static void reset_bdev(struct zram *zram)
+{
+	if (!zram_wb_enabled(zram))
+		return;
+
+	set_blocksize(zram->bdev, zram->old_block_size);
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(zram->backing_dev, NULL);
+	vfree(zram->bitmap);
+
+	zram->backing_dev = NULL;
+	zram->bdev = NULL;
+	zram->old_block_size = 0;
+	zram->bitmap = NULL;
+	zram->nr_pages = 0;
+}
+
+/*
+ * Allocate up to *nr contiguous blocks on the backing device, fewer if it
+ * is too fragmented. Returns the first block and stores the number of
+ * blocks in *nr, or returns 0 if the device is full.
+ */
+static unsigned long alloc_blocks_bdev(struct zram *zram, unsigned int *nr)
+{
+	unsigned long blk = 0;
+	unsigned int n;
+
+	spin_lock(&zram->bitmap_lock);
+	for (n = *nr; n; n >>= 1) {
+		blk = bitmap_find_next_zero_area(zram->bitmap, zram->nr_pages,
+						 1, n, 0);
+		if (blk < zram->nr_pages) {
+			bitmap_set(zram->bitmap, blk, n);
+			break;
+		}
+	}
+	spin_unlock(&zram->bitmap_lock);
+
+	*nr = n;
+	return n ? blk : 0;
+}
+
+static void free_blocks_bdev(struct zram *zram, unsigned long blk,
+			     unsigned int nr)
+{
+	spin_lock(&zram->bitmap_lock);
+	WARN_ON_ONCE(find_next_zero_bit(zram->bitmap, blk + nr, blk) <
+		     blk + nr);
+	bitmap_clear(zram->bitmap, blk, nr);
+	spin_unlock(&zram->bitmap_lock);
+}
+
+static struct bio *zram_bdev_bio(struct zram *zram, unsigned long blk,
+				 unsigned int nr_vecs)
+{
+	struct bio *bio = bio_alloc(GFP_NOIO, nr_vecs);
+
+	bio->bi_iter.bi_sector = blk * SECTORS_PER_PAGE;
+	bio->bi_bdev = zram->bdev;
+	return bio;
+}
+
+struct zram_work {
+	struct work_struct work;
+	struct zram *zram;
+	unsigned long entry;
+	struct page *page;
+	int error;
+};
+
+static void zram_sync_read(struct work_struct *work)
+{
+	struct zram_work *zw = container_of(work, struct zram_work, work);
+	struct bio *bio = zram_bdev_bio(zw->zram, zw->entry, 1);
+
+	bio_add_page(bio, zw->page, PAGE_SIZE, 0);
+	zw->error = submit_bio_wait(READ, bio);
+	bio_put(bio);
+}
+
+/*
+ * A bio submitted from zram's make_request is only issued after it
+ * returns, so waiting for one there would never finish. Have a worker
+ * submit and wait for the read instead.
+ */
+static int read_from_bdev_sync(struct zram *zram, struct page *page,
+			       unsigned long entry)
+{
+	struct zram_work work;
+
+	work.zram = zram;
+	work.entry = entry;
+	work.page = page;
+	work.error = 0;
+
+	atomic64_inc(&zram->stats.bd_reads);
+	INIT_WORK_ONSTACK(&work.work, zram_sync_read);
+	queue_work(system_unbound_wq, &work.work);
+	flush_work(&work.work);
+	destroy_work_on_stack(&work.work);
+
+	return work.error;
+}
+
+/*
+ * Read the block straight into the page of @parent. The parent bio
+ * completes only once this read has finished.
+ */
+static int read_from_bdev_async(struct zram *zram, struct bio_vec *bvec,
+				unsigned long entry, struct bio *parent)
+{
+	struct bio *bio = zram_bdev_bio(zram, entry, 1);
+
+	if (!bio_add_page(bio, bvec->bv_page, bvec->bv_len,
+			  bvec->bv_offset)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	atomic64_inc(&zram->stats.bd_reads);
+	bio_chain(bio, parent);
+	submit_bio(READ, bio);
+	return 0;
+}
+
+/* Copy the page stored in block @entry to @mem */
+static int read_from_bdev_to_buf(struct zram *zram, char *mem,
+				 unsigned long entry)
+{
+	struct page *page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+	char *src;
+	int ret;
+
+	if (!page)
+		return -ENOMEM;
+
+	ret = read_from_bdev_sync(zram, page, entry);
+	if (!ret) {
+		src = kmap_atomic(page);
+		memcpy(mem, src, PAGE_SIZE);
+		kunmap_atomic(src);
+	}
+	__free_page(page);
+	return ret;
+}
+
+static int read_from_bdev(struct zram *zram, struct bio_vec *bvec,
+			  unsigned long entry, int offset, struct bio *parent)
+{
+	unsigned char *user_mem, *uncmem;
+	int ret;
+
+	if (!is_partial_io(bvec)) {
+		if (parent)
+			return read_from_bdev_async(zram, bvec, entry, parent);
+		return read_from_bdev_sync(zram, bvec->bv_page, entry);
+	}
+
+	uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
+	if (!uncmem)
+		return -ENOMEM;
+
+	ret = read_from_bdev_to_buf(zram, uncmem, entry);
+	if (!ret) {
+		user_mem = kmap_atomic(bvec->bv_page);
+		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
+		       bvec->bv_len);
+		kunmap_atomic(user_mem);
+		flush_dcache_page(bvec->bv_page);
+	}
+	kfree(uncmem);
+	return ret;
+}
+#else
+static inline bool zram_wb_enabled(struct zram *zram) { return false; }
+static inline void reset_bdev(struct zram *zram) {}
+static inline void free_blocks_bdev(struct zram *zram, unsigned long blk,
+				    unsigned int nr) {}
+
+static int read_from_bdev_to_buf(struct zram *zram, char *mem,
+				 unsigned long entry)
+{
+	return -EIO;
+}
+
+static int read_from_bdev(struct zram *zram, struct bio_vec *bvec,
+			  unsigned long entry, int offset, struct bio *parent)
+{
+	return -EIO;
+}
+#endif
+
 /*
  * To protect concurrent access to the same index entry,
  * caller should hold this table index entry's bit_spinlock to
@@ -545,18 +922,52 @@ static void zram_free_page(struct zram *zram, size_t index)
 	struct zram_meta *meta = zram->meta;
 	unsigned long handle = meta->table[index].handle;
 
-	if (unlikely(!handle)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(meta, index, ZRAM_ZERO)) {
-			zram_clear_flag(meta, index, ZRAM_ZERO);
-			atomic64_dec(&zram->stats.zero_pages);
-		}
+	zram_clear_flag(meta, index, ZRAM_IDLE);
+	zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+	zram_clear_flag(meta, index, ZRAM_UNDER_RECOMP);
+
+	if (zram_test_flag(meta, index, ZRAM_RECOMP)) {
+		zram_clear_flag(meta, index, ZRAM_RECOMP);
+		atomic64_dec(&zram->stats.recomp_pages);
+	}
+
+	if (zram_test_flag(meta, index, ZRAM_HUGE)) {
+		zram_clear_flag(meta, index, ZRAM_HUGE);
+		atomic64_dec(&zram->stats.huge_pages);
+	}
+
+	/*
+	 * No memory is allocated for same element filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(meta, index, ZRAM_SAME)) {
+		zram_clear_flag(meta, index, ZRAM_SAME);
+		meta->table[index].element = 0;
+		atomic64_dec(&zram->stats.same_pages);
 		return;
 	}
 
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		zram_clear_flag(meta, index, ZRAM_WB);
+		free_blocks_bdev(zram, handle, 1);
+		meta->table[index].handle = 0;
+		atomic64_dec(&zram->stats.bd_count);
+		atomic64_dec(&zram->stats.pages_stored);
+		return;
+	}
+
+	if (zram_test_flag(meta, index, ZRAM_DEDUP)) {
+		zram_clear_flag(meta, index, ZRAM_DEDUP);
+		zram_dedup_put(zram, (struct zram_dedup_entry *)handle);
+		meta->table[index].handle = 0;
+		zram_set_obj_size(meta, index, 0);
+		atomic64_dec(&zram->stats.pages_stored);
+		return;
+	}
+
+	if (unlikely(!handle))
+		return;
+
 	zs_free(meta->mem_pool, handle);
 
 	atomic64_sub(zram_get_obj_size(meta, index),
@@ -572,6 +983,7 @@ static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
 	int ret = 0;
 	unsigned char *cmem;
 	struct zram_meta *meta = zram->meta;
+	struct zcomp *comp;
 	unsigned long handle;
 	size_t size;
 
@@ -579,17 +991,37 @@ static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
 	handle = meta->table[index].handle;
 	size = zram_get_obj_size(meta, index);
 
-	if (!handle || zram_test_flag(meta, index, ZRAM_ZERO)) {
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		return read_from_bdev_to_buf(zram, mem, handle);
+	}
+
+	if (zram_test_flag(meta, index, ZRAM_SAME)) {
+		unsigned long element = meta->table[index].element;
+
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		zram_fill_page(mem, PAGE_SIZE, element);
+		return 0;
+	}
+
+	if (!handle) {
 		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 		memset(mem, 0, PAGE_SIZE);
 		return 0;
 	}
 
+	if (zram_test_flag(meta, index, ZRAM_DEDUP))
+		handle = zram_dedup_handle(handle);
+
+	comp = zram->comp;
+	if (zram_test_flag(meta, index, ZRAM_RECOMP))
+		comp = zram->recomp;
+
 	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_RO);
 	if (size == PAGE_SIZE)
 		memcpy(mem, cmem, PAGE_SIZE);
 	else
-		ret = zcomp_decompress(zram->comp, cmem, size, mem);
+		ret = zcomp_decompress(comp, cmem, size, mem);
 	zs_unmap_object(meta->mem_pool, handle);
 	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
@@ -603,7 +1035,7 @@ static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
 }
 
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
-			  u32 index, int offset)
+			  u32 index, int offset, struct bio *bio)
 {
 	int ret;
 	struct page *page;
@@ -612,12 +1044,25 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	page = bvec->bv_page;
 
 	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
-	if (unlikely(!meta->table[index].handle) ||
-			zram_test_flag(meta, index, ZRAM_ZERO)) {
+	if (zram_test_flag(meta, index, ZRAM_SAME)) {
+		unsigned long element = meta->table[index].element;
+
 		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
-		handle_zero_page(bvec);
+		handle_same_page(bvec, element);
 		return 0;
 	}
+	if (unlikely(!meta->table[index].handle)) {
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		handle_same_page(bvec, 0);
+		return 0;
+	}
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		unsigned long entry = meta->table[index].handle;
+
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		return read_from_bdev(zram, bvec, entry, offset, bio);
+	}
+	zram_clear_flag(meta, index, ZRAM_IDLE);
 	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
 	if (is_partial_io(bvec))
@@ -656,8 +1101,10 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret = 0;
-	size_t clen;
-	unsigned long handle;
+	size_t clen, alloced_len = 0;
+	unsigned long handle = 0, element;
+	struct zram_dedup_entry *entry = NULL;
+	u32 checksum = 0;
 	struct page *page;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 	struct zram_meta *meta = zram->meta;
@@ -681,6 +1128,11 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 	}
 
+compress_again:
+	/*
+	 * A per-cpu stream keeps preemption disabled until it is released,
+	 * so nothing below may sleep while zstrm is held.
+	 */
 	zstrm = zcomp_strm_find(zram->comp);
 	user_mem = kmap_atomic(page);
 
@@ -693,16 +1145,19 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		uncmem = user_mem;
 	}
 
-	if (page_zero_filled(uncmem)) {
+	if (page_same_filled(uncmem, &element)) {
 		if (user_mem)
 			kunmap_atomic(user_mem);
+		if (handle)
+			zs_free(meta->mem_pool, handle);
 		/* Free memory associated with this sector now. */
 		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
 		zram_free_page(zram, index);
-		zram_set_flag(meta, index, ZRAM_ZERO);
+		zram_set_flag(meta, index, ZRAM_SAME);
+		meta->table[index].element = element;
 		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
-		atomic64_inc(&zram->stats.zero_pages);
+		atomic64_inc(&zram->stats.same_pages);
 		ret = 0;
 		goto out;
 	}
@@ -716,6 +1171,8 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 
 	if (unlikely(ret)) {
 		pr_err("Compression failed! err=%d\n", ret);
+		if (handle)
+			zs_free(meta->mem_pool, handle);
 		goto out;
 	}
 	src = zstrm->buffer;
@@ -725,9 +1182,58 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			src = uncmem;
 	}
 
-	handle = zs_malloc(meta->mem_pool, clen, GFP_NOIO | __GFP_HIGHMEM |
-				__GFP_MOVABLE);
+	/*
+	 * Share an identical object if there is one. Uncompressed pages are
+	 * not worth the comparison.
+	 */
+	if (zram_dedup_enabled(meta) && clen != PAGE_SIZE) {
+		entry = zram_dedup_find(zram, src, clen, &checksum);
+		if (entry) {
+			zcomp_strm_release(zram->comp, zstrm);
+			zstrm = NULL;
+			if (handle)
+				zs_free(meta->mem_pool, handle);
+
+			bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+			zram_free_page(zram, index);
+			meta->table[index].handle = (unsigned long)entry;
+			zram_set_obj_size(meta, index, clen);
+			zram_set_flag(meta, index, ZRAM_DEDUP);
+			bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+
+			atomic64_add(clen, &zram->stats.dup_data_size);
+			atomic64_inc(&zram->stats.pages_stored);
+			goto out;
+		}
+	}
+
+	/* the page may have changed while the stream was dropped */
+	if (handle && clen != alloced_len) {
+		zs_free(meta->mem_pool, handle);
+		handle = 0;
+	}
+
+	/*
+	 * Try to allocate without direct reclaim first, so the stream can
+	 * be kept. If that fails, drop the stream, allocate the object with
+	 * reclaim allowed and compress the page again with a fresh stream.
+	 */
+	if (!handle)
+		handle = zs_malloc(meta->mem_pool, clen,
+				__GFP_KSWAPD_RECLAIM | __GFP_NOWARN |
+				__GFP_HIGHMEM | __GFP_MOVABLE);
 	if (!handle) {
+		zcomp_strm_release(zram->comp, zstrm);
+		zstrm = NULL;
+		atomic64_inc(&zram->stats.writestall);
+
+		handle = zs_malloc(meta->mem_pool, clen, GFP_NOIO |
+					__GFP_HIGHMEM | __GFP_MOVABLE);
+		if (handle) {
+			alloced_len = clen;
+			goto compress_again;
+		}
+
 		if (printk_timed_ratelimit(&zram_rs_time,
 					   ALLOC_ERROR_LOG_RATE_MS))
 			pr_info("Error allocating memory for compressed page: %u, size=%zu\n",
@@ -760,6 +1266,9 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	zstrm = NULL;
 	zs_unmap_object(meta->mem_pool, handle);
 
+	if (zram_dedup_enabled(meta) && clen != PAGE_SIZE)
+		entry = zram_dedup_insert(zram, handle, clen, checksum);
+
 	/*
 	 * Free memory associated with this sector
 	 * before overwriting unused sectors.
@@ -767,8 +1276,17 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
 	zram_free_page(zram, index);
 
-	meta->table[index].handle = handle;
+	if (entry) {
+		meta->table[index].handle = (unsigned long)entry;
+		zram_set_flag(meta, index, ZRAM_DEDUP);
+	} else {
+		meta->table[index].handle = handle;
+	}
 	zram_set_obj_size(meta, index, clen);
+	if (clen == PAGE_SIZE) {
+		zram_set_flag(meta, index, ZRAM_HUGE);
+		atomic64_inc(&zram->stats.huge_pages);
+	}
 	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
 	/* Update stats */
@@ -782,6 +1300,116 @@ out:
 	return ret;
 }
 
+/*
+ * Compress slot @index again with the secondary algorithm and replace
+ * the object if that made it smaller. The slot lock is only held to
+ * claim and to update the slot; a write or free in between clears
+ * ZRAM_UNDER_RECOMP and the result is thrown away.
+ */
+static void zram_recompress_slot(struct zram *zram, u32 index,
+				 enum zram_pageflags mode, void *uncmem)
+{
+	struct zram_meta *meta = zram->meta;
+	struct zcomp_strm *zstrm;
+	unsigned long handle;
+	unsigned char *cmem;
+	size_t size, clen;
+	bool idle;
+	int ret;
+
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	if (!meta->table[index].handle ||
+	    zram_test_flag(meta, index, ZRAM_SAME) ||
+	    zram_test_flag(meta, index, ZRAM_DEDUP) ||
+	    zram_test_flag(meta, index, ZRAM_WB) ||
+	    zram_test_flag(meta, index, ZRAM_UNDER_WB) ||
+	    zram_test_flag(meta, index, ZRAM_RECOMP) ||
+	    !zram_test_flag(meta, index, mode)) {
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		return;
+	}
+	zram_set_flag(meta, index, ZRAM_UNDER_RECOMP);
+	size = zram_get_obj_size(meta, index);
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+
+	if (zram_decompress_page(zram, uncmem, index))
+		goto abort;
+
+	/* the single stream backend may sleep while the stream is held */
+	zstrm = zcomp_strm_find(zram->recomp);
+	ret = zcomp_compress(zram->recomp, zstrm, uncmem, &clen);
+	if (ret || clen >= size || clen > max_zpage_size) {
+		zcomp_strm_release(zram->recomp, zstrm);
+		goto abort;
+	}
+
+	handle = zs_malloc(meta->mem_pool, clen, GFP_NOIO | __GFP_HIGHMEM |
+				__GFP_MOVABLE);
+	if (!handle) {
+		zcomp_strm_release(zram->recomp, zstrm);
+		goto abort;
+	}
+	update_used_max(zram, zs_get_total_pages(meta->mem_pool));
+
+	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_WO);
+	memcpy(cmem, zstrm->buffer, clen);
+	zs_unmap_object(meta->mem_pool, handle);
+	zcomp_strm_release(zram->recomp, zstrm);
+
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	if (!zram_test_flag(meta, index, ZRAM_UNDER_RECOMP)) {
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		zs_free(meta->mem_pool, handle);
+		return;
+	}
+
+	/* the page was not accessed, so keep it a writeback candidate */
+	idle = zram_test_flag(meta, index, ZRAM_IDLE);
+	zram_free_page(zram, index);
+	meta->table[index].handle = handle;
+	zram_set_obj_size(meta, index, clen);
+	zram_set_flag(meta, index, ZRAM_RECOMP);
+	if (idle)
+		zram_set_flag(meta, index, ZRAM_IDLE);
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+
+	atomic64_add(clen, &zram->stats.compr_data_size);
+	atomic64_inc(&zram->stats.pages_stored);
+	atomic64_inc(&zram->stats.recomp_pages);
+	return;
+
+abort:
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	zram_clear_flag(meta, index, ZRAM_UNDER_RECOMP);
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+}
+
+static void zram_recompress_work(struct work_struct *work)
+{
+	struct zram *zram = container_of(work, struct zram, recomp_work);
+	unsigned long nr_slots, index;
+	void *uncmem;
+
+	uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!uncmem)
+		return;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram) || !zram->recomp)
+		goto out;
+
+	nr_slots = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_slots; index++) {
+		if (READ_ONCE(zram->recomp_abort))
+			break;
+		zram_recompress_slot(zram, index, zram->recomp_mode, uncmem);
+		cond_resched();
+	}
+out:
+	up_read(&zram->init_lock);
+	kfree(uncmem);
+}
+
 /*
  * zram_bio_discard - handler on discard request
  * @index: physical block index in PAGE_SIZE units
@@ -822,7 +1450,7 @@ static void zram_bio_discard(struct zram *zram, u32 index,
 }
 
 static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
-			int offset, int rw)
+			int offset, int rw, struct bio *bio)
 {
 	unsigned long start_time = jiffies;
 	int ret;
@@ -832,7 +1460,7 @@ static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 
 	if (rw == READ) {
 		atomic64_inc(&zram->stats.num_reads);
-		ret = zram_bvec_read(zram, bvec, index, offset);
+		ret = zram_bvec_read(zram, bvec, index, offset, bio);
 	} else {
 		atomic64_inc(&zram->stats.num_writes);
 		ret = zram_bvec_write(zram, bvec, index, offset);
@@ -882,15 +1510,16 @@ static void __zram_make_request(struct zram *zram, struct bio *bio)
 			bv.bv_len = max_transfer_size;
 			bv.bv_offset = bvec.bv_offset;
 
-			if (zram_bvec_rw(zram, &bv, index, offset, rw) < 0)
+			if (zram_bvec_rw(zram, &bv, index, offset, rw, bio) < 0)
 				goto out;
 
 			bv.bv_len = bvec.bv_len - max_transfer_size;
 			bv.bv_offset += max_transfer_size;
-			if (zram_bvec_rw(zram, &bv, index + 1, 0, rw) < 0)
+			if (zram_bvec_rw(zram, &bv, index + 1, 0, rw, bio) < 0)
 				goto out;
 		} else
-			if (zram_bvec_rw(zram, &bvec, index, offset, rw) < 0)
+			if (zram_bvec_rw(zram, &bvec, index, offset, rw,
+					 bio) < 0)
 				goto out;
 
 		update_position(&index, &offset, &bvec);
@@ -971,7 +1600,7 @@ static int zram_rw_page(struct block_device *bdev, sector_t sector,
 	bv.bv_len = PAGE_SIZE;
 	bv.bv_offset = 0;
 
-	err = zram_bvec_rw(zram, &bv, index, offset, rw);
+	err = zram_bvec_rw(zram, &bv, index, offset, rw, NULL);
 put_zram:
 	zram_meta_put(zram);
 out:
@@ -988,23 +1617,378 @@ out:
 	return err;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Pages written to the backing device in one bio at most */
+#define WRITEBACK_BATCH_PAGES	32
+
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	ssize_t ret;
+	char *p;
+
+	down_read(&zram->init_lock);
+	if (!zram_wb_enabled(zram)) {
+		ret = scnprintf(buf, PAGE_SIZE, "none\n");
+		goto out;
+	}
+
+	p = file_path(zram->backing_dev, buf, PAGE_SIZE - 1);
+	if (IS_ERR(p)) {
+		ret = PTR_ERR(p);
+		goto out;
+	}
+
+	ret = strlen(p);
+	memmove(buf, p, ret);
+	buf[ret++] = '\n';
+out:
+	up_read(&zram->init_lock);
+	return ret;
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct file *backing_dev = NULL;
+	struct block_device *bdev = NULL;
+	struct inode *inode;
+	unsigned long nr_pages, *bitmap = NULL;
+	unsigned int old_block_size;
+	char *file_name;
+	size_t sz;
+	int err;
+
+	file_name = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!file_name)
+		return -ENOMEM;
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		pr_info("Can't setup backing device for initialized device\n");
+		err = -EBUSY;
+		goto out;
+	}
+
+	strlcpy(file_name, buf, PATH_MAX);
+	/* ignore trailing newline */
+	sz = strlen(file_name);
+	if (sz > 0 && file_name[sz - 1] == '\n')
+		file_name[sz - 1] = 0x00;
+
+	if (!strcmp(file_name, "none")) {
+		reset_bdev(zram);
+		goto done;
+	}
+
+	backing_dev = filp_open(file_name, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(backing_dev)) {
+		err = PTR_ERR(backing_dev);
+		backing_dev = NULL;
+		goto out;
+	}
+
+	inode = backing_dev->f_mapping->host;
+	if (!S_ISBLK(inode->i_mode)) {
+		err = -ENOTBLK;
+		goto out;
+	}
+
+	bdev = bdgrab(I_BDEV(inode));
+	err = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (err < 0) {
+		bdev = NULL;
+		goto out;
+	}
+
+	/* block 0 is never allocated, so a device needs at least two */
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	if (nr_pages < 2) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	old_block_size = block_size(bdev);
+	err = set_blocksize(bdev, PAGE_SIZE);
+	if (err)
+		goto out;
+
+	reset_bdev(zram);
+	zram->old_block_size = old_block_size;
+	zram->bdev = bdev;
+	zram->backing_dev = backing_dev;
+	zram->bitmap = bitmap;
+	zram->nr_pages = nr_pages;
+	pr_info("setup backing device %s\n", file_name);
+done:
+	up_write(&zram->init_lock);
+	kfree(file_name);
+	return len;
+out:
+	vfree(bitmap);
+	if (bdev)
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	if (backing_dev)
+		filp_close(backing_dev, NULL);
+	up_write(&zram->init_lock);
+	kfree(file_name);
+	return err;
+}
+
+/*
+ * Writing "all" marks every stored page idle. Any later access clears the
+ * mark, so a following "idle" writeback only picks pages that stayed cold.
+ */
+static ssize_t idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+	unsigned long nr_slots, index;
+
+	if (!sysfs_streq(buf, "all"))
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		up_read(&zram->init_lock);
+		return -EINVAL;
+	}
+
+	meta = zram->meta;
+	nr_slots = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_slots; index++) {
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		if (meta->table[index].handle &&
+		    !zram_test_flag(meta, index, ZRAM_SAME) &&
+		    !zram_test_flag(meta, index, ZRAM_WB))
+			zram_set_flag(meta, index, ZRAM_IDLE);
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		cond_resched();
+	}
+	up_read(&zram->init_lock);
+
+	return len;
+}
+
+/*
+ * Claim slot @index for writeback if it is stored in memory and carries
+ * @mode. A write or free of the slot clears ZRAM_UNDER_WB again, which
+ * tells zram_wb_commit() that the data on the device has become stale.
+ */
+static bool zram_wb_pick(struct zram *zram, u32 index,
+			 enum zram_pageflags mode)
+{
+	struct zram_meta *meta = zram->meta;
+	bool picked = false;
+
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	if (meta->table[index].handle &&
+	    !zram_test_flag(meta, index, ZRAM_SAME) &&
+	    !zram_test_flag(meta, index, ZRAM_WB) &&
+	    !zram_test_flag(meta, index, ZRAM_UNDER_WB) &&
+	    !zram_test_flag(meta, index, ZRAM_UNDER_RECOMP) &&
+	    zram_test_flag(meta, index, mode)) {
+		zram_set_flag(meta, index, ZRAM_UNDER_WB);
+		picked = true;
+	}
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+
+	return picked;
+}
+
+static void zram_wb_abort(struct zram *zram, u32 index)
+{
+	struct zram_meta *meta = zram->meta;
+
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+}
+
+static void zram_wb_commit(struct zram *zram, u32 index, unsigned long blk)
+{
+	struct zram_meta *meta = zram->meta;
+
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	if (!zram_test_flag(meta, index, ZRAM_UNDER_WB)) {
+		/* rewritten or freed while the bio was in flight */
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		free_blocks_bdev(zram, blk, 1);
+		return;
+	}
+
+	zram_free_page(zram, index);
+	zram_set_flag(meta, index, ZRAM_WB);
+	meta->table[index].handle = blk;
+	atomic64_inc(&zram->stats.pages_stored);
+	atomic64_inc(&zram->stats.bd_count);
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+}
+
+/*
+ * Write the @nr picked slots whose data is in @pages to the backing
+ * device, using one bio per contiguous run of free blocks.
+ */
+static int zram_writeback_batch(struct zram *zram, struct page **pages,
+				u32 *indices, unsigned int nr)
+{
+	unsigned int done = 0, count, i;
+	unsigned long blk;
+	struct bio *bio;
+	int err = 0;
+
+	while (done < nr) {
+		count = nr - done;
+		blk = alloc_blocks_bdev(zram, &count);
+		if (!blk) {
+			err = -ENOSPC;
+			break;
+		}
+
+		bio = zram_bdev_bio(zram, blk, count);
+		for (i = 0; i < count; i++) {
+			if (!bio_add_page(bio, pages[done + i], PAGE_SIZE, 0))
+				break;
+		}
+		if (i < count) {
+			/* the queue limits cut the run short */
+			free_blocks_bdev(zram, blk + i, count - i);
+			count = i;
+		}
+
+		err = submit_bio_wait(WRITE, bio);
+		bio_put(bio);
+		if (err) {
+			free_blocks_bdev(zram, blk, count);
+			break;
+		}
+
+		for (i = 0; i < count; i++)
+			zram_wb_commit(zram, indices[done + i], blk + i);
+		atomic64_add(count, &zram->stats.bd_writes);
+		done += count;
+	}
+
+	for (; done < nr; done++)
+		zram_wb_abort(zram, indices[done]);
+	return err;
+}
+
+/*
+ * Writing "huge" writes back all pages that were stored uncompressed,
+ * "idle" all pages not accessed since they were last marked idle.
+ */
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct page *pages[WRITEBACK_BATCH_PAGES] = { NULL };
+	u32 indices[WRITEBACK_BATCH_PAGES];
+	unsigned long nr_slots, index;
+	enum zram_pageflags mode;
+	unsigned int nr = 0, i;
+	ssize_t ret = len;
+	int err;
+
+	if (sysfs_streq(buf, "idle"))
+		mode = ZRAM_IDLE;
+	else if (sysfs_streq(buf, "huge"))
+		mode = ZRAM_HUGE;
+	else
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+	if (!zram_wb_enabled(zram)) {
+		ret = -ENODEV;
+		goto out_unlock;
+	}
+
+	for (i = 0; i < WRITEBACK_BATCH_PAGES; i++) {
+		pages[i] = alloc_page(GFP_KERNEL);
+		if (!pages[i]) {
+			ret = -ENOMEM;
+			goto out_free;
+		}
+	}
+
+	mutex_lock(&zram->writeback_lock);
+	nr_slots = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_slots; index++) {
+		if (!zram_wb_pick(zram, index, mode))
+			continue;
+
+		if (zram_decompress_page(zram, page_address(pages[nr]),
+					 index)) {
+			zram_wb_abort(zram, index);
+			continue;
+		}
+
+		indices[nr++] = index;
+		if (nr < WRITEBACK_BATCH_PAGES)
+			continue;
+
+		err = zram_writeback_batch(zram, pages, indices, nr);
+		nr = 0;
+		if (err) {
+			ret = err;
+			break;
+		}
+		cond_resched();
+	}
+	if (nr) {
+		err = zram_writeback_batch(zram, pages, indices, nr);
+		if (err)
+			ret = err;
+	}
+	mutex_unlock(&zram->writeback_lock);
+
+out_free:
+	for (i = 0; i < WRITEBACK_BATCH_PAGES && pages[i]; i++)
+		__free_page(pages[i]);
+out_unlock:
+	up_read(&zram->init_lock);
+	return ret;
+}
+#endif
+
 static void zram_reset_device(struct zram *zram)
 {
 	struct zram_meta *meta;
-	struct zcomp *comp;
+	struct zcomp *comp, *recomp;
 	u64 disksize;
 
+	/* a recompression pass holds init_lock, stop it first */
+	WRITE_ONCE(zram->recomp_abort, true);
+	cancel_work_sync(&zram->recomp_work);
+	WRITE_ONCE(zram->recomp_abort, false);
+
 	down_write(&zram->init_lock);
 
 	zram->limit_pages = 0;
 
 	if (!init_done(zram)) {
+		reset_bdev(zram);
 		up_write(&zram->init_lock);
 		return;
 	}
 
 	meta = zram->meta;
 	comp = zram->comp;
+	recomp = zram->recomp;
+	zram->recomp = NULL;
 	disksize = zram->disksize;
 	/*
 	 * Refcount will go down to 0 eventually and r/w handler
@@ -1021,22 +2005,25 @@ static void zram_reset_device(struct zram *zram)
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 	zram->disksize = 0;
-	zram->max_comp_streams = 1;
+	zram->max_comp_streams = num_possible_cpus();
 
 	set_capacity(zram->disk, 0);
 	part_stat_set_all(&zram->disk->part0, 0);
 
+	reset_bdev(zram);
 	up_write(&zram->init_lock);
 	/* I/O operation under all of CPU are done so let's free */
 	zram_meta_free(meta, disksize);
 	zcomp_destroy(comp);
+	if (recomp)
+		zcomp_destroy(recomp);
 }
 
 static ssize_t disksize_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t len)
 {
 	u64 disksize;
-	struct zcomp *comp;
+	struct zcomp *comp, *recomp = NULL;
 	struct zram_meta *meta;
 	struct zram *zram = dev_to_zram(dev);
 	int err;
@@ -1046,7 +2033,8 @@ static ssize_t disksize_store(struct device *dev,
 		return -EINVAL;
 
 	disksize = PAGE_ALIGN(disksize);
-	meta = zram_meta_alloc(zram->disk->disk_name, disksize);
+	meta = zram_meta_alloc(zram->disk->disk_name, disksize,
+			       zram_use_dedup(zram));
 	if (!meta)
 		return -ENOMEM;
 
@@ -1058,6 +2046,17 @@ static ssize_t disksize_store(struct device *dev,
 		goto out_free_meta;
 	}
 
+	/* recompression runs in one worker, a single stream will do */
+	if (zram->recomp_algorithm[0]) {
+		recomp = zcomp_create(zram->recomp_algorithm, 1);
+		if (IS_ERR(recomp)) {
+			pr_err("Cannot initialise %s compressing backend\n",
+					zram->recomp_algorithm);
+			err = PTR_ERR(recomp);
+			goto out_destroy_comp_unlocked;
+		}
+	}
+
 	down_write(&zram->init_lock);
 	if (init_done(zram)) {
 		pr_info("Cannot change disksize for initialized device\n");
@@ -1069,6 +2068,7 @@ static ssize_t disksize_store(struct device *dev,
 	atomic_set(&zram->refcount, 1);
 	zram->meta = meta;
 	zram->comp = comp;
+	zram->recomp = recomp;
 	zram->disksize = disksize;
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 	up_write(&zram->init_lock);
@@ -1084,6 +2084,9 @@ static ssize_t disksize_store(struct device *dev,
 
 out_destroy_comp:
 	up_write(&zram->init_lock);
+	if (recomp)
+		zcomp_destroy(recomp);
+out_destroy_comp_unlocked:
 	zcomp_destroy(comp);
 out_free_meta:
 	zram_meta_free(meta, disksize);
@@ -1167,6 +2170,16 @@ static DEVICE_ATTR_RW(mem_limit);
 static DEVICE_ATTR_RW(mem_used_max);
 static DEVICE_ATTR_RW(max_comp_streams);
 static DEVICE_ATTR_RW(comp_algorithm);
+static DEVICE_ATTR_RW(recomp_algorithm);
+static DEVICE_ATTR_WO(recompress);
+#ifdef CONFIG_ZRAM_DEDUP
+static DEVICE_ATTR_RW(use_dedup);
+#endif
+#ifdef CONFIG_ZRAM_WRITEBACK
+static DEVICE_ATTR_RW(backing_dev);
+static DEVICE_ATTR_WO(idle);
+static DEVICE_ATTR_WO(writeback);
+#endif
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
@@ -1187,6 +2200,16 @@ static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_mem_used_max.attr,
 	&dev_attr_max_comp_streams.attr,
 	&dev_attr_comp_algorithm.attr,
+	&dev_attr_recomp_algorithm.attr,
+	&dev_attr_recompress.attr,
+#ifdef CONFIG_ZRAM_DEDUP
+	&dev_attr_use_dedup.attr,
+#endif
+#ifdef CONFIG_ZRAM_WRITEBACK
+	&dev_attr_backing_dev.attr,
+	&dev_attr_idle.attr,
+	&dev_attr_writeback.attr,
+#endif
 	&dev_attr_io_stat.attr,
 	&dev_attr_mm_stat.attr,
 	NULL,
@@ -1216,6 +2239,11 @@ static int zram_add(void)
 	device_id = ret;
 
 	init_rwsem(&zram->init_lock);
+	INIT_WORK(&zram->recomp_work, zram_recompress_work);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	spin_lock_init(&zram->bitmap_lock);
+	mutex_init(&zram->writeback_lock);
+#endif
 
 	queue = blk_alloc_queue(GFP_KERNEL);
 	if (!queue) {
@@ -1286,7 +2314,7 @@ static int zram_add(void)
 	}
 	strlcpy(zram->compressor, default_compressor, sizeof(zram->compressor));
 	zram->meta = NULL;
-	zram->max_comp_streams = 4;
+	zram->max_comp_streams = num_possible_cpus();
 
 	pr_info("Added device: %s\n", zram->disk->disk_name);
 	return device_id;
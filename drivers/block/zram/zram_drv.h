@@ -16,6 +16,7 @@
 #define _ZRAM_DRV_H_
 
 #include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <linux/zsmalloc.h>
 
 #include "zcomp.h"
@@ -53,15 +54,23 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
  * zram is mainly used for memory efficiency so we want to keep memory
  * footprint small so we can squeeze size and flags into a field.
  * The lower ZRAM_FLAG_SHIFT bits is for object size (excluding header),
- * the higher bits is for zram_pageflags.
+ * the higher bits is for zram_pageflags. An object is at most PAGE_SIZE
+ * bytes, so PAGE_SHIFT + 1 bits hold its size.
  */
-#define ZRAM_FLAG_SHIFT 24
+#define ZRAM_FLAG_SHIFT (PAGE_SHIFT + 1)
 
 /* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO = ZRAM_FLAG_SHIFT,
+	/* Page is filled with one repeated word, kept in table.element */
+	ZRAM_SAME = ZRAM_FLAG_SHIFT,
 	ZRAM_ACCESS,	/* page is now accessed */
+	ZRAM_HUGE,	/* page is stored uncompressed */
+	ZRAM_IDLE,	/* page was not accessed since it was marked idle */
+	ZRAM_UNDER_WB,	/* page is being written to the backing device */
+	ZRAM_WB,	/* page is on the backing device, handle is its block */
+	ZRAM_RECOMP,	/* page is compressed with the secondary algorithm */
+	ZRAM_UNDER_RECOMP,	/* page is being recompressed */
+	ZRAM_DEDUP,	/* handle points to a shared zram_dedup_entry */
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -70,7 +79,15 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct zram_table_entry {
-	unsigned long handle;
+	union {
+		/*
+		 * zsmalloc handle, backing device block if ZRAM_WB is set,
+		 * or struct zram_dedup_entry pointer if ZRAM_DEDUP is set
+		 */
+		unsigned long handle;
+		/* fill word if ZRAM_SAME is set */
+		unsigned long element;
+	};
 	unsigned long value;
 };
 
@@ -82,14 +99,27 @@ struct zram_stats {
 	atomic64_t failed_writes;	/* can happen when memory is too low */
 	atomic64_t invalid_io;	/* non-page-aligned I/O requests */
 	atomic64_t notify_free;	/* no. of swap slot free notifications */
-	atomic64_t zero_pages;		/* no. of zero filled pages */
+	atomic64_t same_pages;		/* no. of same element filled pages */
 	atomic64_t pages_stored;	/* no. of pages currently stored */
 	atomic_long_t max_used_pages;	/* no. of maximum pages stored */
+	atomic64_t writestall;	/* no. of writes that had to drop the stream */
+	atomic64_t huge_pages;	/* no. of pages stored uncompressed */
+	atomic64_t bd_count;	/* no. of pages on the backing device */
+	atomic64_t bd_reads;	/* no. of reads from the backing device */
+	atomic64_t bd_writes;	/* no. of pages written back */
+	atomic64_t recomp_pages;	/* no. of pages stored by secondary algorithm */
+	atomic64_t dup_data_size;	/* compressed bytes saved by dedup */
+	atomic64_t meta_data_size;	/* size of dedup entries */
 };
 
 struct zram_meta {
 	struct zram_table_entry *table;
 	struct zs_pool *mem_pool;
+#ifdef CONFIG_ZRAM_DEDUP
+	/* content hash of compressed objects, NULL if dedup is off */
+	struct zram_dedup_bucket *dedup_table;
+	unsigned int dedup_bits;
+#endif
 };
 
 struct zram {
@@ -114,9 +144,35 @@ struct zram {
 	 */
 	u64 disksize;	/* bytes */
 	char compressor[10];
+	/*
+	 * Optional secondary algorithm, set before disksize. Pages chosen by
+	 * a write to the recompress attribute are compressed again with it
+	 * in the background by recomp_work.
+	 */
+	struct zcomp *recomp;
+	char recomp_algorithm[10];
+	struct work_struct recomp_work;
+	enum zram_pageflags recomp_mode;
+	bool recomp_abort;
+#ifdef CONFIG_ZRAM_DEDUP
+	/* share identical objects, set before disksize */
+	bool use_dedup;
+#endif
 	/*
 	 * zram is claimed so open request will be failed
 	 */
 	bool claim; /* Protected by bdev->bd_mutex */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* set before disksize, protected by init_lock */
+	struct file *backing_dev;
+	struct block_device *bdev;
+	unsigned int old_block_size;
+	/* one bit per backing device block, block 0 is never used */
+	unsigned long *bitmap;
+	unsigned long nr_pages;
+	spinlock_t bitmap_lock;
+	/* serializes writeback runs */
+	struct mutex writeback_lock;
+#endif
 };
 #endif
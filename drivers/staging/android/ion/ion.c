@@ -32,6 +32,7 @@
 #include <linux/rbtree.h>
 #include <linux/slab.h>
 #include <linux/seq_file.h>
+#include <linux/sizes.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
 #include <linux/debugfs.h>
@@ -1179,21 +1180,81 @@ static void ion_buffer_sync_for_device(struct ion_buffer *buffer,
 	mutex_unlock(&buffer->lock);
 }
 
+/*
+ * A fault maps the whole physically contiguous run of the buffer around
+ * the faulting page, up to this many pages, so that buffers made of
+ * high-order chunks are faulted in one chunk at a time rather than page by
+ * page. Every page mapped is marked dirty, so a bigger window also means
+ * more to sync on the next ion_buffer_sync_for_device(). The window covers
+ * the largest chunk the system heap hands out.
+ */
+#define ION_FAULT_AROUND_PAGES	(SZ_2M >> PAGE_SHIFT)
+
+static unsigned long ion_buffer_pfn(struct ion_buffer *buffer, pgoff_t pgoff)
+{
+	return page_to_pfn(ion_buffer_page(buffer->pages[pgoff]));
+}
+
+/* Whether the page after @pgoff directly follows it in memory */
+static bool ion_buffer_contig(struct ion_buffer *buffer, pgoff_t pgoff)
+{
+	return ion_buffer_pfn(buffer, pgoff + 1) ==
+		ion_buffer_pfn(buffer, pgoff) + 1;
+}
+
+static int ion_vm_insert(struct vm_area_struct *vma,
+			 struct ion_buffer *buffer, pgoff_t pgoff)
+{
+	unsigned long addr;
+	int ret;
+
+	addr = vma->vm_start + ((pgoff - vma->vm_pgoff) << PAGE_SHIFT);
+	ion_buffer_page_dirty(buffer->pages + pgoff);
+	ret = vm_insert_pfn(vma, addr, ion_buffer_pfn(buffer, pgoff));
+
+	/* already mapped by a concurrent fault */
+	return ret == -EBUSY ? 0 : ret;
+}
+
 static int ion_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
 	struct ion_buffer *buffer = vma->vm_private_data;
-	unsigned long pfn;
+	pgoff_t pgoff = vmf->pgoff;
+	pgoff_t first, last, start, end;
 	int ret;
 
+	/* the window, clipped to the vma and the buffer */
+	first = round_down(pgoff, ION_FAULT_AROUND_PAGES);
+	last = first + ION_FAULT_AROUND_PAGES;
+	first = max_t(pgoff_t, first, vma->vm_pgoff);
+	last = min_t(pgoff_t, last, vma->vm_pgoff + vma_pages(vma));
+	last = min_t(pgoff_t, last, PAGE_ALIGN(buffer->size) >> PAGE_SHIFT);
+
 	mutex_lock(&buffer->lock);
-	ion_buffer_page_dirty(buffer->pages + vmf->pgoff);
-	BUG_ON(!buffer->pages || !buffer->pages[vmf->pgoff]);
+	BUG_ON(!buffer->pages || !buffer->pages[pgoff]);
 
-	pfn = page_to_pfn(ion_buffer_page(buffer->pages[vmf->pgoff]));
-	ret = vm_insert_pfn(vma, (unsigned long)vmf->virtual_address, pfn);
-	mutex_unlock(&buffer->lock);
-	if (ret)
+	ret = ion_vm_insert(vma, buffer, pgoff);
+	if (ret) {
+		mutex_unlock(&buffer->lock);
 		return VM_FAULT_ERROR;
+	}
+
+	/* the contiguous run of the window the faulting page belongs to */
+	for (start = pgoff; start > first; start--)
+		if (!ion_buffer_contig(buffer, start - 1))
+			break;
+	for (end = pgoff + 1; end < last; end++)
+		if (!ion_buffer_contig(buffer, end - 1))
+			break;
+
+	/* the rest is opportunistic, a failure is left to a later fault */
+	for (; start < end; start++) {
+		if (start == pgoff)
+			continue;
+		if (ion_vm_insert(vma, buffer, start))
+			break;
+	}
+	mutex_unlock(&buffer->lock);
 
 	return VM_FAULT_NOPAGE;
 }
@@ -1295,6 +1356,134 @@ static void ion_dma_buf_kunmap(struct dma_buf *dmabuf, unsigned long offset,
 {
 }
 
+/*
+ * Cache maintenance for @size bytes at @offset into the physically
+ * contiguous pages starting at @page.
+ */
+static void ion_pages_sync_range(struct page *page, size_t offset,
+				 size_t size, enum dma_data_direction dir,
+				 bool for_cpu)
+{
+	struct scatterlist sg;
+
+	sg_init_table(&sg, 1);
+	sg_set_page(&sg, nth_page(page, offset >> PAGE_SHIFT), size,
+		    offset & ~PAGE_MASK);
+	/* see ion_pages_sync_for_device() */
+	sg_dma_address(&sg) = sg_phys(&sg);
+	if (for_cpu)
+		dma_sync_sg_for_cpu(NULL, &sg, 1, dir);
+	else
+		dma_sync_sg_for_device(NULL, &sg, 1, dir);
+}
+
+/* Syncs [offset, offset + len) of @buffer, one call per chunk */
+static void ion_buffer_sync_range(struct ion_buffer *buffer, size_t offset,
+				  size_t len, enum dma_data_direction dir,
+				  bool for_cpu)
+{
+	struct sg_table *table = buffer->sg_table;
+	struct scatterlist *sg;
+	size_t pos = 0, end = offset + len;
+	size_t first, last;
+	int i;
+
+	for_each_sg(table->sgl, sg, table->nents, i) {
+		if (pos >= end)
+			break;
+		if (pos + sg->length > offset) {
+			first = max(pos, offset) - pos;
+			last = min_t(size_t, pos + sg->length, end) - pos;
+			ion_pages_sync_range(sg_page(sg), sg->offset + first,
+					     last - first, dir, for_cpu);
+		}
+		pos += sg->length;
+	}
+}
+
+/* Unmaps pages [first, last) of @buffer from all its user mappings */
+static void ion_buffer_zap_range(struct ion_buffer *buffer, pgoff_t first,
+				 pgoff_t last)
+{
+	struct ion_vma_list *vma_list;
+
+	list_for_each_entry(vma_list, &buffer->vmas, list) {
+		struct vm_area_struct *vma = vma_list->vma;
+		pgoff_t start = max_t(pgoff_t, first, vma->vm_pgoff);
+		pgoff_t end = min_t(pgoff_t, last,
+				    vma->vm_pgoff + vma_pages(vma));
+
+		if (start >= end)
+			continue;
+		zap_page_range(vma, vma->vm_start +
+			       ((start - vma->vm_pgoff) << PAGE_SHIFT),
+			       (end - start) << PAGE_SHIFT, NULL);
+	}
+}
+
+/*
+ * Syncs the pages in [offset, offset + len) of a buffer with faulted user
+ * mappings for the device, skipping those that were not written through a
+ * user mapping since they were last synced. The pages are unmapped first,
+ * under buffer->lock like the fault handler, so that a write coming after
+ * the sync faults and marks its page dirty again.
+ */
+static void ion_buffer_sync_dirty_range(struct ion_buffer *buffer,
+					size_t offset, size_t len,
+					enum dma_data_direction dir)
+{
+	pgoff_t first = offset >> PAGE_SHIFT;
+	pgoff_t last = PAGE_ALIGN(offset + len) >> PAGE_SHIFT;
+	pgoff_t pgoff, end;
+
+	mutex_lock(&buffer->lock);
+	ion_buffer_zap_range(buffer, first, last);
+	for (pgoff = first; pgoff < last; pgoff = end) {
+		end = pgoff + 1;
+		if (!ion_buffer_page_is_dirty(buffer->pages[pgoff]))
+			continue;
+		/* one call for each physically contiguous run of dirty pages */
+		while (end < last &&
+		       ion_buffer_page_is_dirty(buffer->pages[end]) &&
+		       ion_buffer_contig(buffer, end - 1))
+			end++;
+		ion_pages_sync_range(ion_buffer_page(buffer->pages[pgoff]), 0,
+				     (end - pgoff) << PAGE_SHIFT, dir, false);
+		while (pgoff < end)
+			ion_buffer_page_clean(buffer->pages + pgoff++);
+	}
+	mutex_unlock(&buffer->lock);
+}
+
+/*
+ * Syncs a range of the buffer userspace accessed. Writes through faulted
+ * user mappings are tracked, so only the pages written need cleaning.
+ */
+static void ion_buffer_sync_user_range(struct ion_buffer *buffer,
+				       size_t offset, size_t len,
+				       enum dma_data_direction dir,
+				       bool for_cpu)
+{
+	if (!for_cpu && ion_buffer_fault_user_mappings(buffer))
+		ion_buffer_sync_dirty_range(buffer, offset, len, dir);
+	else
+		ion_buffer_sync_range(buffer, offset, len, dir, for_cpu);
+}
+
+/* Syncs a range of the buffer accessed through its kernel mapping */
+static void ion_buffer_sync_kernel_range(struct ion_buffer *buffer,
+					 size_t start, size_t len,
+					 enum dma_data_direction dir,
+					 bool for_cpu)
+{
+	if (!ion_buffer_cached(buffer) || (buffer->flags & ION_FLAG_SECURE) ||
+	    start >= buffer->size)
+		return;
+
+	ion_buffer_sync_range(buffer, start, min(len, buffer->size - start),
+			      dir, for_cpu);
+}
+
 static int ion_dma_buf_begin_cpu_access(struct dma_buf *dmabuf, size_t start,
 					size_t len,
 					enum dma_data_direction direction)
@@ -1311,7 +1500,11 @@ static int ion_dma_buf_begin_cpu_access(struct dma_buf *dmabuf, size_t start,
 	mutex_lock(&buffer->lock);
 	vaddr = ion_buffer_kmap_get(buffer);
 	mutex_unlock(&buffer->lock);
-	return PTR_ERR_OR_ZERO(vaddr);
+	if (IS_ERR(vaddr))
+		return PTR_ERR(vaddr);
+
+	ion_buffer_sync_kernel_range(buffer, start, len, direction, true);
+	return 0;
 }
 
 static void ion_dma_buf_end_cpu_access(struct dma_buf *dmabuf, size_t start,
@@ -1320,6 +1513,8 @@ static void ion_dma_buf_end_cpu_access(struct dma_buf *dmabuf, size_t start,
 {
 	struct ion_buffer *buffer = dmabuf->priv;
 
+	ion_buffer_sync_kernel_range(buffer, start, len, direction, false);
+
 	mutex_lock(&buffer->lock);
 	ion_buffer_kmap_put(buffer);
 	mutex_unlock(&buffer->lock);
@@ -1436,30 +1631,91 @@ end:
 }
 EXPORT_SYMBOL(ion_import_dma_buf);
 
-static int ion_sync_for_device(struct ion_client *client, int fd)
+static struct dma_buf *ion_sync_dma_buf_get(int fd)
 {
 	struct dma_buf *dmabuf;
-	struct ion_buffer *buffer;
 
 	dmabuf = dma_buf_get(fd);
 	if (IS_ERR(dmabuf))
-		return PTR_ERR(dmabuf);
+		return dmabuf;
 
 	/* if this memory came from ion */
 	if (dmabuf->ops != &dma_buf_ops) {
 		pr_err("%s: can not sync dmabuf from another exporter\n",
 		       __func__);
 		dma_buf_put(dmabuf);
-		return -EINVAL;
+		return ERR_PTR(-EINVAL);
 	}
+	return dmabuf;
+}
+
+static int ion_sync_for_device(struct ion_client *client, int fd)
+{
+	struct dma_buf *dmabuf;
+	struct ion_buffer *buffer;
+
+	dmabuf = ion_sync_dma_buf_get(fd);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
 	buffer = dmabuf->priv;
 
-	dma_sync_sg_for_device(NULL, buffer->sg_table->sgl,
-			       buffer->sg_table->nents, DMA_BIDIRECTIONAL);
+	ion_buffer_sync_user_range(buffer, 0, buffer->size, DMA_BIDIRECTIONAL,
+				   false);
 	dma_buf_put(dmabuf);
 	return 0;
 }
 
+static int ion_sync_ranges(struct ion_client *client,
+			   struct ion_sync_ranges_data *data)
+{
+	struct ion_sync_range __user *uranges;
+	struct ion_sync_range ranges[16];
+	struct dma_buf *dmabuf;
+	struct ion_buffer *buffer;
+	bool for_cpu = data->flags == ION_SYNC_FOR_CPU;
+	enum dma_data_direction dir;
+	u32 done, i, n;
+	int ret = 0;
+
+	if (data->flags > ION_SYNC_FOR_CPU || data->reserved ||
+	    !data->nr_ranges || data->nr_ranges > ION_SYNC_MAX_RANGES)
+		return -EINVAL;
+
+	dmabuf = ion_sync_dma_buf_get(data->fd);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+	buffer = dmabuf->priv;
+
+	if (!ion_buffer_cached(buffer) || (buffer->flags & ION_FLAG_SECURE))
+		goto out;
+
+	dir = for_cpu ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+	uranges = (struct ion_sync_range __user *)(unsigned long)data->ranges;
+	for (done = 0; done < data->nr_ranges; done += n) {
+		n = min_t(u32, data->nr_ranges - done, ARRAY_SIZE(ranges));
+		if (copy_from_user(ranges, uranges + done,
+				   n * sizeof(*ranges))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		for (i = 0; i < n; i++) {
+			if (ranges[i].offset > buffer->size ||
+			    ranges[i].len > buffer->size - ranges[i].offset) {
+				ret = -EINVAL;
+				goto out;
+			}
+			if (ranges[i].len)
+				ion_buffer_sync_user_range(buffer,
+							   ranges[i].offset,
+							   ranges[i].len, dir,
+							   for_cpu);
+		}
+	}
+out:
+	dma_buf_put(dmabuf);
+	return ret;
+}
+
 /* fix up the cases where the ioctl direction bits are incorrect */
 static unsigned int ion_ioctl_dir(unsigned int cmd)
 {
@@ -1486,6 +1742,7 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		struct ion_allocation_data allocation;
 		struct ion_handle_data handle;
 		struct ion_custom_data custom;
+		struct ion_sync_ranges_data sync_ranges;
 	} data;
 
 	dir = ion_ioctl_dir(cmd);
@@ -1559,6 +1816,11 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		ret = ion_sync_for_device(client, data.fd.fd);
 		break;
 	}
+	case ION_IOC_SYNC_RANGES:
+	{
+		ret = ion_sync_ranges(client, &data.sync_ranges);
+		break;
+	}
 	case ION_IOC_CUSTOM:
 	{
 		if (!dev->custom_ioctl)
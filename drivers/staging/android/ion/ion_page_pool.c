@@ -20,11 +20,21 @@
 #include <linux/fs.h>
 #include <linux/list.h>
 #include <linux/init.h>
+#include <linux/percpu.h>
+#include <linux/sizes.h>
 #include <linux/slab.h>
 #include <linux/swap.h>
 #include <linux/vmalloc.h>
 #include "ion_priv.h"
 
+/*
+ * A magazine holds up to this much memory, and at least one and at most
+ * ION_PAGE_POOL_MAG_MAX pages, so the magazines of the large orders only
+ * keep a page or two per cpu.
+ */
+#define ION_PAGE_POOL_MAG_BYTES	SZ_256K
+#define ION_PAGE_POOL_MAG_MAX	32
+
 static void *ion_page_pool_alloc_pages(struct ion_page_pool *pool)
 {
 	struct page *page;
@@ -56,9 +66,9 @@ static void ion_page_pool_free_pages(struct ion_page_pool *pool,
 	__free_pages(page, pool->order);
 }
 
-static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
+/* Called with pool->mutex held */
+static void ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
 {
-	mutex_lock(&pool->mutex);
 	if (PageHighMem(page)) {
 		list_add_tail(&page->lru, &pool->high_items);
 		pool->high_count++;
@@ -66,8 +76,17 @@ static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
 		list_add_tail(&page->lru, &pool->low_items);
 		pool->low_count++;
 	}
+}
+
+static void ion_page_pool_add_list(struct ion_page_pool *pool,
+				   struct list_head *pages)
+{
+	struct page *page, *tmp;
+
+	mutex_lock(&pool->mutex);
+	list_for_each_entry_safe(page, tmp, pages, lru)
+		ion_page_pool_add(pool, page);
 	mutex_unlock(&pool->mutex);
-	return 0;
 }
 
 static struct page *ion_page_pool_remove(struct ion_page_pool *pool, bool high)
@@ -88,22 +107,103 @@ static struct page *ion_page_pool_remove(struct ion_page_pool *pool, bool high)
 	return page;
 }
 
-void *ion_page_pool_alloc(struct ion_page_pool *pool, bool *from_pool)
+static struct page *ion_page_pool_mag_pop(struct ion_page_pool *pool)
 {
+	struct ion_page_pool_mag *mag = raw_cpu_ptr(pool->mags);
 	struct page *page = NULL;
 
-	BUG_ON(!pool);
+	spin_lock(&mag->lock);
+	if (mag->count) {
+		page = list_first_entry(&mag->items, struct page, lru);
+		list_del(&page->lru);
+		mag->count--;
+		mag->hits++;
+	}
+	spin_unlock(&mag->lock);
 
-	*from_pool = true;
+	return page;
+}
 
-	if (mutex_trylock(&pool->mutex)) {
+/*
+ * Takes a batch of pages from the pool, returns one of them and puts the
+ * rest in the magazine. Like a single page allocation, it gives up rather
+ * than wait for the mutex.
+ */
+static struct page *ion_page_pool_mag_refill(struct ion_page_pool *pool)
+{
+	struct ion_page_pool_mag *mag;
+	struct page *page = NULL;
+	LIST_HEAD(pages);
+	int n = 0;
+
+	if (!mutex_trylock(&pool->mutex))
+		return NULL;
+	while (n < pool->mag_batch + 1) {
 		if (pool->high_count)
 			page = ion_page_pool_remove(pool, true);
 		else if (pool->low_count)
 			page = ion_page_pool_remove(pool, false);
-		mutex_unlock(&pool->mutex);
+		else
+			break;
+		list_add_tail(&page->lru, &pages);
+		n++;
 	}
+	mutex_unlock(&pool->mutex);
+
+	if (!n)
+		return NULL;
+
+	page = list_first_entry(&pages, struct page, lru);
+	list_del(&page->lru);
+
+	mag = raw_cpu_ptr(pool->mags);
+	spin_lock(&mag->lock);
+	list_splice(&pages, &mag->items);
+	mag->count += n - 1;
+	mag->pool_hits++;
+	if (n > 1)
+		mag->refills++;
+	spin_unlock(&mag->lock);
+
+	return page;
+}
+
+static void ion_page_pool_mag_push(struct ion_page_pool *pool,
+				   struct page *page)
+{
+	struct ion_page_pool_mag *mag = raw_cpu_ptr(pool->mags);
+	LIST_HEAD(pages);
+	int n;
+
+	spin_lock(&mag->lock);
+	list_add(&page->lru, &mag->items);
+	mag->count++;
+	if (mag->count > pool->mag_size) {
+		/* hand the coldest pages back */
+		for (n = 0; n < pool->mag_batch; n++)
+			list_move(mag->items.prev, &pages);
+		mag->count -= pool->mag_batch;
+		mag->drains++;
+	}
+	spin_unlock(&mag->lock);
+
+	if (!list_empty(&pages))
+		ion_page_pool_add_list(pool, &pages);
+}
+
+void *ion_page_pool_alloc(struct ion_page_pool *pool, bool *from_pool)
+{
+	struct page *page;
+
+	BUG_ON(!pool);
+
+	*from_pool = true;
+
+	page = ion_page_pool_mag_pop(pool);
+	if (!page)
+		page = ion_page_pool_mag_refill(pool);
 	if (!page) {
+		this_cpu_inc(pool->mags->misses);
 		page = ion_page_pool_alloc_pages(pool);
 		*from_pool = false;
 	}
@@ -119,6 +219,10 @@ void *ion_page_pool_alloc_pool_only(struct ion_page_pool *pool)
 
 	BUG_ON(!pool);
 
+	page = ion_page_pool_mag_pop(pool);
+	if (page)
+		return page;
+
 	if (mutex_trylock(&pool->mutex)) {
 		if (pool->high_count)
 			page = ion_page_pool_remove(pool, true);
@@ -132,11 +236,7 @@ void *ion_page_pool_alloc_pool_only(struct ion_page_pool *pool)
 
 void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
 {
-	int ret;
-
-	ret = ion_page_pool_add(pool, page);
-	if (ret)
-		ion_page_pool_free_pages(pool, page);
+	ion_page_pool_mag_push(pool, page);
 }
 
 void ion_page_pool_free_immediate(struct ion_page_pool *pool, struct page *page)
@@ -144,12 +244,82 @@ void ion_page_pool_free_immediate(struct ion_page_pool *pool, struct page *page)
 	ion_page_pool_free_pages(pool, page);
 }
 
+/*
+ * Allocates a page from the page allocator with the pool's own flags,
+ * zeroes it and adds it to the pool's lists, so that an allocation coming
+ * later is served without going to the page allocator or clearing memory.
+ * Returns false if no page was available.
+ */
+bool ion_page_pool_fill(struct ion_page_pool *pool)
+{
+	struct page *page;
+
+	page = ion_page_pool_alloc_pages(pool);
+	if (!page)
+		return false;
+
+	if (!(pool->gfp_mask & __GFP_ZERO) &&
+	    msm_ion_heap_high_order_page_zero(pool->dev, page, pool->order)) {
+		ion_page_pool_free_pages(pool, page);
+		return false;
+	}
+
+	mutex_lock(&pool->mutex);
+	ion_page_pool_add(pool, page);
+	mutex_unlock(&pool->mutex);
+	return true;
+}
+
+/* Moves the pages of all magazines back to the pool's lists */
+void ion_page_pool_drain_mags(struct ion_page_pool *pool)
+{
+	struct ion_page_pool_mag *mag;
+	LIST_HEAD(pages);
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		mag = per_cpu_ptr(pool->mags, cpu);
+		spin_lock(&mag->lock);
+		if (mag->count) {
+			list_splice_init(&mag->items, &pages);
+			mag->count = 0;
+			mag->drains++;
+		}
+		spin_unlock(&mag->lock);
+	}
+
+	if (!list_empty(&pages))
+		ion_page_pool_add_list(pool, &pages);
+}
+
+void ion_page_pool_stats(struct ion_page_pool *pool,
+			 struct ion_page_pool_stats *stats)
+{
+	struct ion_page_pool_mag *mag;
+	int cpu;
+
+	memset(stats, 0, sizeof(*stats));
+	for_each_possible_cpu(cpu) {
+		mag = per_cpu_ptr(pool->mags, cpu);
+		stats->count += READ_ONCE(mag->count);
+		stats->hits += mag->hits;
+		stats->pool_hits += mag->pool_hits;
+		stats->misses += mag->misses;
+		stats->refills += mag->refills;
+		stats->drains += mag->drains;
+	}
+}
+
+/* Magazines are not told apart by highmem, they count either way */
 int ion_page_pool_total(struct ion_page_pool *pool, bool high)
 {
 	int count = pool->low_count;
+	int cpu;
 
 	if (high)
 		count += pool->high_count;
+	for_each_possible_cpu(cpu)
+		count += READ_ONCE(per_cpu_ptr(pool->mags, cpu)->count);
 
 	return count << pool->order;
 }
@@ -168,6 +338,7 @@ int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
 	if (nr_to_scan == 0)
 		return ion_page_pool_total(pool, high);
 
+	ion_page_pool_drain_mags(pool);
 	while (freed < nr_to_scan) {
 		struct page *page;
 
@@ -193,8 +364,25 @@ struct ion_page_pool *ion_page_pool_create(struct device *dev, gfp_t gfp_mask,
 {
 	struct ion_page_pool *pool = kmalloc(sizeof(struct ion_page_pool),
 					     GFP_KERNEL);
+	int cpu;
+
 	if (!pool)
 		return NULL;
+	pool->mags = alloc_percpu(struct ion_page_pool_mag);
+	if (!pool->mags) {
+		kfree(pool);
+		return NULL;
+	}
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_mag *mag = per_cpu_ptr(pool->mags, cpu);
+
+		spin_lock_init(&mag->lock);
+		INIT_LIST_HEAD(&mag->items);
+	}
+	pool->mag_size = clamp_t(int, ION_PAGE_POOL_MAG_BYTES >>
+				 (PAGE_SHIFT + order), 1,
+				 ION_PAGE_POOL_MAG_MAX);
+	pool->mag_batch = max(pool->mag_size / 2, 1);
 	pool->dev = dev;
 	pool->high_count = 0;
 	pool->low_count = 0;
@@ -210,6 +398,20 @@ struct ion_page_pool *ion_page_pool_create(struct device *dev, gfp_t gfp_mask,
 
 void ion_page_pool_destroy(struct ion_page_pool *pool)
 {
+	struct ion_page_pool_mag *mag;
+	struct page *page, *tmp;
+	int cpu;
+
+	/* nothing uses the pool any more, the magazines need no locking */
+	for_each_possible_cpu(cpu) {
+		mag = per_cpu_ptr(pool->mags, cpu);
+		list_for_each_entry_safe(page, tmp, &mag->items, lru) {
+			list_del(&page->lru);
+			ion_page_pool_free_pages(pool, page);
+		}
+		mag->count = 0;
+	}
+	free_percpu(pool->mags);
 	kfree(pool);
 }
 
@@ -23,8 +23,10 @@
 #include <linux/kref.h>
 #include <linux/mm_types.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/rbtree.h>
 #include <linux/seq_file.h>
+#include <linux/spinlock.h>
 
 #include "msm_ion_priv.h"
 #include <linux/sched.h>
@@ -411,6 +413,42 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  * many systems
  */
 
+/**
+ * struct ion_page_pool_mag - per-cpu magazine of pages in front of a pool
+ * @lock:		protects the magazine, only ever contended by draining
+ * @items:		pages in the magazine
+ * @count:		number of pages in the magazine
+ * @hits:		allocations served by the magazine
+ * @pool_hits:		allocations served by refilling from the pool
+ * @misses:		allocations that had to go to the page allocator
+ * @refills:		batches moved from the pool into the magazine
+ * @drains:		batches moved from the magazine back to the pool
+ */
+struct ion_page_pool_mag {
+	spinlock_t lock;
+	struct list_head items;
+	int count;
+	unsigned long hits;
+	unsigned long pool_hits;
+	unsigned long misses;
+	unsigned long refills;
+	unsigned long drains;
+};
+
+/**
+ * struct ion_page_pool_stats - magazine statistics summed over all cpus
+ * @count:		pages held in magazines
+ * @hits, @pool_hits, @misses, @refills, @drains: see ion_page_pool_mag
+ */
+struct ion_page_pool_stats {
+	int count;
+	unsigned long hits;
+	unsigned long pool_hits;
+	unsigned long misses;
+	unsigned long refills;
+	unsigned long drains;
+};
+
 /**
  * struct ion_page_pool - pagepool struct
  * @high_count:		number of highmem items in the pool
@@ -422,11 +460,18 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  * @gfp_mask:		gfp_mask to use from alloc
  * @order:		order of pages in the pool
  * @list:		plist node for list of pools
+ * @mags:		per-cpu magazines
+ * @mag_size:		pages a magazine holds before it is drained
+ * @mag_batch:		pages moved per refill or drain
  *
  * Allows you to keep a pool of pre allocated pages to use from your heap.
  * Keeping a pool of pages that is ready for dma, ie any cached mapping have
  * been invalidated from the cache, provides a significant performance benefit
  * on many systems
+ *
+ * Pages are allocated from and freed to the magazine of the current cpu
+ * first, which is refilled from and drained to the lists in batches, so
+ * that the mutex is not taken for every page.
  */
 struct ion_page_pool {
 	int high_count;
@@ -438,6 +483,9 @@ struct ion_page_pool {
 	gfp_t gfp_mask;
 	unsigned int order;
 	struct plist_node list;
+	struct ion_page_pool_mag __percpu *mags;
+	int mag_size;
+	int mag_batch;
 };
 
 struct ion_page_pool *ion_page_pool_create(struct device *dev, gfp_t gfp_mask,
@@ -447,7 +495,11 @@ void *ion_page_pool_alloc(struct ion_page_pool *, bool *from_pool);
 void *ion_page_pool_alloc_pool_only(struct ion_page_pool *);
 void ion_page_pool_free(struct ion_page_pool *, struct page *);
 void ion_page_pool_free_immediate(struct ion_page_pool *, struct page *);
+bool ion_page_pool_fill(struct ion_page_pool *pool);
 int ion_page_pool_total(struct ion_page_pool *pool, bool high);
+void ion_page_pool_drain_mags(struct ion_page_pool *pool);
+void ion_page_pool_stats(struct ion_page_pool *pool,
+			 struct ion_page_pool_stats *stats);
 size_t ion_system_heap_secure_page_pool_total(struct ion_heap *heap, int vmid);
 
 #ifdef CONFIG_ION_POOL_CACHE_POLICY
@@ -18,9 +18,13 @@
 #include <asm/page.h>
 #include <linux/dma-mapping.h>
 #include <linux/err.h>
+#include <linux/freezer.h>
 #include <linux/highmem.h>
+#include <linux/kthread.h>
 #include <linux/mm.h>
+#include <linux/moduleparam.h>
 #include <linux/msm_ion.h>
+#include <linux/sched.h>
 #include <linux/scatterlist.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
@@ -43,6 +47,23 @@ static const unsigned int orders[] = {0};
 #endif
 
 static const int num_orders = ARRAY_SIZE(orders);
+
+/*
+ * The uncached pools of these orders, which large graphics buffers are
+ * mostly made of, are kept filled in the background up to pool_fill_kb
+ * each, and refilled once they drop below half of that. Filling stays off
+ * for ION_POOL_FILL_BACKOFF after the pools were shrunk, so as not to take
+ * back what reclaim just got.
+ */
+#define ION_POOL_FILL_MIN_ORDER	4
+#define ION_POOL_FILL_MAX_ORDER	8
+#define ION_POOL_FILL_BACKOFF	(5 * HZ)
+
+static unsigned int pool_fill_kb = 4096;
+module_param(pool_fill_kb, uint, 0644);
+MODULE_PARM_DESC(pool_fill_kb,
+		 "Memory kept ready in each large uncached pool, 0 to disable");
+
 static int order_to_index(unsigned int order)
 {
 	int i;
@@ -65,6 +86,13 @@ struct ion_system_heap {
 	struct ion_page_pool **secure_pools[VMID_LAST];
 	/* Prevents unnecessary page splitting */
 	struct mutex split_page_mutex;
+	/* Background pool filling, see ion_system_heap_fill() */
+	struct task_struct *fill_task;
+	wait_queue_head_t fill_wait;
+	bool fill_requested;
+	unsigned long last_shrink;
+	unsigned long fill_pages;
+	unsigned long fill_failures;
 };
 
 struct page_info {
@@ -326,6 +354,103 @@ static unsigned int process_info(struct page_info *info,
 	return i;
 }
 
+static bool ion_system_heap_fill_pool(int order_idx)
+{
+	return orders[order_idx] >= ION_POOL_FILL_MIN_ORDER &&
+	       orders[order_idx] <= ION_POOL_FILL_MAX_ORDER;
+}
+
+/* Wakes the fill thread if a filled pool ran below its low watermark */
+static void ion_system_heap_fill_kick(struct ion_system_heap *sys_heap)
+{
+	int target = READ_ONCE(pool_fill_kb) >> (PAGE_SHIFT - 10);
+	int i;
+
+	if (!sys_heap->fill_task || !target)
+		return;
+
+	for (i = 0; i < num_orders; i++) {
+		if (!ion_system_heap_fill_pool(i))
+			continue;
+		if (ion_page_pool_total(sys_heap->uncached_pools[i], true) <
+		    target / 2) {
+			WRITE_ONCE(sys_heap->fill_requested, true);
+			wake_up(&sys_heap->fill_wait);
+			return;
+		}
+	}
+}
+
+/*
+ * Tops the pools up to their target. Pages are taken with the pools' own
+ * flags, which neither reclaim nor retry, so only memory that is free
+ * anyway goes into the pools, and they are zeroed and cleaned from the
+ * cache here rather than when a buffer is allocated.
+ */
+static void ion_system_heap_fill(struct ion_system_heap *sys_heap)
+{
+	struct ion_page_pool *pool;
+	unsigned long backoff;
+	int target, i;
+
+	for (i = 0; i < num_orders; i++) {
+		if (!ion_system_heap_fill_pool(i))
+			continue;
+		pool = sys_heap->uncached_pools[i];
+		for (;;) {
+			target = READ_ONCE(pool_fill_kb) >> (PAGE_SHIFT - 10);
+			if (ion_page_pool_total(pool, true) >= target)
+				break;
+			backoff = READ_ONCE(sys_heap->last_shrink) +
+				  ION_POOL_FILL_BACKOFF;
+			if (kthread_should_stop() || time_before(jiffies, backoff))
+				return;
+			if (!ion_page_pool_fill(pool)) {
+				sys_heap->fill_failures++;
+				break;
+			}
+			sys_heap->fill_pages += 1 << pool->order;
+			cond_resched();
+		}
+	}
+}
+
+static int ion_system_heap_fill_thread(void *data)
+{
+	struct ion_system_heap *sys_heap = data;
+
+	set_freezable();
+	while (!kthread_should_stop()) {
+		wait_event_freezable(sys_heap->fill_wait,
+				     READ_ONCE(sys_heap->fill_requested) ||
+				     kthread_should_stop());
+		WRITE_ONCE(sys_heap->fill_requested, false);
+		ion_system_heap_fill(sys_heap);
+	}
+
+	return 0;
+}
+
+static void ion_system_heap_init_fill(struct ion_system_heap *sys_heap)
+{
+	struct sched_param param = { .sched_priority = 0 };
+
+	init_waitqueue_head(&sys_heap->fill_wait);
+	sys_heap->last_shrink = jiffies - ION_POOL_FILL_BACKOFF;
+	sys_heap->fill_task = kthread_run(ion_system_heap_fill_thread,
+					  sys_heap, "ion_pool_fill");
+	if (IS_ERR(sys_heap->fill_task)) {
+		pr_err("%s: creating thread for pool filling failed\n",
+		       __func__);
+		sys_heap->fill_task = NULL;
+		return;
+	}
+	sched_setscheduler(sys_heap->fill_task, SCHED_IDLE, &param);
+	/* start out with filled pools */
+	WRITE_ONCE(sys_heap->fill_requested, true);
+	wake_up(&sys_heap->fill_wait);
+}
+
 static int ion_system_heap_allocate(struct ion_heap *heap,
 				     struct ion_buffer *buffer,
 				     unsigned long size, unsigned long align,
@@ -464,6 +589,7 @@ static int ion_system_heap_allocate(struct ion_heap *heap,
 	if (nents_sync)
 		sg_free_table(&table_sync);
 	msm_ion_heap_free_pages_mem(&data);
+	ion_system_heap_fill_kick(sys_heap);
 	return 0;
 
 err_free_sg2:
@@ -553,6 +679,7 @@ static int ion_secure_page_pool_shrink(
 	if (nr_to_scan == 0)
 		return ion_page_pool_total(pool, true);
 
+	ion_page_pool_drain_mags(pool);
 	while (freed < nr_to_scan) {
 		page = ion_page_pool_alloc_pool_only(pool);
 		if (!page)
@@ -614,6 +741,8 @@ static int ion_system_heap_shrink(struct ion_heap *heap, gfp_t gfp_mask,
 
 	if (!nr_to_scan)
 		only_scan = 1;
+	else
+		WRITE_ONCE(sys_heap->last_shrink, jiffies);
 
 	for (i = 0; i < num_orders; i++) {
 		nr_freed = 0;
@@ -653,6 +782,29 @@ static struct ion_heap_ops system_heap_ops = {
 	.shrink = ion_system_heap_shrink,
 };
 
+static unsigned long ion_system_heap_show_mags(struct seq_file *s,
+					       struct ion_page_pool *pool,
+					       const char *name)
+{
+	struct ion_page_pool_stats stats;
+	unsigned long allocs;
+
+	ion_page_pool_stats(pool, &stats);
+	if (s) {
+		allocs = stats.hits + stats.pool_hits + stats.misses;
+		seq_printf(s,
+			   "%d order %u pages in %s magazines = %lu total, hit rate %lu%% (%lu magazine, %lu pool, %lu miss), %lu refills, %lu drains\n",
+			   stats.count, pool->order, name,
+			   (1 << pool->order) * PAGE_SIZE * stats.count,
+			   allocs ? (stats.hits + stats.pool_hits) * 100 /
+				    allocs : 0,
+			   stats.hits, stats.pool_hits, stats.misses,
+			   stats.refills, stats.drains);
+	}
+
+	return (1 << pool->order) * PAGE_SIZE * stats.count;
+}
+
 static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 				      void *unused)
 {
@@ -686,6 +838,8 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 			pool->high_count;
 		uncached_total += (1 << pool->order) * PAGE_SIZE *
 			pool->low_count;
+		uncached_total += ion_system_heap_show_mags(
+					use_seq ? s : NULL, pool, "uncached");
 	}
 
 	for (i = 0; i < num_orders; i++) {
@@ -706,6 +860,8 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 			pool->high_count;
 		cached_total += (1 << pool->order) * PAGE_SIZE *
 			pool->low_count;
+		cached_total += ion_system_heap_show_mags(
+					use_seq ? s : NULL, pool, "cached");
 	}
 
 	for (i = 0; i < num_orders; i++) {
@@ -731,6 +887,8 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 					 pool->high_count;
 			secure_total += (1 << pool->order) * PAGE_SIZE *
 					 pool->low_count;
+			secure_total += ion_system_heap_show_mags(
+					use_seq ? s : NULL, pool, "secure");
 		}
 	}
 
@@ -740,6 +898,9 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 			   uncached_total, cached_total, secure_total);
 		seq_printf(s, "pool total (uncached + cached + secure) = %lu\n",
 			   uncached_total + cached_total + secure_total);
+		seq_printf(s, "background fill: %lu pages filled, %lu failures, target %u kB per pool\n",
+			   sys_heap->fill_pages, sys_heap->fill_failures,
+			   sys_heap->fill_task ? pool_fill_kb : 0);
 		seq_puts(s, "--------------------------------------------\n");
 	} else {
 		pr_info("-------------------------------------------------\n");
@@ -830,6 +991,7 @@ struct ion_heap *ion_system_heap_create(struct ion_platform_heap *data)
 		goto err_create_cached_pools;
 
 	mutex_init(&heap->split_page_mutex);
+	ion_system_heap_init_fill(heap);
 
 	heap->heap.debug_show = ion_system_heap_debug_show;
 	return &heap->heap;
@@ -859,6 +1021,9 @@ void ion_system_heap_destroy(struct ion_heap *heap)
 							heap);
 	int i, j;
 
+	if (sys_heap->fill_task)
+		kthread_stop(sys_heap->fill_task);
+
 	for (i = 0; i < VMID_LAST; i++) {
 		if (!is_secure_vmid_valid(i))
 			continue;
@@ -18,6 +18,8 @@
 #include <linux/dma-buf.h>
 #include <linux/dma-direction.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/mman.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/module.h>
@@ -143,6 +145,42 @@ err:
 	return ret;
 }
 
+static int ion_handle_test_user_fault(struct dma_buf *dma_buf,
+		struct ion_test_fault_data *data)
+{
+	unsigned long size, uaddr, addr, faults;
+	ktime_t start;
+	int ret = 0;
+	char c;
+
+	if (!dma_buf)
+		return -EINVAL;
+
+	size = PAGE_ALIGN(dma_buf->size);
+	uaddr = vm_mmap(dma_buf->file, 0, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, 0);
+	if (IS_ERR_VALUE(uaddr))
+		return (int)uaddr;
+
+	faults = current->min_flt + current->maj_flt;
+	start = ktime_get();
+	for (addr = uaddr; addr < uaddr + size; addr += PAGE_SIZE) {
+		char __user *ptr = (char __user *)addr;
+
+		if (data->write)
+			ret = put_user(0, ptr);
+		else
+			ret = get_user(c, ptr);
+		if (ret)
+			break;
+	}
+	data->time_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	data->faults = current->min_flt + current->maj_flt - faults;
+
+	vm_munmap(uaddr, size);
+	return ret;
+}
+
 static long ion_test_ioctl(struct file *filp, unsigned int cmd,
 						unsigned long arg)
 {
@@ -151,6 +189,7 @@ static long ion_test_ioctl(struct file *filp, unsigned int cmd,
 
 	union {
 		struct ion_test_rw_data test_rw;
+		struct ion_test_fault_data test_fault;
 	} data;
 
 	if (_IOC_SIZE(cmd) > sizeof(data))
@@ -192,12 +231,18 @@ static long ion_test_ioctl(struct file *filp, unsigned int cmd,
 					data.test_rw.write);
 		break;
 	}
+	case ION_IOC_TEST_USER_FAULT:
+	{
+		ret = ion_handle_test_user_fault(test_data->dma_buf,
+						 &data.test_fault);
+		break;
+	}
 	default:
 		return -ENOTTY;
 	}
 
 	if (_IOC_DIR(cmd) & _IOC_READ) {
-		if (copy_to_user((void __user *)arg, &data, sizeof(data)))
+		if (copy_to_user((void __user *)arg, &data, _IOC_SIZE(cmd)))
 			return -EFAULT;
 	}
 	return ret;
@@ -13,6 +13,11 @@
  * drops below 4096 pages and kill processes with a oom_score_adj value of 0 or
  * higher when the free memory drops below 1024 pages.
  *
+ * With /sys/module/lowmemorykiller/parameters/batch_kill set, a single scan
+ * kills up to batch_kill_max processes, enough to cover the shortfall below
+ * the minfree level that triggered it, and their private memory is freed
+ * right away by the lmk_reaper thread instead of by their own exit.
+ *
  * The driver considers memory used for caches to be free, but if a large
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
@@ -49,6 +54,14 @@
 #include <linux/cpuset.h>
 #include <linux/vmpressure.h>
 #include <linux/zcache.h>
+#include <linux/freezer.h>
+#include <linux/hashtable.h>
+#include <linux/hugetlb.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 
 #define CREATE_TRACE_POINTS
 #include <trace/events/almk.h>
@@ -80,8 +93,11 @@ static int lowmem_minfree[6] = {
 };
 static int lowmem_minfree_size = 4;
 static int lmk_fast_run = 1;
+static bool lowmem_batch_kill;
+static int lowmem_batch_kill_max = 4;
 
 static unsigned long lowmem_deathpending_timeout;
+static struct task_struct *lowmem_deathpending;
 
 #define lowmem_print(level, x...)			\
 	do {						\
@@ -224,6 +240,491 @@ static int test_task_flag(struct task_struct *p, int flag)
 
 static DEFINE_MUTEX(scan_mutex);
 
+/*
+ * Victim index
+ *
+ * Every user process is kept in a bucket for its oom_score_adj, with a
+ * bitmap of the buckets that are not empty, so that a scan only has to
+ * look at the processes sharing the highest eligible oom_score_adj rather
+ * than walk the whole task list from reclaim. A process is (re)indexed
+ * when its oom_score_adj is written and dropped when its last thread
+ * exits or it is found without an mm. Processes that inherited their
+ * oom_score_adj on fork and never had it written are picked up by
+ * lowmem_index_sync(), which walks the task list from a workqueue. Scans
+ * kick it at most once every LOWMEM_SYNC_INTERVAL.
+ */
+#define LOWMEM_NR_BUCKETS	(OOM_SCORE_ADJ_MAX - OOM_SCORE_ADJ_MIN + 1)
+#define LOWMEM_HASH_BITS	8
+#define LOWMEM_SYNC_INTERVAL	HZ
+
+struct lowmem_victim {
+	struct hlist_node hash;		/* in lowmem_victim_hash, by signal */
+	struct hlist_node bucket;	/* in lowmem_buckets[], by adj */
+	struct task_struct *task;	/* thread group leader, referenced */
+	short adj;
+	int rss;			/* pages, as of the last scan */
+	unsigned long seq;		/* lowmem_sync_seq when last seen */
+};
+
+static DEFINE_SPINLOCK(lowmem_index_lock);
+static DEFINE_HASHTABLE(lowmem_victim_hash, LOWMEM_HASH_BITS);
+static struct hlist_head lowmem_buckets[LOWMEM_NR_BUCKETS];
+static DECLARE_BITMAP(lowmem_bucket_map, LOWMEM_NR_BUCKETS);
+static unsigned long lowmem_sync_seq;
+static unsigned long lowmem_sync_next;
+
+static void lowmem_index_sync(struct work_struct *work);
+static DECLARE_WORK(lowmem_sync_work, lowmem_index_sync);
+
+static inline unsigned int lowmem_adj_bucket(short adj)
+{
+	return adj - OOM_SCORE_ADJ_MIN;
+}
+
+static struct lowmem_victim *lowmem_victim_find(struct signal_struct *sig)
+{
+	struct lowmem_victim *v;
+
+	hash_for_each_possible(lowmem_victim_hash, v, hash, (unsigned long)sig)
+		if (v->task->signal == sig)
+			return v;
+	return NULL;
+}
+
+static void lowmem_victim_link(struct lowmem_victim *v, short adj)
+{
+	unsigned int bucket = lowmem_adj_bucket(adj);
+
+	v->adj = adj;
+	hlist_add_head(&v->bucket, &lowmem_buckets[bucket]);
+	__set_bit(bucket, lowmem_bucket_map);
+}
+
+static void lowmem_victim_unlink(struct lowmem_victim *v)
+{
+	unsigned int bucket = lowmem_adj_bucket(v->adj);
+
+	hlist_del(&v->bucket);
+	if (hlist_empty(&lowmem_buckets[bucket]))
+		__clear_bit(bucket, lowmem_bucket_map);
+}
+
+/* Moves @v to @stale, whose entries are freed once the lock is dropped */
+static void lowmem_victim_remove(struct lowmem_victim *v,
+				 struct hlist_head *stale)
+{
+	lowmem_victim_unlink(v);
+	hash_del(&v->hash);
+	hlist_add_head(&v->bucket, stale);
+}
+
+static void lowmem_victims_free(struct hlist_head *stale)
+{
+	struct lowmem_victim *v;
+	struct hlist_node *tmp;
+
+	hlist_for_each_entry_safe(v, tmp, stale, bucket) {
+		put_task_struct(v->task);
+		kfree(v);
+	}
+}
+
+/*
+ * Index the process of @p under its current oom_score_adj. An unknown
+ * process uses up *@new, or is left out if there is none. Called with
+ * lowmem_index_lock held, under rcu_read_lock().
+ */
+static void lowmem_index_task(struct task_struct *p, struct lowmem_victim **new)
+{
+	short adj = READ_ONCE(p->signal->oom_score_adj);
+	struct lowmem_victim *v;
+
+	v = lowmem_victim_find(p->signal);
+	if (v) {
+		if (v->adj != adj) {
+			lowmem_victim_unlink(v);
+			lowmem_victim_link(v, adj);
+		}
+	} else if (*new) {
+		v = *new;
+		*new = NULL;
+		v->task = p->group_leader;
+		get_task_struct(v->task);
+		v->rss = 0;
+		hash_add(lowmem_victim_hash, &v->hash,
+			 (unsigned long)p->signal);
+		lowmem_victim_link(v, adj);
+	}
+	if (v)
+		v->seq = lowmem_sync_seq;
+}
+
+/* Called by procfs after the oom_score_adj of @task was written */
+void lowmem_update_adj(struct task_struct *task)
+{
+	struct lowmem_victim *new;
+
+	if (task->flags & PF_KTHREAD)
+		return;
+
+	/* on failure the next lowmem_index_sync() catches up */
+	new = kmalloc(sizeof(*new), GFP_KERNEL);
+
+	rcu_read_lock();
+	spin_lock(&lowmem_index_lock);
+	if (pid_alive(task))
+		lowmem_index_task(task, &new);
+	spin_unlock(&lowmem_index_lock);
+	rcu_read_unlock();
+
+	kfree(new);
+}
+
+static void lowmem_index_sync(struct work_struct *work)
+{
+	struct lowmem_victim *v, *new = NULL;
+	struct task_struct *tsk;
+	struct hlist_node *tmp;
+	HLIST_HEAD(stale);
+	int bkt;
+
+	rcu_read_lock();
+	spin_lock(&lowmem_index_lock);
+	lowmem_sync_seq++;
+	for_each_process(tsk) {
+		if (tsk->flags & PF_KTHREAD)
+			continue;
+		if (!new)
+			new = kmalloc(sizeof(*new), GFP_NOWAIT | __GFP_NOWARN);
+		lowmem_index_task(tsk, &new);
+	}
+	/* processes that are gone but whose exit was not seen */
+	hash_for_each_safe(lowmem_victim_hash, bkt, tmp, v, hash)
+		if (v->seq != lowmem_sync_seq)
+			lowmem_victim_remove(v, &stale);
+	spin_unlock(&lowmem_index_lock);
+	rcu_read_unlock();
+
+	kfree(new);
+	lowmem_victims_free(&stale);
+}
+
+static void lowmem_index_kick(void)
+{
+	if (time_before(jiffies, lowmem_sync_next))
+		return;
+	lowmem_sync_next = jiffies + LOWMEM_SYNC_INTERVAL;
+	queue_work(system_unbound_wq, &lowmem_sync_work);
+}
+
+static int lowmem_task_exit(struct notifier_block *nb, unsigned long val,
+			    void *data)
+{
+	struct task_struct *task = data;
+	struct lowmem_victim *v;
+	HLIST_HEAD(stale);
+
+	/*
+	 * The process goes with its last thread. If its last threads exit
+	 * at once, none may see itself as the last, and lowmem_select()
+	 * drops the process instead.
+	 */
+	if (atomic_read(&task->signal->live) > 1)
+		return NOTIFY_OK;
+
+	spin_lock(&lowmem_index_lock);
+	v = lowmem_victim_find(task->signal);
+	if (v)
+		lowmem_victim_remove(v, &stale);
+	spin_unlock(&lowmem_index_lock);
+
+	lowmem_victims_free(&stale);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_task_nb = {
+	.notifier_call = lowmem_task_exit,
+};
+
+/*
+ * Reaper
+ *
+ * In batch mode a single scan kills as many processes as it takes to
+ * cover the minfree deficit, and does not wait for them to exit: a victim
+ * stuck in its exit path, or simply slow to tear down a large address
+ * space, would otherwise hold up every allocation in the meantime. The
+ * private memory of each victim is unmapped from lowmem_reaper() instead,
+ * with mmap_sem held for read, the way MADV_DONTNEED does it. This waits
+ * until every process using the mm has gone past exit_mm(): a thread
+ * still in a system call could otherwise refault the zapped pages and,
+ * say, write zeroes to a file. Victims whose mm is also used by a process
+ * that was not killed, or by a kernel thread through use_mm(), are left
+ * alone.
+ *
+ * Reap requests come from reclaim, so they are taken from a fixed pool
+ * rather than allocated. A victim that finds the pool empty is still
+ * killed, it only frees its memory the slow way.
+ */
+#define LOWMEM_REAP_SLOTS	16
+#define LOWMEM_REAP_RETRIES	10
+
+struct lowmem_reap {
+	struct list_head list;
+	struct task_struct *task;	/* referenced */
+	struct mm_struct *mm;		/* mm_count referenced */
+};
+
+static struct lowmem_reap lowmem_reap_slots[LOWMEM_REAP_SLOTS];
+static LIST_HEAD(lowmem_reap_free);
+static LIST_HEAD(lowmem_reap_list);
+static DEFINE_SPINLOCK(lowmem_reap_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_reap_wait);
+static struct task_struct *lowmem_reaper_th;
+/* requests queued or being reaped */
+static int lowmem_reap_nr;
+
+static bool lowmem_reap_pending(void)
+{
+	return READ_ONCE(lowmem_reap_nr) > 0;
+}
+
+/* Called with @p task_lock()ed and p->mm set */
+static void lowmem_reap_queue(struct task_struct *p)
+{
+	struct lowmem_reap *r;
+
+	if (!lowmem_reaper_th)
+		return;
+
+	spin_lock(&lowmem_reap_lock);
+	r = list_first_entry_or_null(&lowmem_reap_free, struct lowmem_reap,
+				     list);
+	if (r) {
+		get_task_struct(p);
+		r->task = p;
+		atomic_inc(&p->mm->mm_count);
+		r->mm = p->mm;
+		list_move_tail(&r->list, &lowmem_reap_list);
+		lowmem_reap_nr++;
+	}
+	spin_unlock(&lowmem_reap_lock);
+
+	if (r)
+		wake_up(&lowmem_reap_wait);
+}
+
+/*
+ * Returns -EBUSY if @mm is used by anyone but the victim and other killed
+ * processes, -EAGAIN if one of those has not gone past exit_mm() yet, and
+ * 0 once it is safe to reap.
+ */
+static int lowmem_mm_attached(struct task_struct *victim, struct mm_struct *mm)
+{
+	struct task_struct *p, *t;
+	int ret = 0;
+
+	rcu_read_lock();
+	for_each_process(p) {
+		t = find_lock_task_mm(p);
+		if (!t)
+			continue;
+		if (t->mm == mm)
+			ret = same_thread_group(p, victim) ||
+			      (p->signal->flags & SIGNAL_GROUP_EXIT) ?
+			      -EAGAIN : -EBUSY;
+		task_unlock(t);
+		if (ret == -EBUSY)
+			break;
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static bool lowmem_reap_mm(struct mm_struct *mm)
+{
+	struct vm_area_struct *vma;
+
+	if (!down_read_trylock(&mm->mmap_sem))
+		return false;
+
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (is_vm_hugetlb_page(vma) ||
+		    (vma->vm_flags & (VM_LOCKED | VM_PFNMAP)))
+			continue;
+		/* shared file pages are not freed by unmapping them */
+		if (vma_is_anonymous(vma) || !(vma->vm_flags & VM_SHARED))
+			zap_page_range(vma, vma->vm_start,
+				       vma->vm_end - vma->vm_start, NULL);
+	}
+	up_read(&mm->mmap_sem);
+
+	return true;
+}
+
+static void lowmem_reap_task(struct lowmem_reap *r)
+{
+	unsigned long rss;
+	int attempts = 0;
+	int ret;
+
+	/* nothing left to do if the victim already released its mm */
+	if (!atomic_inc_not_zero(&r->mm->mm_users))
+		return;
+
+	/* killed threads may take a while to leave their system calls */
+	while ((ret = lowmem_mm_attached(r->task, r->mm)) == -EAGAIN) {
+		if (++attempts == LOWMEM_REAP_RETRIES)
+			goto fail;
+		msleep(100);
+	}
+	if (ret) {
+		lowmem_print(2, "not reaping '%s' (%d), mm is shared\n",
+			     r->task->comm, r->task->pid);
+		goto out;
+	}
+
+	rss = get_mm_rss(r->mm);
+	/* whoever else holds a reference may have mmap_sem for a while */
+	while (!lowmem_reap_mm(r->mm)) {
+		if (++attempts == LOWMEM_REAP_RETRIES)
+			goto fail;
+		msleep(100);
+	}
+	lowmem_print(2, "reaped '%s' (%d), freed %lukB\n",
+		     r->task->comm, r->task->pid,
+		     (rss - min(rss, get_mm_rss(r->mm))) *
+		     (PAGE_SIZE / 1024));
+	goto out;
+fail:
+	lowmem_print(2, "could not reap '%s' (%d)\n",
+		     r->task->comm, r->task->pid);
+out:
+	mmput(r->mm);
+}
+
+static int lowmem_reaper(void *unused)
+{
+	struct lowmem_reap *r;
+
+	set_freezable();
+
+	for (;;) {
+		wait_event_freezable(lowmem_reap_wait,
+				     !list_empty_careful(&lowmem_reap_list));
+
+		spin_lock(&lowmem_reap_lock);
+		r = list_first_entry_or_null(&lowmem_reap_list,
+					     struct lowmem_reap, list);
+		if (r)
+			list_del_init(&r->list);
+		spin_unlock(&lowmem_reap_lock);
+		if (!r)
+			continue;
+
+		lowmem_reap_task(r);
+		put_task_struct(r->task);
+		mmdrop(r->mm);
+
+		spin_lock(&lowmem_reap_lock);
+		list_add(&r->list, &lowmem_reap_free);
+		lowmem_reap_nr--;
+		spin_unlock(&lowmem_reap_lock);
+	}
+
+	return 0;
+}
+
+static void __init lowmem_reaper_init(void)
+{
+	int i;
+
+	for (i = 0; i < LOWMEM_REAP_SLOTS; i++)
+		list_add(&lowmem_reap_slots[i].list, &lowmem_reap_free);
+
+	lowmem_reaper_th = kthread_run(lowmem_reaper, NULL, "lmk_reaper");
+	if (IS_ERR(lowmem_reaper_th)) {
+		pr_err("failed to start the reaper: %ld\n",
+		       PTR_ERR(lowmem_reaper_th));
+		lowmem_reaper_th = NULL;
+	}
+}
+
+/*
+ * Select the process with the highest oom_score_adj not below
+ * @min_score_adj, and the biggest RSS among those. Processes that are
+ * already being killed are passed over if @skip_killed is set. Returns
+ * the thread that holds its mm, or NULL. Called under rcu_read_lock(),
+ * which keeps the returned task around.
+ */
+static struct task_struct *lowmem_select(short min_score_adj,
+					 bool skip_killed, int *tasksize,
+					 short *adj)
+{
+	unsigned int min_bucket = lowmem_adj_bucket(min_score_adj);
+	unsigned int nr_buckets = 0, nr_tasks = 0;
+	unsigned long idx, size = LOWMEM_NR_BUCKETS;
+	struct task_struct *selected = NULL;
+	struct lowmem_victim *v;
+	struct hlist_node *tmp;
+	HLIST_HEAD(stale);
+	ktime_t start;
+
+	start = ktime_get();
+	*tasksize = 0;
+	*adj = min_score_adj;
+
+	spin_lock(&lowmem_index_lock);
+	while (!selected) {
+		idx = find_last_bit(lowmem_bucket_map, size);
+		if (idx >= size || idx < min_bucket)
+			break;
+		size = idx;
+		nr_buckets++;
+
+		hlist_for_each_entry_safe(v, tmp, &lowmem_buckets[idx],
+					  bucket) {
+			struct task_struct *p;
+
+			/*
+			 * Drop processes that are gone, the exit hook misses
+			 * those whose last threads exit at the same time.
+			 */
+			p = find_lock_task_mm(v->task);
+			if (!p) {
+				lowmem_victim_remove(v, &stale);
+				continue;
+			}
+			v->rss = get_mm_rss(p->mm);
+			task_unlock(p);
+
+			/* if task no longer has any memory ignore it */
+			if (test_task_flag(v->task, TIF_MM_RELEASED))
+				continue;
+
+			if (skip_killed &&
+			    (v->task->signal->flags & SIGNAL_GROUP_EXIT))
+				continue;
+			nr_tasks++;
+			if (v->rss <= *tasksize)
+				continue;
+
+			selected = p;
+			*tasksize = v->rss;
+			*adj = v->adj;
+			lowmem_print(3, "select '%s' (%d), adj %hd, size %d, to kill\n",
+				     p->comm, p->pid, v->adj, v->rss);
+		}
+	}
+	spin_unlock(&lowmem_index_lock);
+
+	lowmem_victims_free(&stale);
+	trace_lowmemory_select(selected, min_score_adj, *adj, *tasksize,
+			       nr_buckets, nr_tasks,
+			       ktime_to_ns(ktime_sub(ktime_get(), start)));
+	return selected;
+}
+
 int can_use_cma_pages(gfp_t gfp_mask)
 {
 	int can_use = 0;
@@ -395,15 +896,15 @@ void tune_lmk_param(int *other_free, int *other_file, struct shrink_control *sc)
 
 static unsigned long lowmem_scan(struct shrinker *s, struct shrink_control *sc)
 {
-	struct task_struct *tsk;
 	struct task_struct *selected = NULL;
 	unsigned long rem = 0;
-	int tasksize;
 	int i;
 	int ret = 0;
 	short min_score_adj = OOM_SCORE_ADJ_MAX + 1;
 	int minfree = 0;
 	int selected_tasksize = 0;
+	int nr_killed = 0;
+	unsigned long deficit;
 	short selected_oom_score_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free;
@@ -451,57 +952,28 @@ static unsigned long lowmem_scan(struct shrinker *s, struct shrink_control *sc)
 		return 0;
 	}
 
-	selected_oom_score_adj = min_score_adj;
-
-	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		short oom_score_adj;
-
-		if (tsk->flags & PF_KTHREAD)
-			continue;
-
-		/* if task no longer has any memory ignore it */
-		if (test_task_flag(tsk, TIF_MM_RELEASED))
-			continue;
-
-		if (time_before_eq(jiffies, lowmem_deathpending_timeout)) {
-			if (test_task_flag(tsk, TIF_MEMDIE)) {
-				rcu_read_unlock();
-				/* give the system time to free up the memory */
-				msleep_interruptible(20);
-				mutex_unlock(&scan_mutex);
-				return 0;
-			}
+	if (lowmem_deathpending) {
+		if (time_before_eq(jiffies, lowmem_deathpending_timeout) &&
+		    (lowmem_batch_kill ? lowmem_reap_pending() :
+		     test_tsk_thread_flag(lowmem_deathpending, TIF_MEMDIE))) {
+			/* give the system time to free up the memory */
+			msleep_interruptible(20);
+			mutex_unlock(&scan_mutex);
+			return 0;
 		}
+		put_task_struct(lowmem_deathpending);
+		lowmem_deathpending = NULL;
+	}
 
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
+	lowmem_index_kick();
 
-		oom_score_adj = p->signal->oom_score_adj;
-		if (oom_score_adj < min_score_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_score_adj < selected_oom_score_adj)
-				continue;
-			if (oom_score_adj == selected_oom_score_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_score_adj = oom_score_adj;
-		lowmem_print(3, "select '%s' (%d), adj %hd, size %d, to kill\n",
-			     p->comm, p->pid, oom_score_adj, tasksize);
-	}
-	if (selected) {
+	/* pages to free before other_free is back above minfree */
+	deficit = max(minfree - other_free, 1);
+
+	rcu_read_lock();
+	while ((selected = lowmem_select(min_score_adj, lowmem_batch_kill,
+					 &selected_tasksize,
+					 &selected_oom_score_adj))) {
 		bool should_dump_meminfo = false;
 		long cache_size, cache_limit, free;
 		task_lock(selected);
@@ -511,8 +983,11 @@ static unsigned long lowmem_scan(struct shrinker *s, struct shrink_control *sc)
 		 * infrastructure. There is no real reason why the selected
 		 * task should have access to the memory reserves.
 		 */
-		if (selected->mm)
+		if (selected->mm) {
 			mark_oom_victim(selected);
+			if (lowmem_batch_kill)
+				lowmem_reap_queue(selected);
+		}
 		task_unlock(selected);
 		cache_size = other_file * (long)(PAGE_SIZE / 1024);
 		cache_limit = minfree * (long)(PAGE_SIZE / 1024);
@@ -554,9 +1029,13 @@ static unsigned long lowmem_scan(struct shrinker *s, struct shrink_control *sc)
 			dump_tasks(NULL, NULL);
 		}
 
+		if (lowmem_deathpending)
+			put_task_struct(lowmem_deathpending);
+		get_task_struct(selected);
+		lowmem_deathpending = selected;
 		lowmem_deathpending_timeout = jiffies + HZ;
 		rem += selected_tasksize;
-		rcu_read_unlock();
+		nr_killed++;
 		if (should_dump_meminfo)
 			lowmem_print(1, "killing process of adj less than 7 \n" \
 					"   NR_FILE_PAGES = %ld \n" \
@@ -568,14 +1047,22 @@ static unsigned long lowmem_scan(struct shrinker *s, struct shrink_control *sc)
 					global_page_state(NR_MLOCK),
 					total_swapcache_pages());
 
-		/* give the system time to free up the memory */
-		msleep_interruptible(20);
 		trace_almk_shrink(selected_tasksize, ret,
 				  other_free, other_file,
 				  selected_oom_score_adj);
+
+		/* in batch mode, keep going until the deficit is covered */
+		if (!lowmem_batch_kill || rem >= deficit ||
+		    nr_killed >= lowmem_batch_kill_max)
+			break;
+	}
+	rcu_read_unlock();
+
+	if (nr_killed) {
+		/* give the system time to free up the memory */
+		msleep_interruptible(20);
 	} else {
 		trace_almk_shrink(1, ret, other_free, other_file, 0);
-		rcu_read_unlock();
 	}
 
 	lowmem_print(4, "lowmem_scan %lu, %x, return %lu\n",
@@ -592,6 +1079,16 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	int ret;
+
+	/* without it, exited victims would stay in the index for good */
+	ret = profile_event_register(PROFILE_TASK_EXIT, &lowmem_task_nb);
+	if (ret) {
+		pr_err("failed to register the task exit notifier: %d\n", ret);
+		return ret;
+	}
+	lowmem_sync_next = jiffies;
+	lowmem_reaper_init();
 	register_shrinker(&lowmem_shrinker);
 	vmpressure_notifier_register(&lmk_vmpr_nb);
 	return 0;
@@ -693,4 +1190,7 @@ module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
 module_param_named(lmk_fast_run, lmk_fast_run, int, S_IRUGO | S_IWUSR);
+module_param_named(batch_kill, lowmem_batch_kill, bool, S_IRUGO | S_IWUSR);
+module_param_named(batch_kill_max, lowmem_batch_kill_max, int,
+		   S_IRUGO | S_IWUSR);
 
@@ -34,6 +34,39 @@ TRACE_EVENT(lowmemory_kill,
 		__entry->pagecache_limit, __entry->free)
 );
 
+TRACE_EVENT(lowmemory_select,
+	TP_PROTO(struct task_struct *selected, short min_adj, short adj,
+		 int tasksize, unsigned int buckets, unsigned int tasks,
+		 s64 latency_ns),
+
+	TP_ARGS(selected, min_adj, adj, tasksize, buckets, tasks, latency_ns),
+
+	TP_STRUCT__entry(
+			__field(pid_t, pid)
+			__field(short, min_adj)
+			__field(short, adj)
+			__field(int, tasksize)
+			__field(unsigned int, buckets)
+			__field(unsigned int, tasks)
+			__field(s64, latency_ns)
+	),
+
+	TP_fast_assign(
+			__entry->pid = selected ? selected->pid : -1;
+			__entry->min_adj = min_adj;
+			__entry->adj = adj;
+			__entry->tasksize = tasksize;
+			__entry->buckets = buckets;
+			__entry->tasks = tasks;
+			__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("pid %d adj %hd size %d min_adj %hd, %u buckets %u tasks in %lldns",
+		__entry->pid, __entry->adj, __entry->tasksize,
+		__entry->min_adj, __entry->buckets, __entry->tasks,
+		__entry->latency_ns)
+);
+
 
 #endif /* if !defined(_TRACE_LOWMEMORYKILLER_H) || defined(TRACE_HEADER_MULTI_READ) */
 
@@ -134,6 +134,38 @@ struct ion_custom_data {
 	unsigned long arg;
 };
 
+/**
+ * struct ion_sync_range - a range of a buffer to sync
+ * @offset:	start of the range in the buffer, in bytes
+ * @len:	length of the range, in bytes
+ */
+struct ion_sync_range {
+	__u64 offset;
+	__u64 len;
+};
+
+/* Directions for ION_IOC_SYNC_RANGES */
+#define ION_SYNC_FOR_DEVICE	0	/* after the cpu wrote the ranges */
+#define ION_SYNC_FOR_CPU	1	/* before the cpu reads the ranges */
+
+#define ION_SYNC_MAX_RANGES	1024
+
+/**
+ * struct ion_sync_ranges_data - ranges of a buffer to sync in one call
+ * @fd:		dma-buf file descriptor of the buffer
+ * @flags:	ION_SYNC_FOR_DEVICE or ION_SYNC_FOR_CPU
+ * @nr_ranges:	number of entries in @ranges, at most ION_SYNC_MAX_RANGES
+ * @reserved:	must be zero
+ * @ranges:	user pointer to an array of struct ion_sync_range
+ */
+struct ion_sync_ranges_data {
+	int fd;
+	__u32 flags;
+	__u32 nr_ranges;
+	__u32 reserved;
+	__u64 ranges;
+};
+
 #define ION_IOC_MAGIC		'I'
 
 /**
@@ -192,6 +224,19 @@ struct ion_custom_data {
  */
 #define ION_IOC_SYNC		_IOWR(ION_IOC_MAGIC, 7, struct ion_fd_data)
 
+/**
+ * DOC: ION_IOC_SYNC_RANGES - syncs parts of a cached buffer to memory
+ *
+ * Takes an ion_sync_ranges_data struct. Like ION_IOC_SYNC, but only the
+ * given ranges of the buffer are cleaned from (ION_SYNC_FOR_DEVICE) or
+ * invalidated in (ION_SYNC_FOR_CPU) the cpu caches. Unless the buffer was
+ * allocated with ION_FLAG_CACHED_NEEDS_SYNC, pages that were not written
+ * through a mapping since they were last synced for the device are skipped.
+ * Does nothing for uncached and secure buffers.
+ */
+#define ION_IOC_SYNC_RANGES	_IOW(ION_IOC_MAGIC, 8, \
+				     struct ion_sync_ranges_data)
+
 /**
  * DOC: ION_IOC_CUSTOM - call architecture specific ion ioctl
  *
@@ -35,6 +35,19 @@ struct ion_test_rw_data {
 	int __padding;
 };
 
+/**
+ * struct ion_test_fault_data - result of a user mapping fault benchmark
+ * @faults:	page faults taken to touch every page of the buffer
+ * @time_ns:	time taken to touch every page, including the faults
+ * @write:	1 to write to each page, 0 to read from it
+ */
+struct ion_test_fault_data {
+	__u64 faults;
+	__u64 time_ns;
+	int write;
+	int __padding;
+};
+
 #define ION_IOC_MAGIC		'I'
 
 /**
@@ -66,5 +79,17 @@ struct ion_test_rw_data {
 #define ION_IOC_TEST_KERNEL_MAPPING \
 			_IOW(ION_IOC_MAGIC, 0xf2, struct ion_test_rw_data)
 
+/**
+ * DOC: ION_IOC_TEST_USER_FAULT - time faulting in a user mapping of a handle
+ *
+ * Maps the whole buffer into the calling process, touches every page of the
+ * mapping once and unmaps it again, reporting how many page faults that took
+ * and how long.  Used to measure the cost of faulting in buffers whose user
+ * mappings are not populated at mmap time.  Only expected to be used for
+ * debugging and testing, may not always be available.
+ */
+#define ION_IOC_TEST_USER_FAULT \
+			_IOWR(ION_IOC_MAGIC, 0xf3, struct ion_test_fault_data)
+
 
 #endif /* _UAPI_LINUX_ION_H */
@@ -534,6 +534,9 @@ static void __allocate_data_blocks(struct inode *inode, loff_t offset,
 				if (__allocate_data_block(&dn))
 					goto sync_out;
 				allocated = true;
+			} else {
+				/* rewritten in place by the direct write */
+				inc_write_heat(inode);
 			}
 			len--;
 			start++;
@@ -1062,6 +1065,10 @@ int do_write_data_page(struct f2fs_io_info *fio)
 		goto out_writepage;
 	}
 
+	/* moving a block for GC does not make the file any hotter */
+	if (fio->blk_addr != NEW_ADDR && !is_cold_data(page))
+		inc_write_heat(inode);
+
 	if (f2fs_encrypted_inode(inode) && S_ISREG(inode->i_mode)) {
 
 		/* wait for GCed encrypted page writeback */
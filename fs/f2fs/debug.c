@@ -167,6 +167,7 @@ static void update_mem_info(struct f2fs_sb_info *sbi)
 	si->base_mem += sizeof(struct dirty_seglist_info);
 	si->base_mem += NR_DIRTY_TYPE * f2fs_bitmap_size(MAIN_SEGS(sbi));
 	si->base_mem += f2fs_bitmap_size(MAIN_SECS(sbi));
+	si->base_mem += MAIN_SECS(sbi) * sizeof(struct victim_entry);
 
 	/* build nm */
 	si->base_mem += sizeof(struct f2fs_nm_info);
@@ -183,6 +184,13 @@ get_cache:
 	if (SM_I(sbi)->cmd_control_info)
 		si->cache_mem += sizeof(struct flush_cmd_control);
 
+	/* discard command control */
+	if (SM_I(sbi)->dcc_info)
+		si->cache_mem += sizeof(struct discard_cmd_control) +
+			f2fs_bitmap_size(MAIN_SEGS(sbi)) +
+			SM_I(sbi)->dcc_info->nr_discard_cmds *
+					sizeof(struct discard_entry);
+
 	/* free nids */
 	si->cache_mem += NM_I(sbi)->fcnt * sizeof(struct free_nid);
 	si->cache_mem += NM_I(sbi)->nat_cnt * sizeof(struct nat_entry);
@@ -282,6 +290,17 @@ static int stat_show(struct seq_file *s, void *v)
 				si->bg_data_blks);
 		seq_printf(s, "  - node blocks : %d (%d)\n", si->node_blks,
 				si->bg_node_blks);
+		seq_printf(s, "GC passes: %d, %d blocks/pass, %llu blocks/s\n",
+				si->gc_passes,
+				!si->gc_passes ? 0 :
+				si->tot_blks / si->gc_passes,
+				!si->gc_pass_time ? 0 :
+				div64_u64(si->tot_blks * 1000000000ULL,
+					si->gc_pass_time));
+		seq_printf(s, "  - latency: avg %llu us, max %llu us\n",
+				!si->gc_passes ? 0 :
+				div_u64(si->gc_pass_time, si->gc_passes) / 1000,
+				div_u64(si->gc_pass_max, 1000));
 		seq_puts(s, "\nExtent Cache:\n");
 		seq_printf(s, "  - Hit Count: L1-1:%llu L1-2:%llu L2:%llu\n",
 				si->hit_largest, si->hit_cached,
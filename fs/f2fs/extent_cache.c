@@ -21,6 +21,26 @@
 static struct kmem_cache *extent_tree_slab;
 static struct kmem_cache *extent_node_slab;
 
+/*
+ * Lookups walk an extent tree without et->lock, under rcu_read_lock() and
+ * inside et->seq, which every change of the tree, its nodes, largest and
+ * cached_en is made in. Extent nodes come from a SLAB_DESTROY_BY_RCU
+ * cache, so a node freed under a walker stays an extent node, though it
+ * may be reused for another one; the sequence count tells the walker, which
+ * then looks again under the lock.
+ */
+static inline void __lock_extent_tree(struct extent_tree *et)
+{
+	write_lock(&et->lock);
+	write_seqcount_begin(&et->seq);
+}
+
+static inline void __unlock_extent_tree(struct extent_tree *et)
+{
+	write_seqcount_end(&et->seq);
+	write_unlock(&et->lock);
+}
+
 static struct extent_node *__attach_extent_node(struct f2fs_sb_info *sbi,
 				struct extent_tree *et, struct extent_info *ei,
 				struct rb_node *parent, struct rb_node **p)
@@ -33,8 +53,9 @@ static struct extent_node *__attach_extent_node(struct f2fs_sb_info *sbi,
 
 	en->ei = *ei;
 	INIT_LIST_HEAD(&en->list);
+	en->referenced = false;
 
-	rb_link_node(&en->rb_node, parent, p);
+	rb_link_node_rcu(&en->rb_node, parent, p);
 	rb_insert_color(&en->rb_node, &et->root);
 	et->count++;
 	atomic_inc(&sbi->total_ext_node);
@@ -68,6 +89,7 @@ static struct extent_tree *__grab_extent_tree(struct inode *inode)
 		et->root = RB_ROOT;
 		et->cached_en = NULL;
 		rwlock_init(&et->lock);
+		seqcount_init(&et->seq);
 		atomic_set(&et->refcount, 0);
 		et->count = 0;
 		sbi->total_ext_tree++;
@@ -81,34 +103,51 @@ static struct extent_tree *__grab_extent_tree(struct inode *inode)
 	return et;
 }
 
-static struct extent_node *__lookup_extent_tree(struct f2fs_sb_info *sbi,
-				struct extent_tree *et, unsigned int fofs)
+enum {
+	EXTENT_MISS,
+	EXTENT_HIT_LARGEST,
+	EXTENT_HIT_CACHED,
+	EXTENT_HIT_RBTREE,
+};
+
+/*
+ * Copies the extent at @fofs to @ei and sets @en to its node, if it has
+ * one. Without et->lock, the result is only good if et->seq says so.
+ */
+static int __lookup_extent_tree(struct extent_tree *et, unsigned int fofs,
+			struct extent_info *ei, struct extent_node **en)
 {
-	struct rb_node *node = et->root.rb_node;
-	struct extent_node *en = et->cached_en;
+	struct rb_node *node;
+	struct extent_node *cur;
 
-	if (en) {
-		struct extent_info *cei = &en->ei;
+	if (et->largest.fofs <= fofs &&
+			et->largest.fofs + et->largest.len > fofs) {
+		*ei = et->largest;
+		return EXTENT_HIT_LARGEST;
+	}
 
-		if (cei->fofs <= fofs && cei->fofs + cei->len > fofs) {
-			stat_inc_cached_node_hit(sbi);
-			return en;
-		}
+	cur = READ_ONCE(et->cached_en);
+	if (cur && cur->ei.fofs <= fofs && cur->ei.fofs + cur->ei.len > fofs) {
+		*ei = cur->ei;
+		*en = cur;
+		return EXTENT_HIT_CACHED;
 	}
 
+	node = rcu_dereference_raw(et->root.rb_node);
 	while (node) {
-		en = rb_entry(node, struct extent_node, rb_node);
+		cur = rb_entry(node, struct extent_node, rb_node);
 
-		if (fofs < en->ei.fofs) {
-			node = node->rb_left;
-		} else if (fofs >= en->ei.fofs + en->ei.len) {
-			node = node->rb_right;
+		if (fofs < cur->ei.fofs) {
+			node = rcu_dereference_raw(node->rb_left);
+		} else if (fofs >= cur->ei.fofs + cur->ei.len) {
+			node = rcu_dereference_raw(node->rb_right);
 		} else {
-			stat_inc_rbtree_node_hit(sbi);
-			return en;
+			*ei = cur->ei;
+			*en = cur;
+			return EXTENT_HIT_RBTREE;
 		}
 	}
-	return NULL;
+	return EXTENT_MISS;
 }
 
 static struct extent_node *__init_extent_tree(struct f2fs_sb_info *sbi,
@@ -190,7 +229,7 @@ void f2fs_init_extent_tree(struct inode *inode, struct f2fs_extent *i_ext)
 	set_extent_info(&ei, le32_to_cpu(i_ext->fofs),
 		le32_to_cpu(i_ext->blk), le32_to_cpu(i_ext->len));
 
-	write_lock(&et->lock);
+	__lock_extent_tree(et);
 	if (et->count)
 		goto out;
 
@@ -201,7 +240,7 @@ void f2fs_init_extent_tree(struct inode *inode, struct f2fs_extent *i_ext)
 		spin_unlock(&sbi->extent_lock);
 	}
 out:
-	write_unlock(&et->lock);
+	__unlock_extent_tree(et);
 }
 
 static bool f2fs_lookup_extent_tree(struct inode *inode, pgoff_t pgofs,
@@ -209,39 +248,49 @@ static bool f2fs_lookup_extent_tree(struct inode *inode, pgoff_t pgofs,
 {
 	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
 	struct extent_tree *et = F2FS_I(inode)->extent_tree;
-	struct extent_node *en;
-	bool ret = false;
+	struct extent_node *en = NULL;
+	unsigned int seq;
+	int hit;
 
 	f2fs_bug_on(sbi, !et);
 
 	trace_f2fs_lookup_extent_tree_start(inode, pgofs);
 
-	read_lock(&et->lock);
-
-	if (et->largest.fofs <= pgofs &&
-			et->largest.fofs + et->largest.len > pgofs) {
-		*ei = et->largest;
-		ret = true;
-		stat_inc_largest_node_hit(sbi);
-		goto out;
+	rcu_read_lock();
+	seq = read_seqcount_begin(&et->seq);
+	hit = __lookup_extent_tree(et, pgofs, ei, &en);
+	if (read_seqcount_retry(&et->seq, seq)) {
+		rcu_read_unlock();
+
+		/* raced with a change of the tree */
+		read_lock(&et->lock);
+		en = NULL;
+		hit = __lookup_extent_tree(et, pgofs, ei, &en);
+		if (en && !en->referenced)
+			WRITE_ONCE(en->referenced, true);
+		read_unlock(&et->lock);
+	} else {
+		/*
+		 * Rather than moving the node to the tail of the LRU list
+		 * under extent_lock, leave that to the shrinker. The node is
+		 * only written the first time, so that lookups on other cpus
+		 * keep sharing its cacheline.
+		 */
+		if (en && !READ_ONCE(en->referenced))
+			WRITE_ONCE(en->referenced, true);
+		rcu_read_unlock();
 	}
 
-	en = __lookup_extent_tree(sbi, et, pgofs);
-	if (en) {
-		*ei = en->ei;
-		spin_lock(&sbi->extent_lock);
-		if (!list_empty(&en->list))
-			list_move_tail(&en->list, &sbi->extent_list);
-		et->cached_en = en;
-		spin_unlock(&sbi->extent_lock);
-		ret = true;
-	}
-out:
+	if (hit == EXTENT_HIT_LARGEST)
+		stat_inc_largest_node_hit(sbi);
+	else if (hit == EXTENT_HIT_CACHED)
+		stat_inc_cached_node_hit(sbi);
+	else if (hit == EXTENT_HIT_RBTREE)
+		stat_inc_rbtree_node_hit(sbi);
 	stat_inc_total_hit(sbi);
-	read_unlock(&et->lock);
 
 	trace_f2fs_lookup_extent_tree_end(inode, pgofs, ei);
-	return ret;
+	return hit != EXTENT_MISS;
 }
 
 
@@ -410,10 +459,10 @@ static unsigned int f2fs_update_extent_tree_range(struct inode *inode,
 
 	trace_f2fs_update_extent_tree_range(inode, fofs, blkaddr, len);
 
-	write_lock(&et->lock);
+	__lock_extent_tree(et);
 
 	if (is_inode_flag_set(F2FS_I(inode), FI_NO_EXTENT)) {
-		write_unlock(&et->lock);
+		__unlock_extent_tree(et);
 		return false;
 	}
 
@@ -541,7 +590,7 @@ static unsigned int f2fs_update_extent_tree_range(struct inode *inode,
 	if (is_inode_flag_set(F2FS_I(inode), FI_NO_EXTENT))
 		__free_extent_tree(sbi, et, true);
 
-	write_unlock(&et->lock);
+	__unlock_extent_tree(et);
 
 	return !__is_extent_same(&prev, &et->largest);
 }
@@ -550,6 +599,7 @@ unsigned int f2fs_shrink_extent_tree(struct f2fs_sb_info *sbi, int nr_shrink)
 {
 	struct extent_tree *treevec[EXT_TREE_VEC_SIZE];
 	struct extent_node *en, *tmp;
+	LIST_HEAD(referenced);
 	unsigned long ino = F2FS_ROOT_INO(sbi);
 	struct radix_tree_root *root = &sbi->extent_tree_root;
 	unsigned int found;
@@ -572,9 +622,9 @@ unsigned int f2fs_shrink_extent_tree(struct f2fs_sb_info *sbi, int nr_shrink)
 			struct extent_tree *et = treevec[i];
 
 			if (!atomic_read(&et->refcount)) {
-				write_lock(&et->lock);
+				__lock_extent_tree(et);
 				node_cnt += __free_extent_tree(sbi, et, true);
-				write_unlock(&et->lock);
+				__unlock_extent_tree(et);
 
 				radix_tree_delete(root, et->ino);
 				kmem_cache_free(extent_tree_slab, et);
@@ -594,12 +644,20 @@ unsigned int f2fs_shrink_extent_tree(struct f2fs_sb_info *sbi, int nr_shrink)
 
 	remained = nr_shrink - (node_cnt + tree_cnt);
 
+	/* lookups only mark nodes, they are moved to the tail here */
 	spin_lock(&sbi->extent_lock);
 	list_for_each_entry_safe(en, tmp, &sbi->extent_list, list) {
-		if (!remained--)
+		if (!remained)
 			break;
+		if (en->referenced) {
+			en->referenced = false;
+			list_move_tail(&en->list, &referenced);
+			continue;
+		}
 		list_del_init(&en->list);
+		remained--;
 	}
+	list_splice_tail(&referenced, &sbi->extent_list);
 	spin_unlock(&sbi->extent_lock);
 
 	/*
@@ -615,9 +673,9 @@ unsigned int f2fs_shrink_extent_tree(struct f2fs_sb_info *sbi, int nr_shrink)
 		for (i = 0; i < found; i++) {
 			struct extent_tree *et = treevec[i];
 
-			write_lock(&et->lock);
+			__lock_extent_tree(et);
 			node_cnt += __free_extent_tree(sbi, et, false);
-			write_unlock(&et->lock);
+			__unlock_extent_tree(et);
 
 			if (node_cnt + tree_cnt >= nr_shrink)
 				goto unlock_out;
@@ -640,9 +698,9 @@ unsigned int f2fs_destroy_extent_node(struct inode *inode)
 	if (!et)
 		return 0;
 
-	write_lock(&et->lock);
+	__lock_extent_tree(et);
 	node_cnt = __free_extent_tree(sbi, et, true);
-	write_unlock(&et->lock);
+	__unlock_extent_tree(et);
 
 	return node_cnt;
 }
@@ -732,8 +790,9 @@ int __init create_extent_cache(void)
 			sizeof(struct extent_tree));
 	if (!extent_tree_slab)
 		return -ENOMEM;
-	extent_node_slab = f2fs_kmem_cache_create("f2fs_extent_node",
-			sizeof(struct extent_node));
+	extent_node_slab = kmem_cache_create("f2fs_extent_node",
+			sizeof(struct extent_node), 0,
+			SLAB_RECLAIM_ACCOUNT | SLAB_DESTROY_BY_RCU, NULL);
 	if (!extent_node_slab) {
 		kmem_cache_destroy(extent_tree_slab);
 		return -ENOMEM;
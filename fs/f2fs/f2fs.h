@@ -350,6 +350,7 @@ struct extent_node {
 	struct rb_node rb_node;		/* rb node located in rb-tree */
 	struct list_head list;		/* node in global extent list of sbi */
 	struct extent_info ei;		/* extent info */
+	bool referenced;		/* looked up since put on the list */
 };
 
 struct extent_tree {
@@ -358,6 +359,7 @@ struct extent_tree {
 	struct extent_node *cached_en;	/* recently accessed extent node */
 	struct extent_info largest;	/* largested extent info */
 	rwlock_t lock;			/* protect extent info rb-tree */
+	seqcount_t seq;			/* for lookups without the lock */
 	atomic_t refcount;		/* reference count of rb-tree */
 	unsigned int count;		/* # of extent node in rb-tree*/
 };
@@ -441,6 +443,10 @@ struct f2fs_inode_info {
 
 	struct extent_tree *extent_tree;	/* cached extent_tree entry */
 
+	/* blocks rewritten, decaying over time, see is_hot_data() */
+	unsigned int i_write_heat;
+	unsigned long i_heat_stamp;		/* jiffies of the last decay */
+
 #ifdef CONFIG_F2FS_FS_ENCRYPTION
 	/* Encryption params */
 	struct f2fs_crypt_info *i_crypt_info;
@@ -598,6 +604,18 @@ struct flush_cmd_control {
 	struct llist_node *dispatch_list;	/* list for command dispatch */
 };
 
+struct discard_cmd_control {
+	struct task_struct *f2fs_issue_discard;	/* discard thread */
+	wait_queue_head_t discard_wait_queue;	/* waiting queue for wake-up */
+	wait_queue_head_t issue_wait_queue;	/* waiting for issue_seq */
+	struct mutex cmd_lock;			/* for the list and segmap */
+	struct discard_entry *issuing;		/* being issued by the thread */
+	unsigned int issue_seq;			/* # of issues ended */
+	struct list_head discard_cmd_list;	/* pending, in address order */
+	unsigned long *pend_segmap;		/* segments with pending ones */
+	int nr_discard_cmds;			/* # of pending commands */
+};
+
 struct f2fs_sm_info {
 	struct sit_info *sit_info;		/* whole segment information */
 	struct free_segmap_info *free_info;	/* free segment information */
@@ -630,9 +648,17 @@ struct f2fs_sm_info {
 	unsigned int min_ipu_util;	/* in-place-update threshold */
 	unsigned int min_fsync_blocks;	/* threshold for fsync */
 
+	/* for write temperature */
+	unsigned int hot_data_threshold;	/* write heat of hot data */
+	unsigned int heat_decay_interval;	/* write heat halves, in secs */
+	unsigned long long temp_blocks[NR_CURSEG_DATA_TYPE]; /* written */
+
 	/* for flush command control */
 	struct flush_cmd_control *cmd_control_info;
 
+	/* for asynchronous discard */
+	struct discard_cmd_control *dcc_info;
+
 };
 
 /*
@@ -1772,6 +1798,10 @@ void f2fs_balance_fs_bg(struct f2fs_sb_info *);
 int f2fs_issue_flush(struct f2fs_sb_info *);
 int create_flush_cmd_control(struct f2fs_sb_info *);
 void destroy_flush_cmd_control(struct f2fs_sb_info *);
+int start_discard_thread(struct f2fs_sb_info *);
+void stop_discard_thread(struct f2fs_sb_info *);
+int create_discard_cmd_control(struct f2fs_sb_info *);
+void destroy_discard_cmd_control(struct f2fs_sb_info *);
 void invalidate_blocks(struct f2fs_sb_info *, block_t);
 bool is_checkpointed_data(struct f2fs_sb_info *, block_t);
 void refresh_sit_entry(struct f2fs_sb_info *, block_t, block_t);
@@ -1893,6 +1923,8 @@ struct f2fs_stat_info {
 	int bg_node_segs, bg_data_segs;
 	int tot_blks, data_blks, node_blks;
 	int bg_data_blks, bg_node_blks;
+	int gc_passes;
+	unsigned long long gc_pass_time, gc_pass_max;
 	int curseg[NR_CURSEG_TYPE];
 	int cursec[NR_CURSEG_TYPE];
 	int curzone[NR_CURSEG_TYPE];
@@ -1985,6 +2017,17 @@ static inline struct f2fs_stat_info *F2FS_STAT(struct f2fs_sb_info *sbi)
 		si->bg_node_blks += (gc_type == BG_GC) ? (blks) : 0;	\
 	} while (0)
 
+/* one pass of f2fs_gc() over a victim section, taking @ns nanoseconds */
+#define stat_inc_gc_pass(sbi, ns)					\
+	do {								\
+		struct f2fs_stat_info *si = F2FS_STAT(sbi);		\
+		u64 __ns = (ns);					\
+		si->gc_passes++;					\
+		si->gc_pass_time += __ns;				\
+		if (__ns > si->gc_pass_max)				\
+			si->gc_pass_max = __ns;				\
+	} while (0)
+
 int f2fs_build_stats(struct f2fs_sb_info *);
 void f2fs_destroy_stats(struct f2fs_sb_info *);
 void __init f2fs_create_root_stats(void);
@@ -2012,6 +2055,7 @@ void f2fs_destroy_root_stats(void);
 #define stat_inc_tot_blk_count(si, blks)
 #define stat_inc_data_blk_count(sbi, blks, gc_type)
 #define stat_inc_node_blk_count(sbi, blks, gc_type)
+#define stat_inc_gc_pass(sbi, ns)
 
 static inline int f2fs_build_stats(struct f2fs_sb_info *sbi) { return 0; }
 static inline void f2fs_destroy_stats(struct f2fs_sb_info *sbi) { }
@@ -246,58 +246,86 @@ static inline unsigned int get_gc_cost(struct f2fs_sb_info *sbi,
 		return get_cb_cost(sbi, segno);
 }
 
-/*
- * This function is called from two paths.
- * One is garbage collection and the other is SSR segment selection.
- * When it is called during GC, it just gets a victim segment
- * and it does not remove it from dirty seglist.
- * When it is called from SSR segment selection, it finds a segment
- * which has minimum valid blocks and removes it from dirty seglist.
- */
-static int get_victim_by_default(struct f2fs_sb_info *sbi,
-		unsigned int *result, int gc_type, int type, char alloc_mode)
+/* Considers the first section of @root that may be collected */
+static void check_victim_tree(struct f2fs_sb_info *sbi, struct rb_root *root,
+			struct victim_sel_policy *p, int gc_type, bool greedy)
 {
 	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
-	struct victim_sel_policy p;
-	unsigned int secno, max_cost;
-	unsigned int last_segment = MAIN_SEGS(sbi);
-	int nsearched = 0;
+	struct rb_node *node;
 
-	mutex_lock(&dirty_i->seglist_lock);
+	for (node = rb_first(root); node; node = rb_next(node)) {
+		struct victim_entry *ve;
+		unsigned int secno, segno, cost;
 
-	p.alloc_mode = alloc_mode;
-	select_policy(sbi, gc_type, type, &p);
+		if (greedy)
+			ve = rb_entry(node, struct victim_entry, greedy_node);
+		else
+			ve = rb_entry(node, struct victim_entry, cb_node);
+		secno = ve - dirty_i->victim_entries;
+		segno = secno * sbi->segs_per_sec;
 
-	p.min_segno = NULL_SEGNO;
-	p.min_cost = max_cost = get_max_cost(sbi, &p);
+		if (sec_usage_check(sbi, secno))
+			continue;
+		if (gc_type == BG_GC && test_bit(secno, dirty_i->victim_secmap))
+			continue;
 
-	if (p.max_search == 0)
-		goto out;
+		cost = get_gc_cost(sbi, segno, p);
+		if (p->min_cost > cost) {
+			p->min_segno = segno;
+			p->min_cost = cost;
+		}
+		return;
+	}
+}
 
-	if (p.alloc_mode == LFS && gc_type == FG_GC) {
-		p.min_segno = check_bg_victims(sbi);
-		if (p.min_segno != NULL_SEGNO)
-			goto got_it;
+/*
+ * GC victims come from the victim index rather than a scan of the dirty
+ * segmap: greedy takes the usable section with the fewest valid blocks, and
+ * cost-benefit the oldest usable section of each utilization, whose cost is
+ * the lowest of all sections of that utilization.
+ */
+static void get_victim_from_index(struct f2fs_sb_info *sbi,
+				struct victim_sel_policy *p, int gc_type)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	int u;
+
+	if (p->gc_mode == GC_GREEDY) {
+		check_victim_tree(sbi, &dirty_i->greedy_root, p, gc_type, true);
+		return;
 	}
 
+	for (u = 0; u < NR_CB_VICTIM_TREES; u++)
+		check_victim_tree(sbi, &dirty_i->cb_root[u], p, gc_type, false);
+}
+
+static void get_victim_by_scan(struct f2fs_sb_info *sbi,
+			struct victim_sel_policy *p, int gc_type,
+			unsigned int max_cost)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	unsigned int last_segment = MAIN_SEGS(sbi);
+	unsigned int secno;
+	int nsearched = 0;
+
 	while (1) {
 		unsigned long cost;
 		unsigned int segno;
 
-		segno = find_next_bit(p.dirty_segmap, last_segment, p.offset);
+		segno = find_next_bit(p->dirty_segmap, last_segment, p->offset);
 		if (segno >= last_segment) {
-			if (sbi->last_victim[p.gc_mode]) {
-				last_segment = sbi->last_victim[p.gc_mode];
-				sbi->last_victim[p.gc_mode] = 0;
-				p.offset = 0;
+			if (sbi->last_victim[p->gc_mode]) {
+				last_segment = sbi->last_victim[p->gc_mode];
+				sbi->last_victim[p->gc_mode] = 0;
+				p->offset = 0;
 				continue;
 			}
 			break;
 		}
 
-		p.offset = segno + p.ofs_unit;
-		if (p.ofs_unit > 1)
-			p.offset -= segno % p.ofs_unit;
+		p->offset = segno + p->ofs_unit;
+		if (p->ofs_unit > 1)
+			p->offset -= segno % p->ofs_unit;
 
 		secno = GET_SECNO(sbi, segno);
 
@@ -306,20 +334,59 @@ static int get_victim_by_default(struct f2fs_sb_info *sbi,
 		if (gc_type == BG_GC && test_bit(secno, dirty_i->victim_secmap))
 			continue;
 
-		cost = get_gc_cost(sbi, segno, &p);
+		cost = get_gc_cost(sbi, segno, p);
 
-		if (p.min_cost > cost) {
-			p.min_segno = segno;
-			p.min_cost = cost;
+		if (p->min_cost > cost) {
+			p->min_segno = segno;
+			p->min_cost = cost;
 		} else if (unlikely(cost == max_cost)) {
 			continue;
 		}
 
-		if (nsearched++ >= p.max_search) {
-			sbi->last_victim[p.gc_mode] = segno;
+		if (nsearched++ >= p->max_search) {
+			sbi->last_victim[p->gc_mode] = segno;
 			break;
 		}
 	}
+}
+
+/*
+ * This function is called from two paths.
+ * One is garbage collection and the other is SSR segment selection.
+ * When it is called during GC, it just gets a victim segment
+ * and it does not remove it from dirty seglist.
+ * When it is called from SSR segment selection, it finds a segment
+ * which has minimum valid blocks and removes it from dirty seglist.
+ */
+static int get_victim_by_default(struct f2fs_sb_info *sbi,
+		unsigned int *result, int gc_type, int type, char alloc_mode)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	struct victim_sel_policy p;
+	unsigned int secno, max_cost;
+
+	mutex_lock(&dirty_i->seglist_lock);
+
+	p.alloc_mode = alloc_mode;
+	select_policy(sbi, gc_type, type, &p);
+
+	p.min_segno = NULL_SEGNO;
+	p.min_cost = max_cost = get_max_cost(sbi, &p);
+
+	if (p.max_search == 0)
+		goto out;
+
+	if (p.alloc_mode == LFS && gc_type == FG_GC) {
+		p.min_segno = check_bg_victims(sbi);
+		if (p.min_segno != NULL_SEGNO)
+			goto got_it;
+	}
+
+	if (p.alloc_mode == LFS)
+		get_victim_from_index(sbi, &p, gc_type);
+	else
+		get_victim_by_scan(sbi, &p, gc_type, max_cost);
+
 	if (p.min_segno != NULL_SEGNO) {
 got_it:
 		if (p.alloc_mode == LFS) {
@@ -535,7 +602,72 @@ static bool is_alive(struct f2fs_sb_info *sbi, struct f2fs_summary *sum,
 	return true;
 }
 
-static void move_encrypted_block(struct inode *inode, block_t bidx)
+/*
+ * Starts reading a valid block of the victim into the page cache of its
+ * inode. The read is added to the merged read bio, so that the blocks of a
+ * segment go out in as few requests as they are contiguous; the caller
+ * submits it once the whole segment has been walked.
+ */
+static void ra_data_block(struct inode *inode, block_t bidx, block_t blkaddr)
+{
+	struct f2fs_io_info fio = {
+		.sbi = F2FS_I_SB(inode),
+		.type = DATA,
+		.rw = READA,
+		.blk_addr = blkaddr,
+		.encrypted_page = NULL,
+	};
+	struct page *page;
+
+	page = f2fs_grab_cache_page(inode->i_mapping, bidx, false);
+	if (!page)
+		return;
+	if (PageUptodate(page)) {
+		f2fs_put_page(page, 1);
+		return;
+	}
+
+	/* the page is unlocked when the read completes */
+	fio.page = page;
+	f2fs_submit_page_mbio(&fio);
+	f2fs_put_page(page, 0);
+}
+
+/*
+ * Same for an encrypted block, which is moved as it is on disk: its
+ * ciphertext is read into the meta mapping, where move_encrypted_block()
+ * finds it. A page left there by an earlier pass may hold what used to be
+ * at this address, so it is always read again.
+ */
+static void ra_encrypted_block(struct f2fs_sb_info *sbi, block_t blkaddr)
+{
+	struct f2fs_io_info fio = {
+		.sbi = sbi,
+		.type = DATA,
+		.rw = READA,
+		.blk_addr = blkaddr,
+		.encrypted_page = NULL,
+	};
+	struct page *page;
+
+	page = pagecache_get_page(META_MAPPING(sbi), blkaddr,
+					FGP_LOCK|FGP_CREAT, GFP_NOFS);
+	if (!page)
+		return;
+
+	f2fs_wait_on_page_writeback(page, DATA);
+	ClearPageUptodate(page);
+	fio.page = page;
+	f2fs_submit_page_mbio(&fio);
+	f2fs_put_page(page, 0);
+}
+
+/*
+ * @ra_addr is where gc_data_segment() read the block ahead; if the block is
+ * still there, the read has already been done.
+ */
+static void move_encrypted_block(struct inode *inode, block_t bidx,
+							block_t ra_addr)
 {
 	struct f2fs_io_info fio = {
 		.sbi = F2FS_I_SB(inode),
@@ -584,13 +716,14 @@ static void move_encrypted_block(struct inode *inode, block_t bidx)
 	if (!fio.encrypted_page)
 		goto put_out;
 
-	err = f2fs_submit_page_bio(&fio);
-	if (err)
-		goto put_page_out;
+	if (fio.blk_addr != ra_addr || !PageUptodate(fio.encrypted_page)) {
+		err = f2fs_submit_page_bio(&fio);
+		if (err)
+			goto put_page_out;
+		lock_page(fio.encrypted_page);
+	}
 
 	/* write page */
-	lock_page(fio.encrypted_page);
-
 	if (unlikely(!PageUptodate(fio.encrypted_page)))
 		goto put_page_out;
 	if (unlikely(fio.encrypted_page->mapping != META_MAPPING(fio.sbi)))
@@ -678,8 +811,15 @@ static int gc_data_segment(struct f2fs_sb_info *sbi, struct f2fs_summary *sum,
 next_step:
 	entry = sum;
 
+	/*
+	 * Drop what earlier passes left of this segment in the meta mapping,
+	 * so that move_encrypted_block() only finds blocks read ahead now.
+	 */
+	if (phase == 2)
+		invalidate_mapping_pages(META_MAPPING(sbi), start_addr,
+					start_addr + sbi->blocks_per_seg - 1);
+
 	for (off = 0; off < sbi->blocks_per_seg; off++, entry++) {
-		struct page *data_page;
 		struct inode *inode;
 		struct node_info dni; /* dnode info for the data */
 		unsigned int ofs_in_node, nofs;
@@ -713,22 +853,15 @@ next_step:
 			if (IS_ERR(inode) || is_bad_inode(inode))
 				continue;
 
-			/* if encrypted inode, let's go phase 3 */
 			if (f2fs_encrypted_inode(inode) &&
 						S_ISREG(inode->i_mode)) {
-				add_gc_inode(gc_list, inode);
-				continue;
-			}
-
-			start_bidx = start_bidx_of_node(nofs, F2FS_I(inode));
-			data_page = get_read_data_page(inode,
-					start_bidx + ofs_in_node, READA, true);
-			if (IS_ERR(data_page)) {
-				iput(inode);
-				continue;
+				ra_encrypted_block(sbi, start_addr + off);
+			} else {
+				start_bidx = start_bidx_of_node(nofs,
+								F2FS_I(inode));
+				ra_data_block(inode, start_bidx + ofs_in_node,
+							start_addr + off);
 			}
-
-			f2fs_put_page(data_page, 0);
 			add_gc_inode(gc_list, inode);
 			continue;
 		}
@@ -739,13 +872,16 @@ next_step:
 			start_bidx = start_bidx_of_node(nofs, F2FS_I(inode))
 								+ ofs_in_node;
 			if (f2fs_encrypted_inode(inode) && S_ISREG(inode->i_mode))
-				move_encrypted_block(inode, start_bidx);
+				move_encrypted_block(inode, start_bidx,
+							start_addr + off);
 			else
 				move_data_page(inode, start_bidx, gc_type);
 			stat_inc_data_blk_count(sbi, 1, gc_type);
 		}
 	}
 
+	if (phase == 2)
+		f2fs_submit_merged_bio(sbi, DATA, READ);
 	if (++phase < 4)
 		goto next_step;
 
@@ -818,6 +954,7 @@ int f2fs_gc(struct f2fs_sb_info *sbi, bool sync)
 {
 	unsigned int segno, i;
 	int gc_type = sync ? FG_GC : BG_GC;
+	u64 start;
 	int sec_freed = 0;
 	int ret = -EINVAL;
 	struct cp_control cpc;
@@ -845,6 +982,8 @@ gc_more:
 		goto stop;
 	ret = 0;
 
+	start = ktime_get_ns();
+
 	/* readahead multi ssa blocks those have contiguous address */
 	if (sbi->segs_per_sec > 1)
 		ra_meta_pages(sbi, GET_SUM_BLOCK(sbi, segno), sbi->segs_per_sec,
@@ -860,6 +999,8 @@ gc_more:
 			break;
 	}
 
+	stat_inc_gc_pass(sbi, ktime_get_ns() - start);
+
 	if (i == sbi->segs_per_sec && gc_type == FG_GC)
 		sec_freed++;
 
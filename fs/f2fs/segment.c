@@ -20,6 +20,7 @@
 #include "f2fs.h"
 #include "segment.h"
 #include "node.h"
+#include "gc.h"
 #include "trace.h"
 #include <trace/events/f2fs.h>
 
@@ -417,6 +418,89 @@ void destroy_flush_cmd_control(struct f2fs_sb_info *sbi)
 	SM_I(sbi)->cmd_control_info = NULL;
 }
 
+static void __insert_victim_entry(struct rb_root *root,
+				struct victim_entry *ve, bool greedy)
+{
+	struct rb_node **p = &root->rb_node, *parent = NULL;
+	unsigned long long key = greedy ? ve->vblocks : ve->mtime;
+
+	while (*p) {
+		struct victim_entry *e;
+		unsigned long long k;
+
+		parent = *p;
+		if (greedy) {
+			e = rb_entry(parent, struct victim_entry, greedy_node);
+			k = e->vblocks;
+		} else {
+			e = rb_entry(parent, struct victim_entry, cb_node);
+			k = e->mtime;
+		}
+
+		/* sections of the same key are kept in address order */
+		if (key < k || (key == k && ve < e))
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+
+	if (greedy) {
+		rb_link_node(&ve->greedy_node, parent, p);
+		rb_insert_color(&ve->greedy_node, root);
+	} else {
+		rb_link_node(&ve->cb_node, parent, p);
+		rb_insert_color(&ve->cb_node, root);
+	}
+}
+
+/*
+ * Keeps the section of segno in the victim index as long as one of its
+ * segments is in the DIRTY segmap, sorted by its valid blocks for greedy GC
+ * and by its age within its utilization for cost-benefit GC. It has to be
+ * called under seglist_lock whenever the dirty state or the valid blocks of
+ * a segment change, which update_sit_entry() callers do through
+ * locate_dirty_segment().
+ */
+static void update_victim_entry(struct f2fs_sb_info *sbi, unsigned int segno)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	unsigned int secno = GET_SECNO(sbi, segno);
+	unsigned int start = secno * sbi->segs_per_sec;
+	unsigned int end = start + sbi->segs_per_sec;
+	struct victim_entry *ve = &dirty_i->victim_entries[secno];
+	unsigned long long mtime = 0;
+	unsigned int vblocks, i;
+
+	if (find_next_bit(dirty_i->dirty_segmap[DIRTY], end, start) >= end) {
+		if (ve->queued) {
+			rb_erase(&ve->greedy_node, &dirty_i->greedy_root);
+			rb_erase(&ve->cb_node, &dirty_i->cb_root[ve->u]);
+			ve->queued = false;
+		}
+		return;
+	}
+
+	for (i = start; i < end; i++)
+		mtime += get_seg_entry(sbi, i)->mtime;
+	vblocks = get_valid_blocks(sbi, segno, sbi->segs_per_sec);
+
+	if (ve->queued) {
+		if (ve->vblocks == vblocks && ve->mtime == mtime)
+			return;
+		rb_erase(&ve->greedy_node, &dirty_i->greedy_root);
+		rb_erase(&ve->cb_node, &dirty_i->cb_root[ve->u]);
+	}
+
+	/* the same utilization as get_cb_cost() works out */
+	ve->u = ((vblocks / sbi->segs_per_sec) * 100) >>
+					sbi->log_blocks_per_seg;
+	ve->vblocks = vblocks;
+	ve->mtime = mtime;
+	ve->queued = true;
+	__insert_victim_entry(&dirty_i->greedy_root, ve, true);
+	__insert_victim_entry(&dirty_i->cb_root[ve->u], ve, false);
+}
+
 static void __locate_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno,
 		enum dirty_type dirty_type)
 {
@@ -439,6 +523,8 @@ static void __locate_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno,
 		}
 		if (!test_and_set_bit(segno, dirty_i->dirty_segmap[t]))
 			dirty_i->nr_dirty[t]++;
+
+		update_victim_entry(sbi, segno);
 	}
 }
 
@@ -460,6 +546,8 @@ static void __remove_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno,
 		if (get_valid_blocks(sbi, segno, sbi->segs_per_sec) == 0)
 			clear_bit(GET_SECNO(sbi, segno),
 						dirty_i->victim_secmap);
+
+		update_victim_entry(sbi, segno);
 	}
 }
 
@@ -473,11 +561,21 @@ static void locate_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno)
 	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
 	unsigned short valid_blocks;
 
-	if (segno == NULL_SEGNO || IS_CURSEG(sbi, segno))
+	if (segno == NULL_SEGNO)
 		return;
 
 	mutex_lock(&dirty_i->seglist_lock);
 
+	/*
+	 * A current segment is never dirty, but the victim entry of its
+	 * section is keyed by the valid blocks of all of its segments.
+	 */
+	if (IS_CURSEG(sbi, segno)) {
+		if (sbi->segs_per_sec > 1)
+			update_victim_entry(sbi, segno);
+		goto out;
+	}
+
 	valid_blocks = get_valid_blocks(sbi, segno, 0);
 
 	if (valid_blocks == 0) {
@@ -489,15 +587,13 @@ static void locate_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno)
 		/* Recovery routine with SSR needs this */
 		__remove_dirty_segment(sbi, segno, DIRTY);
 	}
-
+out:
 	mutex_unlock(&dirty_i->seglist_lock);
 }
 
-static int f2fs_issue_discard(struct f2fs_sb_info *sbi,
+static void __mark_discarded(struct f2fs_sb_info *sbi,
 				block_t blkstart, block_t blklen)
 {
-	sector_t start = SECTOR_FROM_BLOCK(blkstart);
-	sector_t len = SECTOR_FROM_BLOCK(blklen);
 	struct seg_entry *se;
 	unsigned int offset;
 	block_t i;
@@ -509,10 +605,345 @@ static int f2fs_issue_discard(struct f2fs_sb_info *sbi,
 		if (!f2fs_test_and_set_bit(offset, se->discard_map))
 			sbi->discard_blks--;
 	}
+}
+
+static void __unmark_discarded(struct f2fs_sb_info *sbi,
+				block_t blkstart, block_t blklen)
+{
+	struct seg_entry *se;
+	unsigned int offset;
+	block_t i;
+
+	for (i = blkstart; i < blkstart + blklen; i++) {
+		se = get_seg_entry(sbi, GET_SEGNO(sbi, i));
+		offset = GET_BLKOFF_FROM_SEG0(sbi, i);
+
+		if (f2fs_test_and_clear_bit(offset, se->discard_map))
+			sbi->discard_blks++;
+	}
+}
+
+static int __f2fs_issue_discard(struct f2fs_sb_info *sbi,
+				block_t blkstart, block_t blklen)
+{
+	sector_t start = SECTOR_FROM_BLOCK(blkstart);
+	sector_t len = SECTOR_FROM_BLOCK(blklen);
+
 	trace_f2fs_issue_discard(sbi->sb, blkstart, blklen);
 	return blkdev_issue_discard(sbi->sb->s_bdev, start, len, GFP_NOFS, 0);
 }
 
+static int f2fs_issue_discard(struct f2fs_sb_info *sbi,
+				block_t blkstart, block_t blklen)
+{
+	__mark_discarded(sbi, blkstart, blklen);
+	return __f2fs_issue_discard(sbi, blkstart, blklen);
+}
+
+static void __remove_discard_cmd(struct discard_cmd_control *dcc,
+					struct discard_entry *entry)
+{
+	list_del(&entry->list);
+	dcc->nr_discard_cmds--;
+	kmem_cache_free(discard_entry_slab, entry);
+}
+
+/*
+ * Adds a range to the pending commands, which are kept in address order,
+ * merging it with the commands right before and after it.
+ */
+static void __insert_discard_cmd(struct f2fs_sb_info *sbi,
+				block_t blkstart, block_t blklen)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	struct list_head *head = &dcc->discard_cmd_list;
+	struct discard_entry *prev = NULL, *next, *new;
+	unsigned int segno;
+
+	/* ranges come mostly in address order, so search from the tail */
+	list_for_each_entry_reverse(next, head, list) {
+		if (next->blkaddr < blkstart) {
+			prev = next;
+			break;
+		}
+	}
+	next = list_prepare_entry(prev, head, list);
+	next = list_next_entry(next, list);
+	if (&next->list == head)
+		next = NULL;
+
+	if (prev && prev->blkaddr + prev->len == blkstart) {
+		prev->len += blklen;
+		new = prev;
+	} else {
+		new = f2fs_kmem_cache_alloc(discard_entry_slab, GFP_NOFS);
+		new->blkaddr = blkstart;
+		new->len = blklen;
+		list_add(&new->list, prev ? &prev->list : head);
+		dcc->nr_discard_cmds++;
+	}
+
+	if (next && new->blkaddr + new->len == next->blkaddr) {
+		new->len += next->len;
+		__remove_discard_cmd(dcc, next);
+	}
+
+	for (segno = GET_SEGNO(sbi, blkstart);
+			segno <= GET_SEGNO(sbi, blkstart + blklen - 1); segno++)
+		set_bit(segno, dcc->pend_segmap);
+}
+
+/* Clears the segments of a range which no pending command reaches into */
+static void __clear_pend_segments(struct f2fs_sb_info *sbi,
+				block_t blkstart, block_t blklen)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	unsigned int segno = GET_SEGNO(sbi, blkstart);
+	unsigned int end = GET_SEGNO(sbi, blkstart + blklen - 1);
+	unsigned int first, last;
+	struct discard_entry *entry;
+
+	list_for_each_entry(entry, &dcc->discard_cmd_list, list) {
+		first = GET_SEGNO(sbi, entry->blkaddr);
+		last = GET_SEGNO(sbi, entry->blkaddr + entry->len - 1);
+		if (last < segno)
+			continue;
+		if (first > end)
+			break;
+		for (; segno < first; segno++)
+			clear_bit(segno, dcc->pend_segmap);
+		segno = last + 1;
+	}
+	for (; segno <= end; segno++)
+		clear_bit(segno, dcc->pend_segmap);
+}
+
+/*
+ * Discards a range at the next idle moment of the device. A range reaching
+ * into a current segment may be allocated right after the checkpoint,
+ * without going through drain_discard_segment(), so it is discarded now.
+ */
+static void f2fs_queue_discard(struct f2fs_sb_info *sbi,
+				block_t blkstart, block_t blklen)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	unsigned int segno;
+
+	if (!dcc || !READ_ONCE(dcc->f2fs_issue_discard))
+		goto issue;
+	for (segno = GET_SEGNO(sbi, blkstart);
+			segno <= GET_SEGNO(sbi, blkstart + blklen - 1); segno++)
+		if (IS_CURSEG(sbi, segno))
+			goto issue;
+
+	__mark_discarded(sbi, blkstart, blklen);
+	mutex_lock(&dcc->cmd_lock);
+	__insert_discard_cmd(sbi, blkstart, blklen);
+	mutex_unlock(&dcc->cmd_lock);
+	wake_up(&dcc->discard_wait_queue);
+	return;
+issue:
+	f2fs_issue_discard(sbi, blkstart, blklen);
+}
+
+/*
+ * Drops the pending discards covering @segno before blocks of the segment
+ * are written again, and waits for the thread if it is issuing one there.
+ * The dropped blocks are marked as not discarded, so that they are
+ * discarded later on once they are invalid again.
+ */
+static void drain_discard_segment(struct f2fs_sb_info *sbi, unsigned int segno)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	block_t start = START_BLOCK(sbi, segno);
+	block_t end = start + sbi->blocks_per_seg;
+	struct discard_entry *entry, *this, *new;
+	block_t entry_end, from;
+	unsigned int seq;
+	bool busy;
+
+	if (!dcc || !test_bit(segno, dcc->pend_segmap))
+		return;
+
+	mutex_lock(&dcc->cmd_lock);
+	list_for_each_entry_safe(entry, this, &dcc->discard_cmd_list, list) {
+		entry_end = entry->blkaddr + entry->len;
+		if (entry->blkaddr >= end)
+			break;
+		if (entry_end <= start)
+			continue;
+
+		from = max(entry->blkaddr, start);
+		__unmark_discarded(sbi, from, min(entry_end, end) - from);
+		if (entry->blkaddr < start && entry_end > end) {
+			new = f2fs_kmem_cache_alloc(discard_entry_slab,
+								GFP_NOFS);
+			new->blkaddr = end;
+			new->len = entry_end - end;
+			list_add(&new->list, &entry->list);
+			dcc->nr_discard_cmds++;
+			entry->len = start - entry->blkaddr;
+		} else if (entry->blkaddr < start) {
+			entry->len = start - entry->blkaddr;
+		} else if (entry_end > end) {
+			entry->blkaddr = end;
+			entry->len = entry_end - end;
+		} else {
+			__remove_discard_cmd(dcc, entry);
+		}
+	}
+
+	entry = dcc->issuing;
+	busy = entry && entry->blkaddr < end &&
+				entry->blkaddr + entry->len > start;
+	seq = dcc->issue_seq;
+	/* otherwise the thread clears it once the discard is done */
+	if (!busy)
+		clear_bit(segno, dcc->pend_segmap);
+	mutex_unlock(&dcc->cmd_lock);
+
+	if (busy)
+		wait_event(dcc->issue_wait_queue,
+				READ_ONCE(dcc->issue_seq) != seq);
+}
+
+/* Issues the first pending command, returns false if there was none */
+static bool issue_discard_cmd(struct f2fs_sb_info *sbi)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	struct discard_entry *entry;
+
+	mutex_lock(&dcc->cmd_lock);
+	entry = list_first_entry_or_null(&dcc->discard_cmd_list,
+					struct discard_entry, list);
+	if (entry) {
+		list_del(&entry->list);
+		dcc->nr_discard_cmds--;
+		dcc->issuing = entry;
+	}
+	mutex_unlock(&dcc->cmd_lock);
+
+	if (!entry)
+		return false;
+
+	__f2fs_issue_discard(sbi, entry->blkaddr, entry->len);
+
+	mutex_lock(&dcc->cmd_lock);
+	dcc->issuing = NULL;
+	dcc->issue_seq++;
+	__clear_pend_segments(sbi, entry->blkaddr, entry->len);
+	mutex_unlock(&dcc->cmd_lock);
+	wake_up_all(&dcc->issue_wait_queue);
+
+	kmem_cache_free(discard_entry_slab, entry);
+	return true;
+}
+
+static int issue_discard_thread(void *data)
+{
+	struct f2fs_sb_info *sbi = data;
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	wait_queue_head_t *q = &dcc->discard_wait_queue;
+repeat:
+	if (kthread_should_stop())
+		return 0;
+
+	if (READ_ONCE(dcc->nr_discard_cmds)) {
+		/* leave the device to reads and writes while it has any */
+		if (!is_idle(sbi) &&
+		    READ_ONCE(dcc->nr_discard_cmds) < DEF_MAX_DISCARD_CMDS) {
+			wait_event_interruptible_timeout(*q,
+				kthread_should_stop(),
+				msecs_to_jiffies(DEF_DISCARD_BUSY_WAIT_MS));
+			goto repeat;
+		}
+		issue_discard_cmd(sbi);
+		goto repeat;
+	}
+
+	wait_event_interruptible(*q,
+		kthread_should_stop() || READ_ONCE(dcc->nr_discard_cmds));
+	goto repeat;
+}
+
+int start_discard_thread(struct f2fs_sb_info *sbi)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	dev_t dev = sbi->sb->s_bdev->bd_dev;
+	struct task_struct *task;
+
+	if (dcc->f2fs_issue_discard)
+		return 0;
+	task = kthread_run(issue_discard_thread, sbi,
+				"f2fs_discard-%u:%u", MAJOR(dev), MINOR(dev));
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+	WRITE_ONCE(dcc->f2fs_issue_discard, task);
+	return 0;
+}
+
+/* Stops the thread and issues what it left, so that no discard is lost */
+void stop_discard_thread(struct f2fs_sb_info *sbi)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	struct task_struct *task = dcc->f2fs_issue_discard;
+
+	if (!task)
+		return;
+	/* from now on f2fs_queue_discard() issues discards itself */
+	WRITE_ONCE(dcc->f2fs_issue_discard, NULL);
+	kthread_stop(task);
+	while (issue_discard_cmd(sbi))
+		;
+}
+
+/*
+ * The command control lives as long as the mount, since the allocation
+ * and checkpoint paths use it without locking against remount. Only the
+ * thread comes and goes with the discard option.
+ */
+int create_discard_cmd_control(struct f2fs_sb_info *sbi)
+{
+	struct discard_cmd_control *dcc;
+	int err = 0;
+
+	dcc = kzalloc(sizeof(struct discard_cmd_control), GFP_KERNEL);
+	if (!dcc)
+		return -ENOMEM;
+	dcc->pend_segmap = f2fs_kvzalloc(f2fs_bitmap_size(MAIN_SEGS(sbi)),
+								GFP_KERNEL);
+	if (!dcc->pend_segmap) {
+		kfree(dcc);
+		return -ENOMEM;
+	}
+	init_waitqueue_head(&dcc->discard_wait_queue);
+	init_waitqueue_head(&dcc->issue_wait_queue);
+	mutex_init(&dcc->cmd_lock);
+	INIT_LIST_HEAD(&dcc->discard_cmd_list);
+	SM_I(sbi)->dcc_info = dcc;
+
+	if (test_opt(sbi, DISCARD) && !f2fs_readonly(sbi->sb))
+		err = start_discard_thread(sbi);
+	if (err) {
+		kvfree(dcc->pend_segmap);
+		kfree(dcc);
+		SM_I(sbi)->dcc_info = NULL;
+	}
+	return err;
+}
+
+void destroy_discard_cmd_control(struct f2fs_sb_info *sbi)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+
+	if (!dcc)
+		return;
+	stop_discard_thread(sbi);
+	kvfree(dcc->pend_segmap);
+	kfree(dcc);
+	SM_I(sbi)->dcc_info = NULL;
+}
+
 bool discard_next_dnode(struct f2fs_sb_info *sbi, block_t blkaddr)
 {
 	int err = -ENOTSUPP;
@@ -649,16 +1080,24 @@ void clear_prefree_segments(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 		if (!test_opt(sbi, DISCARD))
 			continue;
 
-		f2fs_issue_discard(sbi, START_BLOCK(sbi, start),
+		/* fitrim reports what it trimmed once it is done */
+		if (cpc->reason == CP_DISCARD)
+			f2fs_issue_discard(sbi, START_BLOCK(sbi, start),
+				(end - start) << sbi->log_blocks_per_seg);
+		else
+			f2fs_queue_discard(sbi, START_BLOCK(sbi, start),
 				(end - start) << sbi->log_blocks_per_seg);
 	}
 	mutex_unlock(&dirty_i->seglist_lock);
 
-	/* send small discards */
+	/* send small discards, fitrim waits for them to be done */
 	list_for_each_entry_safe(entry, this, head, list) {
 		if (cpc->reason == CP_DISCARD && entry->len < cpc->trim_minlen)
 			goto skip;
-		f2fs_issue_discard(sbi, entry->blkaddr, entry->len);
+		if (cpc->reason == CP_DISCARD)
+			f2fs_issue_discard(sbi, entry->blkaddr, entry->len);
+		else
+			f2fs_queue_discard(sbi, entry->blkaddr, entry->len);
 		cpc->trimmed += entry->len;
 skip:
 		list_del(&entry->list);
@@ -996,6 +1435,7 @@ static void new_curseg(struct f2fs_sb_info *sbi, int type, bool new_sec)
 		dir = ALLOC_RIGHT;
 
 	get_new_segment(sbi, &segno, new_sec, dir);
+	drain_discard_segment(sbi, segno);
 	curseg->next_segno = segno;
 	reset_curseg(sbi, type, 1);
 	curseg->alloc_type = LFS;
@@ -1048,6 +1488,7 @@ static void change_curseg(struct f2fs_sb_info *sbi, int type, bool reuse)
 	write_sum_page(sbi, curseg->sum_blk,
 				GET_SUM_BLOCK(sbi, curseg->segno));
 	__set_test_and_inuse(sbi, new_segno);
+	drain_discard_segment(sbi, new_segno);
 
 	mutex_lock(&dirty_i->seglist_lock);
 	__remove_dirty_segment(sbi, new_segno, PRE);
@@ -1214,6 +1655,8 @@ static int __get_segment_type_6(struct page *page, enum page_type p_type)
 			return CURSEG_HOT_DATA;
 		else if (is_cold_data(page) || file_is_cold(inode))
 			return CURSEG_COLD_DATA;
+		else if (is_hot_data(inode))
+			return CURSEG_HOT_DATA;
 		else
 			return CURSEG_WARM_DATA;
 	} else {
@@ -1260,6 +1703,8 @@ void allocate_data_block(struct f2fs_sb_info *sbi, struct page *page,
 		__allocate_new_segments(sbi, type);
 
 	*new_blkaddr = NEXT_FREE_BLKADDR(sbi, curseg);
+	if (IS_DATASEG(type))
+		SM_I(sbi)->temp_blocks[type]++;
 
 	/*
 	 * __add_sum_entry should be resided under the curseg_mutex
@@ -2247,6 +2692,11 @@ static int build_dirty_segmap(struct f2fs_sb_info *sbi)
 			return -ENOMEM;
 	}
 
+	dirty_i->victim_entries = f2fs_kvzalloc(MAIN_SECS(sbi) *
+				sizeof(struct victim_entry), GFP_KERNEL);
+	if (!dirty_i->victim_entries)
+		return -ENOMEM;
+
 	init_dirty_segmap(sbi);
 	return init_victim_secmap(sbi);
 }
@@ -2304,6 +2754,8 @@ int build_segment_manager(struct f2fs_sb_info *sbi)
 	sm_info->ipu_policy = 1 << F2FS_IPU_FSYNC;
 	sm_info->min_ipu_util = DEF_MIN_IPU_UTIL;
 	sm_info->min_fsync_blocks = DEF_MIN_FSYNC_BLOCKS;
+	sm_info->hot_data_threshold = DEF_HOT_DATA_THRESHOLD;
+	sm_info->heat_decay_interval = DEF_HEAT_DECAY_INTERVAL;
 
 	INIT_LIST_HEAD(&sm_info->discard_list);
 	sm_info->nr_discards = 0;
@@ -2319,6 +2771,10 @@ int build_segment_manager(struct f2fs_sb_info *sbi)
 			return err;
 	}
 
+	err = create_discard_cmd_control(sbi);
+	if (err)
+		return err;
+
 	err = build_sit_info(sbi);
 	if (err)
 		return err;
@@ -2371,6 +2827,7 @@ static void destroy_dirty_segmap(struct f2fs_sb_info *sbi)
 		discard_dirty_segmap(sbi, i);
 
 	destroy_victim_secmap(sbi);
+	kvfree(dirty_i->victim_entries);
 	SM_I(sbi)->dirty_info = NULL;
 	kfree(dirty_i);
 }
@@ -2432,6 +2889,7 @@ void destroy_segment_manager(struct f2fs_sb_info *sbi)
 	if (!sm_info)
 		return;
 	destroy_flush_cmd_control(sbi);
+	destroy_discard_cmd_control(sbi);
 	destroy_dirty_segmap(sbi);
 	destroy_curseg(sbi);
 	destroy_free_segmap(sbi);
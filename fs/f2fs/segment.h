@@ -17,6 +17,10 @@
 
 #define DEF_RECLAIM_PREFREE_SEGMENTS	5	/* 5% over total segments */
 
+/* pending discards wait this long for an idle device, until there are many */
+#define DEF_DISCARD_BUSY_WAIT_MS	50
+#define DEF_MAX_DISCARD_CMDS		512
+
 /* L: Logical segment # in volume, R: Relative segment # in main area */
 #define GET_L2R_SEGNO(free_i, segno)	(segno - free_i->start_segno)
 #define GET_R2L_SEGNO(free_i, segno)	(segno + free_i->start_segno)
@@ -239,12 +243,28 @@ enum dirty_type {
 	NR_DIRTY_TYPE
 };
 
+/* one cost-benefit victim tree per utilization percent of a section */
+#define NR_CB_VICTIM_TREES	101
+
+/* a section with dirty segments in the victim index */
+struct victim_entry {
+	struct rb_node greedy_node;	/* in greedy_root, by valid blocks */
+	struct rb_node cb_node;		/* in cb_root[u], by mtime */
+	unsigned long long mtime;	/* sum of the segments' mtime */
+	unsigned int vblocks;		/* # of valid blocks */
+	unsigned char u;		/* utilization in percent */
+	bool queued;			/* whether it is in the trees */
+};
+
 struct dirty_seglist_info {
 	const struct victim_selection *v_ops;	/* victim selction operation */
 	unsigned long *dirty_segmap[NR_DIRTY_TYPE];
 	struct mutex seglist_lock;		/* lock for segment bitmaps */
 	int nr_dirty[NR_DIRTY_TYPE];		/* # of dirty segments */
 	unsigned long *victim_secmap;		/* background GC victims */
+	struct victim_entry *victim_entries;	/* one per section */
+	struct rb_root greedy_root;		/* victims for GC_GREEDY */
+	struct rb_root cb_root[NR_CB_VICTIM_TREES]; /* victims for GC_CB */
 };
 
 /* victim selection function for cleaning and SSR */
@@ -546,6 +566,55 @@ static inline bool need_inplace_update(struct inode *inode)
 	return false;
 }
 
+/*
+ * The write heat of a file is the number of its blocks rewritten, halved
+ * every heat_decay_interval seconds, up to a day. Data of files at
+ * hot_data_threshold or above goes to the hot data log, so that it is not
+ * mixed with data that stays put. A threshold of 0 turns this off.
+ */
+#define DEF_HOT_DATA_THRESHOLD	64
+#define DEF_HEAT_DECAY_INTERVAL	60	/* 60 secs */
+#define MAX_HEAT_DECAY_INTERVAL	(24 * 60 * 60)	/* 1 day */
+
+/* updated without locking, an approximate count does */
+static inline void __decay_write_heat(struct f2fs_sb_info *sbi,
+					struct f2fs_inode_info *fi)
+{
+	unsigned int secs = min_t(unsigned int, MAX_HEAT_DECAY_INTERVAL,
+					SM_I(sbi)->heat_decay_interval);
+	unsigned long interval, periods;
+
+	if (!secs)
+		return;
+	interval = msecs_to_jiffies(secs * MSEC_PER_SEC);
+	periods = (jiffies - fi->i_heat_stamp) / interval;
+	if (!periods)
+		return;
+	fi->i_write_heat = periods < 32 ? fi->i_write_heat >> periods : 0;
+	fi->i_heat_stamp += periods * interval;
+}
+
+static inline void inc_write_heat(struct inode *inode)
+{
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+
+	__decay_write_heat(F2FS_I_SB(inode), fi);
+	if (fi->i_write_heat < UINT_MAX)
+		fi->i_write_heat++;
+}
+
+static inline bool is_hot_data(struct inode *inode)
+{
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	unsigned int threshold = SM_I(sbi)->hot_data_threshold;
+
+	if (!threshold)
+		return false;
+	__decay_write_heat(sbi, fi);
+	return fi->i_write_heat >= threshold;
+}
+
 static inline unsigned int curseg_segno(struct f2fs_sb_info *sbi,
 		int type)
 {
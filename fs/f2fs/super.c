@@ -161,6 +161,17 @@ static ssize_t f2fs_sbi_store(struct f2fs_attr *a,
 	return count;
 }
 
+/* data blocks written to the hot, warm and cold logs */
+static ssize_t temp_data_blocks_show(struct f2fs_attr *a,
+			struct f2fs_sb_info *sbi, char *buf)
+{
+	unsigned long long *blocks = SM_I(sbi)->temp_blocks;
+
+	return snprintf(buf, PAGE_SIZE, "%llu %llu %llu\n",
+			blocks[CURSEG_HOT_DATA], blocks[CURSEG_WARM_DATA],
+			blocks[CURSEG_COLD_DATA]);
+}
+
 static ssize_t f2fs_attr_show(struct kobject *kobj,
 				struct attribute *attr, char *buf)
 {
@@ -212,11 +223,15 @@ F2FS_RW_ATTR(SM_INFO, f2fs_sm_info, batched_trim_sections, trim_sections);
 F2FS_RW_ATTR(SM_INFO, f2fs_sm_info, ipu_policy, ipu_policy);
 F2FS_RW_ATTR(SM_INFO, f2fs_sm_info, min_ipu_util, min_ipu_util);
 F2FS_RW_ATTR(SM_INFO, f2fs_sm_info, min_fsync_blocks, min_fsync_blocks);
+F2FS_RW_ATTR(SM_INFO, f2fs_sm_info, hot_data_threshold, hot_data_threshold);
+F2FS_RW_ATTR(SM_INFO, f2fs_sm_info, heat_decay_interval, heat_decay_interval);
 F2FS_RW_ATTR(NM_INFO, f2fs_nm_info, ram_thresh, ram_thresh);
 F2FS_RW_ATTR(NM_INFO, f2fs_nm_info, ra_nid_pages, ra_nid_pages);
 F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, max_victim_search, max_victim_search);
 F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, dir_level, dir_level);
 F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, cp_interval, cp_interval);
+F2FS_ATTR_OFFSET(SM_INFO, temp_data_blocks, 0444, temp_data_blocks_show,
+					NULL, 0);
 
 #define ATTR_LIST(name) (&f2fs_attr_##name.attr)
 static struct attribute *f2fs_attrs[] = {
@@ -230,6 +245,9 @@ static struct attribute *f2fs_attrs[] = {
 	ATTR_LIST(ipu_policy),
 	ATTR_LIST(min_ipu_util),
 	ATTR_LIST(min_fsync_blocks),
+	ATTR_LIST(hot_data_threshold),
+	ATTR_LIST(heat_decay_interval),
+	ATTR_LIST(temp_data_blocks),
 	ATTR_LIST(max_victim_search),
 	ATTR_LIST(dir_level),
 	ATTR_LIST(ram_thresh),
@@ -434,6 +452,8 @@ static struct inode *f2fs_alloc_inode(struct super_block *sb)
 	init_rwsem(&fi->i_sem);
 	INIT_LIST_HEAD(&fi->inmem_pages);
 	mutex_init(&fi->inmem_lock);
+	fi->i_write_heat = 0;
+	fi->i_heat_stamp = jiffies;
 
 	set_inode_flag(fi, FI_NEW_INODE);
 
@@ -818,6 +838,15 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data)
 		if (err)
 			goto restore_gc;
 	}
+
+	/* the discard thread issues what it still has when stopped */
+	if ((*flags & MS_RDONLY) || !test_opt(sbi, DISCARD)) {
+		stop_discard_thread(sbi);
+	} else {
+		err = start_discard_thread(sbi);
+		if (err)
+			goto restore_gc;
+	}
 skip:
 	/* Update the POSIXACL Flag */
 	 sb->s_flags = (sb->s_flags & ~MS_POSIXACL) |
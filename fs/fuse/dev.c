@@ -22,6 +22,8 @@
 #include <linux/swap.h>
 #include <linux/splice.h>
 #include <linux/freezer.h>
+#include <linux/hash.h>
+#include <linux/percpu.h>
 
 MODULE_ALIAS_MISCDEV(FUSE_MINOR);
 MODULE_ALIAS("devname:fuse");
@@ -325,16 +327,67 @@ static unsigned len_args(unsigned numargs, struct fuse_arg *args)
 
 static u64 fuse_get_unique(struct fuse_iqueue *fiq)
 {
-	return ++fiq->reqctr;
+	/* Each input queue keeps to its own residue, see fuse_iqueue_init() */
+	fiq->reqctr += (nr_cpu_ids + 1) * FUSE_REQ_ID_STEP;
+	return fiq->reqctr;
 }
 
-static void queue_request(struct fuse_iqueue *fiq, struct fuse_req *req)
+static unsigned int fuse_req_hash(u64 unique)
+{
+	return hash_64(unique & ~FUSE_INT_REQ_BIT, FUSE_PQ_HASH_BITS);
+}
+
+/*
+ * Lock the input queue a new request goes to.  That is the queue of the
+ * current CPU if a device bound to it is blocked reading, else the main
+ * queue, which is read by all devices.  A request is thus never left
+ * behind the busy readers of a CPU queue while others are idle.  Pollers
+ * are not counted, as they stay on the waitqueue while busy.
+ */
+static struct fuse_iqueue *fuse_lock_iqueue(struct fuse_conn *fc)
+__acquires(fiq->waitq.lock)
+{
+	struct fuse_iqueue __percpu *cpu_iqs;
+	struct fuse_iqueue *fiq;
+
+	cpu_iqs = lockless_dereference(fc->cpu_iqs);
+	if (cpu_iqs) {
+		fiq = per_cpu_ptr(cpu_iqs, raw_smp_processor_id());
+		spin_lock(&fiq->waitq.lock);
+		if (fiq->idle_readers)
+			return fiq;
+		spin_unlock(&fiq->waitq.lock);
+	}
+
+	fiq = &fc->iq;
+	spin_lock(&fiq->waitq.lock);
+	return fiq;
+}
+
+/* Lock the input queue a request is pending on, it may be moved meanwhile */
+static struct fuse_iqueue *lock_req_iqueue(struct fuse_req *req)
+__acquires(fiq->waitq.lock)
+{
+	struct fuse_iqueue *fiq;
+
+	for (;;) {
+		fiq = READ_ONCE(req->fiq);
+		spin_lock(&fiq->waitq.lock);
+		if (fiq == req->fiq)
+			return fiq;
+		spin_unlock(&fiq->waitq.lock);
+	}
+}
+
+static void queue_request(struct fuse_conn *fc, struct fuse_iqueue *fiq,
+			  struct fuse_req *req)
 {
 	req->in.h.len = sizeof(struct fuse_in_header) +
 		len_args(req->in.numargs, (struct fuse_arg *) req->in.args);
+	req->fiq = fiq;
 	list_add_tail(&req->list, &fiq->pending);
 	wake_up_sync_locked(&fiq->waitq);
-	kill_fasync(&fiq->fasync, SIGIO, POLL_IN);
+	kill_fasync(&fc->iq.fasync, SIGIO, POLL_IN);
 }
 
 void fuse_queue_forget(struct fuse_conn *fc, struct fuse_forget_link *forget,
@@ -362,14 +415,14 @@ static void flush_bg_queue(struct fuse_conn *fc)
 	while (fc->active_background < fc->max_background &&
 	       !list_empty(&fc->bg_queue)) {
 		struct fuse_req *req;
-		struct fuse_iqueue *fiq = &fc->iq;
+		struct fuse_iqueue *fiq;
 
 		req = list_entry(fc->bg_queue.next, struct fuse_req, list);
 		list_del(&req->list);
 		fc->active_background++;
-		spin_lock(&fiq->waitq.lock);
+		fiq = fuse_lock_iqueue(fc);
 		req->in.h.unique = fuse_get_unique(fiq);
-		queue_request(fiq, req);
+		queue_request(fc, fiq, req);
 		spin_unlock(&fiq->waitq.lock);
 	}
 }
@@ -466,7 +519,7 @@ static void request_wait_answer(struct fuse_conn *fc, struct fuse_req *req)
 		if (!err)
 			return;
 
-		spin_lock(&fiq->waitq.lock);
+		fiq = lock_req_iqueue(req);
 		/* Request is not yet in userspace, bail out */
 		if (test_bit(FR_PENDING, &req->flags)) {
 			list_del(&req->list);
@@ -489,16 +542,16 @@ static void request_wait_answer(struct fuse_conn *fc, struct fuse_req *req)
 
 static void __fuse_request_send(struct fuse_conn *fc, struct fuse_req *req)
 {
-	struct fuse_iqueue *fiq = &fc->iq;
+	struct fuse_iqueue *fiq;
 
 	BUG_ON(test_bit(FR_BACKGROUND, &req->flags));
-	spin_lock(&fiq->waitq.lock);
+	fiq = fuse_lock_iqueue(fc);
 	if (!fiq->connected) {
 		spin_unlock(&fiq->waitq.lock);
 		req->out.h.error = -ENOTCONN;
 	} else {
 		req->in.h.unique = fuse_get_unique(fiq);
-		queue_request(fiq, req);
+		queue_request(fc, fiq, req);
 		/* acquire extra reference, since request is still needed
 		   after request_end() */
 		__fuse_get_request(req);
@@ -643,7 +696,7 @@ static int fuse_request_send_notify_reply(struct fuse_conn *fc,
 	req->in.h.unique = unique;
 	spin_lock(&fiq->waitq.lock);
 	if (fiq->connected) {
-		queue_request(fiq, req);
+		queue_request(fc, fiq, req);
 		err = 0;
 	}
 	spin_unlock(&fiq->waitq.lock);
@@ -1104,12 +1157,11 @@ __releases(fiq->waitq.lock)
 	int err;
 
 	list_del_init(&req->intr_entry);
-	req->intr_unique = fuse_get_unique(fiq);
 	memset(&ih, 0, sizeof(ih));
 	memset(&arg, 0, sizeof(arg));
 	ih.len = reqsize;
 	ih.opcode = FUSE_INTERRUPT;
-	ih.unique = req->intr_unique;
+	ih.unique = (req->in.h.unique | FUSE_INT_REQ_BIT);
 	arg.unique = req->in.h.unique;
 
 	spin_unlock(&fiq->waitq.lock);
@@ -1239,6 +1291,95 @@ __releases(fiq->waitq.lock)
 		return fuse_read_batch_forget(fiq, cs, nbytes);
 }
 
+static bool iqueue_ready(struct fuse_iqueue *fiq)
+{
+	return !READ_ONCE(fiq->connected) || request_pending(fiq);
+}
+
+/* Sleep, letting requests be routed to the device's own queue meanwhile */
+static void fuse_dev_idle(struct fuse_iqueue *fiq)
+{
+	spin_lock(&fiq->waitq.lock);
+	fiq->idle_readers++;
+	spin_unlock(&fiq->waitq.lock);
+
+	schedule();
+
+	spin_lock(&fiq->waitq.lock);
+	fiq->idle_readers--;
+	spin_unlock(&fiq->waitq.lock);
+}
+
+/*
+ * Wait until the device's own input queue or the main queue has something
+ * to read, and return that queue locked.  The own queue is preferred.
+ */
+static struct fuse_iqueue *fuse_dev_wait_iqueue(struct fuse_dev *fud,
+						struct file *file)
+{
+	struct fuse_iqueue *main_fiq = &fud->fc->iq;
+	struct fuse_iqueue *fiq = fud->iq;
+	DEFINE_WAIT(wait);
+	DEFINE_WAIT(main_wait);
+	int err;
+
+	if (fiq == main_fiq) {
+		spin_lock(&fiq->waitq.lock);
+		err = -EAGAIN;
+		if ((file->f_flags & O_NONBLOCK) && fiq->connected &&
+		    !request_pending(fiq))
+			goto err_unlock;
+
+		err = wait_event_interruptible_exclusive_locked(fiq->waitq,
+				!fiq->connected || request_pending(fiq));
+		if (err)
+			goto err_unlock;
+		return fiq;
+	}
+
+	for (;;) {
+		err = 0;
+		prepare_to_wait_exclusive(&fiq->waitq, &wait,
+					  TASK_INTERRUPTIBLE);
+		prepare_to_wait_exclusive(&main_fiq->waitq, &main_wait,
+					  TASK_INTERRUPTIBLE);
+		if (!iqueue_ready(fiq) && !iqueue_ready(main_fiq)) {
+			if (file->f_flags & O_NONBLOCK)
+				err = -EAGAIN;
+			else if (signal_pending(current))
+				err = -ERESTARTSYS;
+			else
+				fuse_dev_idle(fiq);
+		}
+		/*
+		 * Once off the own queue's waitqueue no more requests are put
+		 * there for us, so nothing can arrive unnoticed below.
+		 */
+		finish_wait(&fiq->waitq, &wait);
+		finish_wait(&main_fiq->waitq, &main_wait);
+		if (err)
+			return ERR_PTR(err);
+
+		spin_lock(&fiq->waitq.lock);
+		if (!fiq->connected || request_pending(fiq)) {
+			/* Pass on a wakeup of the main queue we may have eaten */
+			if (request_pending(main_fiq))
+				wake_up(&main_fiq->waitq);
+			return fiq;
+		}
+		spin_unlock(&fiq->waitq.lock);
+
+		spin_lock(&main_fiq->waitq.lock);
+		if (!main_fiq->connected || request_pending(main_fiq))
+			return main_fiq;
+		spin_unlock(&main_fiq->waitq.lock);
+	}
+
+ err_unlock:
+	spin_unlock(&fiq->waitq.lock);
+	return ERR_PTR(err);
+}
+
 /*
  * Read a single request into the userspace filesystem's buffer.  This
  * function waits until a request is available, then removes it from
@@ -1253,23 +1394,17 @@ static ssize_t fuse_dev_do_read(struct fuse_dev *fud, struct file *file,
 {
 	ssize_t err;
 	struct fuse_conn *fc = fud->fc;
-	struct fuse_iqueue *fiq = &fc->iq;
+	struct fuse_iqueue *fiq;
 	struct fuse_pqueue *fpq = &fud->pq;
 	struct fuse_req *req;
 	struct fuse_in *in;
 	unsigned reqsize;
+	unsigned int hash;
 
  restart:
-	spin_lock(&fiq->waitq.lock);
-	err = -EAGAIN;
-	if ((file->f_flags & O_NONBLOCK) && fiq->connected &&
-	    !request_pending(fiq))
-		goto err_unlock;
-
-	err = wait_event_interruptible_exclusive_locked(fiq->waitq,
-				!fiq->connected || request_pending(fiq));
-	if (err)
-		goto err_unlock;
+	fiq = fuse_dev_wait_iqueue(fud, file);
+	if (IS_ERR(fiq))
+		return PTR_ERR(fiq);
 
 	err = -ENODEV;
 	if (!fiq->connected)
@@ -1328,13 +1463,14 @@ static ssize_t fuse_dev_do_read(struct fuse_dev *fud, struct file *file,
 		err = reqsize;
 		goto out_end;
 	}
-	list_move_tail(&req->list, &fpq->processing);
+	hash = fuse_req_hash(req->in.h.unique);
+	list_move_tail(&req->list, &fpq->processing[hash]);
 	spin_unlock(&fpq->lock);
 	set_bit(FR_SENT, &req->flags);
 	/* matches barrier in request_wait_answer() */
 	smp_mb__after_atomic();
 	if (test_bit(FR_INTERRUPTED, &req->flags))
-		queue_interrupt(fiq, req);
+		queue_interrupt(&fc->iq, req);
 
 	return reqsize;
 
@@ -1840,10 +1976,11 @@ static int fuse_notify(struct fuse_conn *fc, enum fuse_notify_code code,
 /* Look up request on processing list by unique ID */
 static struct fuse_req *request_find(struct fuse_pqueue *fpq, u64 unique)
 {
+	unsigned int hash = fuse_req_hash(unique);
 	struct fuse_req *req;
 
-	list_for_each_entry(req, &fpq->processing, list) {
-		if (req->in.h.unique == unique || req->intr_unique == unique)
+	list_for_each_entry(req, &fpq->processing[hash], list) {
+		if (req->in.h.unique == unique)
 			return req;
 	}
 	return NULL;
@@ -1917,12 +2054,12 @@ static ssize_t fuse_dev_do_write(struct fuse_dev *fud,
 	if (!fpq->connected)
 		goto err_unlock_pq;
 
-	req = request_find(fpq, oh.unique);
+	req = request_find(fpq, oh.unique & ~FUSE_INT_REQ_BIT);
 	if (!req)
 		goto err_unlock_pq;
 
 	/* Is it an interrupt reply? */
-	if (req->intr_unique == oh.unique) {
+	if (oh.unique & FUSE_INT_REQ_BIT) {
 		spin_unlock(&fpq->lock);
 
 		err = -EINVAL;
@@ -2082,6 +2219,8 @@ static unsigned fuse_dev_poll(struct file *file, poll_table *wait)
 
 	fiq = &fud->fc->iq;
 	poll_wait(file, &fiq->waitq, wait);
+	if (fud->iq != fiq)
+		poll_wait(file, &fud->iq->waitq, wait);
 
 	spin_lock(&fiq->waitq.lock);
 	if (!fiq->connected)
@@ -2090,6 +2229,14 @@ static unsigned fuse_dev_poll(struct file *file, poll_table *wait)
 		mask |= POLLIN | POLLRDNORM;
 	spin_unlock(&fiq->waitq.lock);
 
+	if (fud->iq != fiq && mask != POLLERR) {
+		fiq = fud->iq;
+		spin_lock(&fiq->waitq.lock);
+		if (request_pending(fiq))
+			mask |= POLLIN | POLLRDNORM;
+		spin_unlock(&fiq->waitq.lock);
+	}
+
 	return mask;
 }
 
@@ -2153,6 +2300,8 @@ void fuse_abort_conn(struct fuse_conn *fc)
 		struct fuse_req *req, *next;
 		LIST_HEAD(to_end1);
 		LIST_HEAD(to_end2);
+		unsigned int i;
+		int cpu;
 
 		fc->connected = 0;
 		fc->blocked = 0;
@@ -2172,12 +2321,29 @@ void fuse_abort_conn(struct fuse_conn *fc)
 				}
 				spin_unlock(&req->waitq.lock);
 			}
-			list_splice_init(&fpq->processing, &to_end2);
+			for (i = 0; i < FUSE_PQ_HASH_SIZE; i++)
+				list_splice_init(&fpq->processing[i], &to_end2);
 			spin_unlock(&fpq->lock);
 		}
 		fc->max_background = UINT_MAX;
 		flush_bg_queue(fc);
 
+		for_each_possible_cpu(cpu) {
+			struct fuse_iqueue *cpu_fiq;
+
+			/* Per-CPU queues only exist once a device was cloned */
+			if (!fc->cpu_iqs)
+				break;
+			cpu_fiq = per_cpu_ptr(fc->cpu_iqs, cpu);
+			spin_lock(&cpu_fiq->waitq.lock);
+			cpu_fiq->connected = 0;
+			list_for_each_entry(req, &cpu_fiq->pending, list)
+				clear_bit(FR_PENDING, &req->flags);
+			list_splice_init(&cpu_fiq->pending, &to_end2);
+			wake_up_all_locked(&cpu_fiq->waitq);
+			spin_unlock(&cpu_fiq->waitq.lock);
+		}
+
 		spin_lock(&fiq->waitq.lock);
 		fiq->connected = 0;
 		list_splice_init(&fiq->pending, &to_end2);
@@ -2205,6 +2371,31 @@ void fuse_abort_conn(struct fuse_conn *fc)
 }
 EXPORT_SYMBOL_GPL(fuse_abort_conn);
 
+/*
+ * Requests are only queued on a CPU queue for an idle reader, which may be
+ * this one.  Hand what is left over to the main queue.
+ */
+static void fuse_dev_unbind(struct fuse_dev *fud)
+{
+	struct fuse_iqueue *main_fiq = &fud->fc->iq;
+	struct fuse_iqueue *fiq = fud->iq;
+	struct fuse_req *req;
+
+	if (fiq == main_fiq)
+		return;
+
+	spin_lock(&fiq->waitq.lock);
+	if (!list_empty(&fiq->pending)) {
+		spin_lock(&main_fiq->waitq.lock);
+		list_for_each_entry(req, &fiq->pending, list)
+			req->fiq = main_fiq;
+		list_splice_tail_init(&fiq->pending, &main_fiq->pending);
+		wake_up_all_locked(&main_fiq->waitq);
+		spin_unlock(&main_fiq->waitq.lock);
+	}
+	spin_unlock(&fiq->waitq.lock);
+}
+
 int fuse_dev_release(struct inode *inode, struct file *file)
 {
 	struct fuse_dev *fud = fuse_get_dev(file);
@@ -2212,9 +2403,12 @@ int fuse_dev_release(struct inode *inode, struct file *file)
 	if (fud) {
 		struct fuse_conn *fc = fud->fc;
 		struct fuse_pqueue *fpq = &fud->pq;
+		unsigned int i;
 
+		fuse_dev_unbind(fud);
 		WARN_ON(!list_empty(&fpq->io));
-		end_requests(fc, &fpq->processing);
+		for (i = 0; i < FUSE_PQ_HASH_SIZE; i++)
+			end_requests(fc, &fpq->processing[i]);
 		/* Are we the last open device? */
 		if (atomic_dec_and_test(&fc->dev_count)) {
 			WARN_ON(fc->iq.fasync != NULL);
@@ -2248,6 +2442,11 @@ static int fuse_device_clone(struct fuse_conn *fc, struct file *new)
 	if (!fud)
 		return -ENOMEM;
 
+	if (fuse_dev_bind_cpu(fud)) {
+		fuse_dev_free(fud);
+		return -ENOMEM;
+	}
+
 	new->private_data = fud;
 	atomic_inc(&fc->dev_count);
 
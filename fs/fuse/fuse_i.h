@@ -48,6 +48,14 @@
 /** Number of page pointers embedded in fuse_req */
 #define FUSE_REQ_INLINE_PAGES 1
 
+/** Request unique IDs are even, the interrupt of a request has its ID | 1 */
+#define FUSE_INT_REQ_BIT (1ULL << 0)
+#define FUSE_REQ_ID_STEP (1ULL << 1)
+
+/** Size of the hash table of requests being processed on a device */
+#define FUSE_PQ_HASH_BITS 8
+#define FUSE_PQ_HASH_SIZE (1 << FUSE_PQ_HASH_BITS)
+
 /** List of active connections */
 extern struct list_head fuse_conn_list;
 
@@ -317,8 +325,8 @@ struct fuse_req {
 	/** refcount */
 	atomic_t count;
 
-	/** Unique ID for the interrupt request */
-	u64 intr_unique;
+	/** Input queue the request is pending on */
+	struct fuse_iqueue *fiq;
 
 	/* Request flags, updated with test/set/clear_bit() */
 	unsigned long flags;
@@ -403,6 +411,9 @@ struct fuse_iqueue {
 	/** Readers of the connection are waiting on this */
 	wait_queue_head_t waitq;
 
+	/** Readers blocked in read(), not pollers, under waitq.lock */
+	unsigned int idle_readers;
+
 	/** The next unique request id */
 	u64 reqctr;
 
@@ -430,8 +441,8 @@ struct fuse_pqueue {
 	/** Lock protecting accessess to  members of this structure */
 	spinlock_t lock;
 
-	/** The list of requests being processed */
-	struct list_head processing;
+	/** Hash table of requests being processed, indexed by unique ID */
+	struct list_head *processing;
 
 	/** The list of requests under I/O */
 	struct list_head io;
@@ -447,6 +458,9 @@ struct fuse_dev {
 	/** Processing queue */
 	struct fuse_pqueue pq;
 
+	/** Input queue read first, a per-CPU queue for cloned devices */
+	struct fuse_iqueue *iq;
+
 	/** list entry on fc->devices */
 	struct list_head entry;
 };
@@ -488,6 +502,9 @@ struct fuse_conn {
 	/** Input queue */
 	struct fuse_iqueue iq;
 
+	/** Per-CPU input queues of cloned devices, allocated on first clone */
+	struct fuse_iqueue __percpu *cpu_iqs;
+
 	/** The next unique kernel file handle */
 	u64 khctr;
 
@@ -883,6 +900,7 @@ void fuse_conn_put(struct fuse_conn *fc);
 
 struct fuse_dev *fuse_dev_alloc(struct fuse_conn *fc);
 void fuse_dev_free(struct fuse_dev *fud);
+int fuse_dev_bind_cpu(struct fuse_dev *fud);
 
 /**
  * Add connection to control filesystem
@@ -26,6 +26,21 @@ ssize_t fuse_passthrough_read_iter(struct kiocb *iocb, struct iov_iter *to);
 
 ssize_t fuse_passthrough_write_iter(struct kiocb *iocb, struct iov_iter *from);
 
+ssize_t fuse_passthrough_splice_read(struct file *in, loff_t *ppos,
+				     struct pipe_inode_info *pipe, size_t len,
+				     unsigned int flags);
+
+ssize_t fuse_passthrough_splice_write(struct pipe_inode_info *pipe,
+				      struct file *out, loff_t *ppos,
+				      size_t len, unsigned int flags);
+
+bool fuse_passthrough_can_mmap(struct fuse_file *ff,
+			       struct vm_area_struct *vma);
+
+int fuse_passthrough_mmap(struct file *file, struct vm_area_struct *vma);
+
+int fuse_passthrough_readdir(struct file *file, struct dir_context *ctx);
+
 void fuse_passthrough_release(struct fuse_file *ff);
 
 #endif /* _FS_FUSE_PASSTHROUGH_H */
@@ -18,6 +18,7 @@
 #include <linux/parser.h>
 #include <linux/statfs.h>
 #include <linux/random.h>
+#include <linux/percpu.h>
 #include <linux/sched.h>
 #include <linux/exportfs.h>
 
@@ -567,21 +568,31 @@ static int fuse_show_options(struct seq_file *m, struct dentry *root)
 	return 0;
 }
 
-static void fuse_iqueue_init(struct fuse_iqueue *fiq)
+/*
+ * Queue @index hands out the unique IDs congruent to @index steps, so that
+ * IDs stay unique across all the input queues of a connection.
+ */
+static void fuse_iqueue_init(struct fuse_iqueue *fiq, unsigned index)
 {
 	memset(fiq, 0, sizeof(struct fuse_iqueue));
 	init_waitqueue_head(&fiq->waitq);
 	INIT_LIST_HEAD(&fiq->pending);
 	INIT_LIST_HEAD(&fiq->interrupts);
 	fiq->forget_list_tail = &fiq->forget_list_head;
+	fiq->reqctr = index * FUSE_REQ_ID_STEP;
 	fiq->connected = 1;
 }
 
-static void fuse_pqueue_init(struct fuse_pqueue *fpq)
+static void fuse_pqueue_init(struct fuse_pqueue *fpq,
+			     struct list_head *processing)
 {
+	unsigned int i;
+
 	memset(fpq, 0, sizeof(struct fuse_pqueue));
 	spin_lock_init(&fpq->lock);
-	INIT_LIST_HEAD(&fpq->processing);
+	fpq->processing = processing;
+	for (i = 0; i < FUSE_PQ_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&fpq->processing[i]);
 	INIT_LIST_HEAD(&fpq->io);
 	fpq->connected = 1;
 }
@@ -595,7 +606,7 @@ void fuse_conn_init(struct fuse_conn *fc)
 	atomic_set(&fc->dev_count, 1);
 	init_waitqueue_head(&fc->blocked_waitq);
 	init_waitqueue_head(&fc->reserved_req_waitq);
-	fuse_iqueue_init(&fc->iq);
+	fuse_iqueue_init(&fc->iq, 0);
 	INIT_LIST_HEAD(&fc->bg_queue);
 	INIT_LIST_HEAD(&fc->entry);
 	INIT_LIST_HEAD(&fc->devices);
@@ -617,6 +628,7 @@ void fuse_conn_put(struct fuse_conn *fc)
 	if (atomic_dec_and_test(&fc->count)) {
 		if (fc->destroy_req)
 			fuse_request_free(fc->destroy_req);
+		free_percpu(fc->cpu_iqs);
 		fc->release(fc);
 	}
 }
@@ -1003,21 +1015,62 @@ static int fuse_bdi_init(struct fuse_conn *fc, struct super_block *sb)
 struct fuse_dev *fuse_dev_alloc(struct fuse_conn *fc)
 {
 	struct fuse_dev *fud;
+	struct list_head *pq;
 
 	fud = kzalloc(sizeof(struct fuse_dev), GFP_KERNEL);
-	if (fud) {
-		fud->fc = fuse_conn_get(fc);
-		fuse_pqueue_init(&fud->pq);
+	if (!fud)
+		return NULL;
 
-		spin_lock(&fc->lock);
-		list_add_tail(&fud->entry, &fc->devices);
-		spin_unlock(&fc->lock);
+	pq = kcalloc(FUSE_PQ_HASH_SIZE, sizeof(struct list_head), GFP_KERNEL);
+	if (!pq) {
+		kfree(fud);
+		return NULL;
 	}
 
+	fud->fc = fuse_conn_get(fc);
+	fud->iq = &fc->iq;
+	fuse_pqueue_init(&fud->pq, pq);
+
+	spin_lock(&fc->lock);
+	list_add_tail(&fud->entry, &fc->devices);
+	spin_unlock(&fc->lock);
+
 	return fud;
 }
 EXPORT_SYMBOL_GPL(fuse_dev_alloc);
 
+/*
+ * Make a cloned device read the input queue of the current CPU before the
+ * main queue.  The per-CPU queues are set up by the first clone.  Called
+ * with fuse_mutex held.
+ */
+int fuse_dev_bind_cpu(struct fuse_dev *fud)
+{
+	struct fuse_conn *fc = fud->fc;
+	struct fuse_iqueue __percpu *cpu_iqs;
+	int cpu;
+
+	if (!fc->cpu_iqs) {
+		cpu_iqs = alloc_percpu(struct fuse_iqueue);
+		if (!cpu_iqs)
+			return -ENOMEM;
+
+		spin_lock(&fc->lock);
+		for_each_possible_cpu(cpu) {
+			struct fuse_iqueue *fiq = per_cpu_ptr(cpu_iqs, cpu);
+
+			fuse_iqueue_init(fiq, cpu + 1);
+			fiq->connected = fc->connected;
+		}
+		/* Pairs with lockless_dereference() in fuse_lock_iqueue() */
+		smp_store_release(&fc->cpu_iqs, cpu_iqs);
+		spin_unlock(&fc->lock);
+	}
+
+	fud->iq = per_cpu_ptr(fc->cpu_iqs, raw_smp_processor_id());
+	return 0;
+}
+
 void fuse_dev_free(struct fuse_dev *fud)
 {
 	struct fuse_conn *fc = fud->fc;
@@ -1029,6 +1082,7 @@ void fuse_dev_free(struct fuse_dev *fud)
 
 		fuse_conn_put(fc);
 	}
+	kfree(fud->pq.processing);
 	kfree(fud);
 }
 EXPORT_SYMBOL_GPL(fuse_dev_free);
@@ -15,7 +15,10 @@
 #include "fuse_passthrough.h"
 
 #include <linux/aio.h>
+#include <linux/cred.h>
 #include <linux/fs_stack.h>
+#include <linux/mm.h>
+#include <linux/splice.h>
 
 void fuse_setup_passthrough(struct fuse_conn *fc, struct fuse_req *req)
 {
@@ -32,7 +35,8 @@ void fuse_setup_passthrough(struct fuse_conn *fc, struct fuse_req *req)
 		return;
 
 	if ((req->in.h.opcode != FUSE_OPEN) &&
-	    (req->in.h.opcode != FUSE_CREATE))
+	    (req->in.h.opcode != FUSE_CREATE) &&
+	    (req->in.h.opcode != FUSE_OPENDIR))
 		return;
 
 	open_out_index = req->in.numargs - 1;
@@ -54,6 +58,15 @@ void fuse_setup_passthrough(struct fuse_conn *fc, struct fuse_req *req)
 	passthrough_sb = passthrough_inode->i_sb;
 	fs_stack_depth = passthrough_sb->s_stack_depth + 1;
 
+	/* Directories can only be passed through for directories */
+	if (S_ISDIR(passthrough_inode->i_mode) !=
+	    (req->in.h.opcode == FUSE_OPENDIR) ||
+	    (S_ISDIR(passthrough_inode->i_mode) &&
+	     !passthrough_filp->f_op->iterate)) {
+		fput(passthrough_filp);
+		return;
+	}
+
 	/* If we reached the stacking limit go through regular io */
 	if (fs_stack_depth > FILESYSTEM_MAX_STACK_DEPTH) {
 		/* Release the passthrough file. */
@@ -121,6 +134,139 @@ ssize_t fuse_passthrough_write_iter(struct kiocb *iocb, struct iov_iter *from)
 	return fuse_passthrough_read_write_iter(iocb, from, 1);
 }
 
+ssize_t fuse_passthrough_splice_read(struct file *in, loff_t *ppos,
+				     struct pipe_inode_info *pipe, size_t len,
+				     unsigned int flags)
+{
+	struct fuse_file *ff = in->private_data;
+	struct file *passthrough_filp = ff->passthrough_filp;
+	ssize_t ret_val;
+
+	if (!passthrough_filp->f_op->splice_read)
+		return -EINVAL;
+
+	/* lock passthrough file to prevent it from being released */
+	get_file(passthrough_filp);
+	ret_val = passthrough_filp->f_op->splice_read(passthrough_filp, ppos,
+						      pipe, len, flags);
+	if (ret_val >= 0)
+		fsstack_copy_attr_atime(file_inode(in),
+					file_inode(passthrough_filp));
+	fput(passthrough_filp);
+
+	return ret_val;
+}
+
+ssize_t fuse_passthrough_splice_write(struct pipe_inode_info *pipe,
+				      struct file *out, loff_t *ppos,
+				      size_t len, unsigned int flags)
+{
+	struct fuse_file *ff = out->private_data;
+	struct file *passthrough_filp = ff->passthrough_filp;
+	struct inode *fuse_inode = file_inode(out);
+	struct inode *passthrough_inode = file_inode(passthrough_filp);
+	ssize_t ret_val;
+
+	if (!passthrough_filp->f_op->splice_write)
+		return -EINVAL;
+
+	/* lock passthrough file to prevent it from being released */
+	get_file(passthrough_filp);
+	file_start_write(passthrough_filp);
+	ret_val = passthrough_filp->f_op->splice_write(pipe, passthrough_filp,
+						       ppos, len, flags);
+	file_end_write(passthrough_filp);
+	if (ret_val >= 0) {
+		spin_lock(&ff->fc->lock);
+		fsstack_copy_inode_size(fuse_inode, passthrough_inode);
+		spin_unlock(&ff->fc->lock);
+		fsstack_copy_attr_times(fuse_inode, passthrough_inode);
+	}
+	fput(passthrough_filp);
+
+	return ret_val;
+}
+
+/*
+ * Shared writable mappings would let the lower file be written through a
+ * descriptor the daemon only opened for reading, use the FUSE page cache
+ * for those.
+ */
+bool fuse_passthrough_can_mmap(struct fuse_file *ff,
+			       struct vm_area_struct *vma)
+{
+	struct file *passthrough_filp = ff->passthrough_filp;
+
+	if (!passthrough_filp->f_op->mmap)
+		return false;
+
+	return !(vma->vm_flags & VM_SHARED) ||
+	       !(vma->vm_flags & VM_MAYWRITE) ||
+	       (passthrough_filp->f_mode & FMODE_WRITE);
+}
+
+/*
+ * Map the lower file's pages directly.  The vma takes over a reference to
+ * the lower file and drops the one to the FUSE file, so faults and
+ * writeback never reach the daemon.
+ */
+int fuse_passthrough_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct fuse_file *ff = file->private_data;
+	struct file *passthrough_filp = ff->passthrough_filp;
+	int ret_val;
+
+	if (WARN_ON(file != vma->vm_file))
+		return -EIO;
+
+	vma->vm_file = get_file(passthrough_filp);
+	ret_val = passthrough_filp->f_op->mmap(passthrough_filp, vma);
+	if (ret_val) {
+		vma->vm_file = file;
+		fput(passthrough_filp);
+		return ret_val;
+	}
+	fput(file);
+
+	fsstack_copy_attr_atime(file_inode(file), file_inode(passthrough_filp));
+	return 0;
+}
+
+/*
+ * Directory positions and inode numbers are those of the lower directory.
+ * It is read with the credentials of the daemon that opened it, as the
+ * caller was already checked against the FUSE directory.
+ *
+ * iterate_dir() starts from the lower file position, so that is moved to
+ * the FUSE one first, which rewinddir() and seekdir() may have changed.
+ * The caller holds the f_pos_lock of the FUSE file, which serializes all
+ * users of its lower file.
+ */
+int fuse_passthrough_readdir(struct file *file, struct dir_context *ctx)
+{
+	struct fuse_file *ff = file->private_data;
+	struct file *passthrough_filp = ff->passthrough_filp;
+	const struct cred *old_cred;
+	loff_t pos;
+	int ret_val;
+
+	/* lock passthrough file to prevent it from being released */
+	get_file(passthrough_filp);
+	pos = vfs_llseek(passthrough_filp, ctx->pos, SEEK_SET);
+	if (pos < 0) {
+		ret_val = pos;
+		goto out;
+	}
+	old_cred = override_creds(passthrough_filp->f_cred);
+	ret_val = iterate_dir(passthrough_filp, ctx);
+	revert_creds(old_cred);
+	fsstack_copy_attr_atime(file_inode(file), file_inode(passthrough_filp));
+out:
+	fput(passthrough_filp);
+
+	return ret_val;
+}
+
 void fuse_passthrough_release(struct fuse_file *ff)
 {
 	if (!(ff->passthrough_filp))
@@ -1121,6 +1121,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		lowmem_update_adj(task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -1210,6 +1212,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		lowmem_update_adj(task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -212,3 +212,25 @@ read_failure:
 	kfree(bh);
 	return -EIO;
 }
+
+
+/*
+ * Start reading the device blocks holding a datablock without waiting for
+ * them, so that I/O for several datablocks can be in flight at once.  A
+ * later squashfs_read_data() of the datablock finds the buffers either
+ * locked for I/O or uptodate.
+ */
+void squashfs_readahead_data(struct super_block *sb, u64 index, int length)
+{
+	struct squashfs_sb_info *msblk = sb->s_fs_info;
+	u64 cur_index = index >> msblk->devblksize_log2;
+	u64 end_index;
+
+	length = SQUASHFS_COMPRESSED_SIZE_BLOCK(length);
+	if (length <= 0 || (index + length) > msblk->bytes_used)
+		return;
+
+	end_index = (index + length - 1) >> msblk->devblksize_log2;
+	for (; cur_index <= end_index; cur_index++)
+		sb_breadahead(sb, cur_index);
+}
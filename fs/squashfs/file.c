@@ -47,11 +47,15 @@
 #include <linux/string.h>
 #include <linux/pagemap.h>
 #include <linux/mutex.h>
+#include <linux/module.h>
+#include <linux/blkdev.h>
+#include <linux/workqueue.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
 #include "squashfs_fs_i.h"
 #include "squashfs.h"
+#include "page_actor.h"
 
 /*
  * Locate cache slot in range [offset, index] for specified inode.  If
@@ -497,7 +501,233 @@ out:
 	return 0;
 }
 
+#ifdef CONFIG_SQUASHFS_FILE_DIRECT
+/*
+ * Readahead.  The datablocks fully covered by the readahead window have
+ * their I/O started together, and are then decompressed directly into the
+ * page cache in parallel on an unbound workqueue, rather than one at a time
+ * by squashfs_readpage() in the reading task.  The first datablock, which
+ * usually holds the page a reader is waiting for, is decompressed by the
+ * caller.  Fragments, sparse and partially covered datablocks are left to
+ * squashfs_readpage().
+ */
+static bool parallel_readahead = true;
+module_param(parallel_readahead, bool, 0644);
+MODULE_PARM_DESC(parallel_readahead,
+	"Decompress readahead datablocks in parallel (default: true)");
+
+static struct workqueue_struct *squashfs_read_wq;
+
+struct squashfs_ra_block {
+	struct list_head list;
+	struct work_struct work;
+	struct super_block *sb;
+	u64 block;
+	int bsize;
+	int pages;
+	struct page *page[];
+};
+
+/*
+ * Decompress a datablock into its locked page cache pages, then unlock and
+ * release them.  The superblock must not be touched once the pages are
+ * unlocked, as nothing else holds it.
+ */
+static void squashfs_ra_block_read(struct squashfs_ra_block *ra)
+{
+	struct squashfs_page_actor *actor;
+	int i, bytes, res = -ENOMEM;
+	void *pageaddr;
+
+	actor = squashfs_page_actor_init_special(ra->page, ra->pages, 0);
+	if (actor) {
+		res = squashfs_read_data(ra->sb, ra->block, ra->bsize, NULL,
+					 actor);
+		kfree(actor);
+	}
+
+	/* Last page may have trailing bytes not filled */
+	bytes = res > 0 ? res % PAGE_CACHE_SIZE : 0;
+	if (bytes) {
+		pageaddr = kmap_atomic(ra->page[ra->pages - 1]);
+		memset(pageaddr + bytes, 0, PAGE_CACHE_SIZE - bytes);
+		kunmap_atomic(pageaddr);
+	}
+
+	for (i = 0; i < ra->pages; i++) {
+		flush_dcache_page(ra->page[i]);
+		if (res < 0)
+			SetPageError(ra->page[i]);
+		else
+			SetPageUptodate(ra->page[i]);
+		unlock_page(ra->page[i]);
+		page_cache_release(ra->page[i]);
+	}
+
+	kfree(ra);
+}
+
+static void squashfs_ra_block_work(struct work_struct *work)
+{
+	squashfs_ra_block_read(container_of(work, struct squashfs_ra_block,
+					    work));
+}
+
+/* Are the next @pages pages of the list those starting at @start? */
+static bool squashfs_ra_covered(struct list_head *list, pgoff_t start,
+	int pages)
+{
+	struct page *page;
+	pgoff_t index = start;
+
+	list_for_each_entry_reverse(page, list, lru) {
+		if (page->index != index)
+			return false;
+		if (++index == start + pages)
+			return true;
+	}
+
+	return false;
+}
+
+/* Read the next page of the list the way the generic readahead code does */
+static void squashfs_ra_page(struct file *file, struct address_space *mapping,
+	struct list_head *list, gfp_t gfp)
+{
+	struct page *page = list_entry(list->prev, struct page, lru);
+
+	list_del(&page->lru);
+	if (!add_to_page_cache_lru(page, mapping, page->index, gfp))
+		squashfs_readpage(file, page);
+	page_cache_release(page);
+}
+
+/*
+ * Take the pages of the datablock at the tail of the list and add them to
+ * the page cache.  Returns NULL if the datablock has to be read page by page
+ * instead, in which case the pages not dealt with are left on the list.
+ */
+static struct squashfs_ra_block *squashfs_ra_block_get(struct file *file,
+	struct address_space *mapping, struct list_head *list, gfp_t gfp)
+{
+	struct inode *inode = mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	struct page *page = list_entry(list->prev, struct page, lru);
+	int shift = msblk->block_log - PAGE_CACHE_SHIFT;
+	int index = page->index >> shift;
+	int file_end = i_size_read(inode) >> msblk->block_log;
+	pgoff_t last_page = (i_size_read(inode) - 1) >> PAGE_CACHE_SHIFT;
+	pgoff_t end_index = page->index | ((1 << shift) - 1);
+	struct squashfs_ra_block *ra;
+	int i, pages, bsize;
+	u64 block = 0;
+
+	if (page->index & ((1 << shift) - 1) || page->index > last_page)
+		return NULL;
+
+	if (index >= file_end && squashfs_i(inode)->fragment_block !=
+					SQUASHFS_INVALID_BLK)
+		return NULL;
+
+	if (end_index > last_page)
+		end_index = last_page;
+	pages = end_index - page->index + 1;
+	if (!squashfs_ra_covered(list, page->index, pages))
+		return NULL;
+
+	bsize = read_blocklist(inode, index, &block);
+	if (bsize <= 0)
+		return NULL;
+
+	ra = kmalloc(sizeof(*ra) + pages * sizeof(struct page *), gfp);
+	if (ra == NULL)
+		return NULL;
+
+	for (i = 0; i < pages; i++) {
+		page = list_entry(list->prev, struct page, lru);
+		list_del(&page->lru);
+		if (add_to_page_cache_lru(page, mapping, page->index, gfp)) {
+			page_cache_release(page);
+			break;
+		}
+		ra->page[i] = page;
+	}
+
+	if (i < pages) {
+		/*
+		 * Racing with another reader of the same datablock, fall back
+		 * to reading the pages already added one by one.
+		 */
+		while (i--) {
+			squashfs_readpage(file, ra->page[i]);
+			page_cache_release(ra->page[i]);
+		}
+		kfree(ra);
+		return ERR_PTR(-EEXIST);
+	}
+
+	ra->sb = inode->i_sb;
+	ra->block = block;
+	ra->bsize = bsize;
+	ra->pages = pages;
+	return ra;
+}
+
+static int squashfs_readpages(struct file *file, struct address_space *mapping,
+	struct list_head *pages, unsigned nr_pages)
+{
+	gfp_t gfp = mapping_gfp_constraint(mapping, GFP_KERNEL);
+	struct squashfs_ra_block *ra, *next, *first;
+	struct blk_plug plug;
+	LIST_HEAD(blocks);
+
+	while (!list_empty(pages)) {
+		ra = parallel_readahead ?
+			squashfs_ra_block_get(file, mapping, pages, gfp) : NULL;
+		if (ra == NULL)
+			squashfs_ra_page(file, mapping, pages, gfp);
+		else if (!IS_ERR(ra))
+			list_add_tail(&ra->list, &blocks);
+	}
+
+	if (list_empty(&blocks))
+		return 0;
+
+	blk_start_plug(&plug);
+	list_for_each_entry(ra, &blocks, list)
+		squashfs_readahead_data(ra->sb, ra->block, ra->bsize);
+	blk_finish_plug(&plug);
+
+	/* A queued datablock may be freed at any time, don't touch it again */
+	first = list_first_entry(&blocks, struct squashfs_ra_block, list);
+	list_del(&first->list);
+	list_for_each_entry_safe(ra, next, &blocks, list) {
+		INIT_WORK(&ra->work, squashfs_ra_block_work);
+		queue_work(squashfs_read_wq, &ra->work);
+	}
+
+	squashfs_ra_block_read(first);
+	return 0;
+}
+
+int __init squashfs_init_readahead(void)
+{
+	squashfs_read_wq = alloc_workqueue("squashfs_read",
+				WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	return squashfs_read_wq ? 0 : -ENOMEM;
+}
+
+/* Waits for outstanding datablocks, they run module code */
+void squashfs_destroy_readahead(void)
+{
+	destroy_workqueue(squashfs_read_wq);
+}
+#endif
+
 
 const struct address_space_operations squashfs_aops = {
-	.readpage = squashfs_readpage
+	.readpage = squashfs_readpage,
+#ifdef CONFIG_SQUASHFS_FILE_DIRECT
+	.readpages = squashfs_readpages
+#endif
 };
@@ -30,6 +30,7 @@
 /* block.c */
 extern int squashfs_read_data(struct super_block *, u64, int, u64 *,
 				struct squashfs_page_actor *);
+extern void squashfs_readahead_data(struct super_block *, u64, int);
 
 /* cache.c */
 extern struct squashfs_cache *squashfs_cache_init(char *, int, int);
@@ -69,6 +70,19 @@ extern __le64 *squashfs_read_fragment_index_table(struct super_block *,
 /* file.c */
 void squashfs_copy_cache(struct page *, struct squashfs_cache_entry *, int,
 				int);
+#ifdef CONFIG_SQUASHFS_FILE_DIRECT
+extern int squashfs_init_readahead(void);
+extern void squashfs_destroy_readahead(void);
+#else
+static inline int squashfs_init_readahead(void)
+{
+	return 0;
+}
+
+static inline void squashfs_destroy_readahead(void)
+{
+}
+#endif
 
 /* file_xxx.c */
 extern int squashfs_readpage_block(struct page *, u64, int);
@@ -116,6 +116,14 @@ static inline bool task_will_free_mem(struct task_struct *task)
 extern void dump_tasks(struct mem_cgroup *memcg,
 		const nodemask_t *nodemask);
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void lowmem_update_adj(struct task_struct *task);
+#else
+static inline void lowmem_update_adj(struct task_struct *task)
+{
+}
+#endif
+
 /* sysctls */
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
@@ -2454,6 +2454,7 @@ extern int sched_set_window(u64 window_start, unsigned int window_size);
 extern unsigned long sched_get_busy(int cpu);
 extern void sched_get_cpus_busy(struct sched_load *busy,
 				const struct cpumask *query_cpus);
+extern unsigned int sched_get_pred_busy(int cpu);
 extern void sched_set_io_is_busy(int val);
 extern int sched_set_boost(int enable);
 extern int sched_set_init_task_load(struct task_struct *p, int init_load_pct);
@@ -2500,6 +2501,10 @@ static inline unsigned long sched_get_busy(int cpu)
 }
 static inline void sched_get_cpus_busy(struct sched_load *busy,
 				       const struct cpumask *query_cpus) {};
+static inline unsigned int sched_get_pred_busy(int cpu)
+{
+	return 0;
+}
 
 static inline void sched_set_io_is_busy(int val) {};
 
@@ -191,6 +191,7 @@ struct binder_version {
 #define BINDER_SET_CONTEXT_MGR		_IOW('b', 7, __s32)
 #define BINDER_THREAD_EXIT		_IOW('b', 8, __s32)
 #define BINDER_VERSION			_IOWR('b', 9, struct binder_version)
+#define BINDER_SET_ZERO_COPY		_IOW('b', 10, __u32)
 
 /*
  * NOTE: Two special error codes you should check for when calling
@@ -212,6 +213,17 @@ enum transaction_flags {
 	TF_ROOT_OBJECT	= 0x04,	/* contents are the component's root object */
 	TF_STATUS_CODE	= 0x08,	/* contents are a 32-bit status code */
 	TF_ACCEPT_FDS	= 0x10,	/* allow replies with file descriptors */
+	/*
+	 * Hand large buffer objects over to the target instead of copying
+	 * them, if the target enabled this with BINDER_SET_ZERO_COPY. A
+	 * BINDER_TYPE_PTR buffer is moved into the target, read-only, when
+	 * it is page aligned, a multiple of the page size, large enough and
+	 * backed by private anonymous memory that nothing else maps. Other
+	 * buffers, including file, shmem and ashmem mappings, are copied as
+	 * usual. A moved buffer reads as zeroes in the sender afterwards.
+	 * Moved buffers cannot be the parent of pointer or fd array fixups.
+	 */
+	TF_ZERO_COPY	= 0x20,
 };
 
 struct binder_transaction_data {
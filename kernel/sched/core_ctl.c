@@ -46,6 +46,11 @@ struct cluster_data {
 	struct task_struct *core_ctl_thread;
 	unsigned int first_cpu;
 	unsigned int boost;
+	bool predict;
+	unsigned int pred_need;
+	s64 pred_ts;
+	unsigned int pred_hits;
+	unsigned int pred_misses;
 	struct kobject kobj;
 };
 
@@ -241,6 +246,30 @@ static ssize_t show_is_big_cluster(const struct cluster_data *state, char *buf)
 	return snprintf(buf, PAGE_SIZE, "%u\n", state->is_big_cluster);
 }
 
+static ssize_t store_predict(struct cluster_data *state,
+				const char *buf, size_t count)
+{
+	unsigned int val;
+
+	if (sscanf(buf, "%u\n", &val) != 1)
+		return -EINVAL;
+
+	state->predict = !!val;
+	apply_need(state);
+	return count;
+}
+
+static ssize_t show_predict(const struct cluster_data *state, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%u\n", state->predict);
+}
+
+static ssize_t show_pred_stats(const struct cluster_data *state, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "hits %u\nmisses %u\n",
+			state->pred_hits, state->pred_misses);
+}
+
 static ssize_t show_cpus(const struct cluster_data *state, char *buf)
 {
 	struct cpu_data *c;
@@ -376,6 +405,8 @@ core_ctl_attr_rw(busy_up_thres);
 core_ctl_attr_rw(busy_down_thres);
 core_ctl_attr_rw(task_thres);
 core_ctl_attr_rw(is_big_cluster);
+core_ctl_attr_rw(predict);
+core_ctl_attr_ro(pred_stats);
 core_ctl_attr_ro(cpus);
 core_ctl_attr_ro(need_cpus);
 core_ctl_attr_ro(active_cpus);
@@ -390,6 +421,8 @@ static struct attribute *default_attrs[] = {
 	&busy_down_thres.attr,
 	&task_thres.attr,
 	&is_big_cluster.attr,
+	&predict.attr,
+	&pred_stats.attr,
 	&cpus.attr,
 	&need_cpus.attr,
 	&active_cpus.attr,
@@ -518,6 +551,46 @@ static unsigned int apply_task_need(const struct cluster_data *cluster,
 	return new_need;
 }
 
+/*
+ * Unisolate ahead of a burst: the demand the runnable tasks are predicted to
+ * have in the next window is turned into a number of cpus busy at the up
+ * threshold. Predictions only ever add cpus. One is a hit if the busy cpus
+ * catch up with it within a poll period, and a miss otherwise.
+ */
+static unsigned int apply_pred_need(struct cluster_data *cluster,
+				    unsigned int need_cpus,
+				    unsigned int busy_cpus,
+				    unsigned int thres, s64 now)
+{
+	unsigned int pred_busy = 0, pred_need;
+	struct cpu_data *c;
+
+	if (cluster->pred_need) {
+		if (busy_cpus >= cluster->pred_need) {
+			cluster->pred_hits++;
+			cluster->pred_need = 0;
+		} else if (now - cluster->pred_ts >= rq_avg_period_ms) {
+			cluster->pred_misses++;
+			cluster->pred_need = 0;
+		}
+	}
+
+	if (!cluster->predict || !thres)
+		return need_cpus;
+
+	list_for_each_entry(c, &cluster->lru, sib)
+		pred_busy += sched_get_pred_busy(c->cpu);
+	pred_need = DIV_ROUND_UP(pred_busy, thres);
+	if (pred_need <= need_cpus)
+		return need_cpus;
+
+	if (!cluster->pred_need) {
+		cluster->pred_need = pred_need;
+		cluster->pred_ts = now;
+	}
+	return pred_need;
+}
+
 /* ======================= load based core count  ====================== */
 
 static unsigned int apply_limits(const struct cluster_data *cluster,
@@ -548,7 +621,7 @@ static bool eval_need(struct cluster_data *cluster)
 {
 	unsigned long flags;
 	struct cpu_data *c;
-	unsigned int need_cpus = 0, last_need, thres_idx;
+	unsigned int need_cpus = 0, last_need, thres_idx, busy_cpus;
 	int ret = 0;
 	bool need_flag = false;
 	unsigned int active_cpus;
@@ -560,6 +633,8 @@ static bool eval_need(struct cluster_data *cluster)
 
 	spin_lock_irqsave(&state_lock, flags);
 
+	now = ktime_to_ms(ktime_get());
+
 	if (cluster->boost) {
 		need_cpus = cluster->max_cpus;
 	} else {
@@ -572,13 +647,15 @@ static bool eval_need(struct cluster_data *cluster)
 				c->is_busy = false;
 			need_cpus += c->is_busy;
 		}
+		busy_cpus = need_cpus;
 		need_cpus = apply_task_need(cluster, need_cpus);
+		need_cpus = apply_pred_need(cluster, need_cpus, busy_cpus,
+				cluster->busy_up_thres[thres_idx], now);
 	}
 	new_need = apply_limits(cluster, need_cpus);
 	need_flag = adjustment_possible(cluster, new_need);
 
 	last_need = cluster->need_cpus;
-	now = ktime_to_ms(ktime_get());
 
 	if (new_need == last_need) {
 		cluster->need_ts = now;
@@ -998,6 +1075,7 @@ static int cluster_init(const struct cpumask *mask)
 	cluster->offline_delay_ms = 100;
 	cluster->task_thres = UINT_MAX;
 	cluster->nrrun = cluster->num_cpus;
+	cluster->predict = true;
 	INIT_LIST_HEAD(&cluster->lru);
 	spin_lock_init(&cluster->pending_lock);
 
@@ -5991,6 +5991,8 @@ unsigned long capacity_curr_of(int cpu)
 struct energy_env {
 	struct sched_group	*sg_top;
 	struct sched_group	*sg_cap;
+	struct sched_group	*sg_util;	/* sg_cap of max_util */
+	unsigned long		max_util;
 	int			cap_idx;
 	int			util_delta;
 	int			src_cpu;
@@ -6044,17 +6046,26 @@ static int calc_util_delta(struct energy_env *eenv, int cpu)
 	return 0;
 }
 
+/*
+ * All groups sharing a frequency domain have the same sg_cap, so its max util
+ * is only computed for the first of them in an energy_env.
+ */
 static
 unsigned long group_max_util(struct energy_env *eenv)
 {
 	int i, delta;
 	unsigned long max_util = 0;
 
+	if (eenv->sg_util == eenv->sg_cap)
+		return eenv->max_util;
+
 	for_each_cpu(i, sched_group_cpus(eenv->sg_cap)) {
 		delta = calc_util_delta(eenv, i);
 		max_util = max(max_util, __cpu_util(i, delta));
 	}
 
+	eenv->sg_util = eenv->sg_cap;
+	eenv->max_util = max_util;
 	return max_util;
 }
 
@@ -6084,17 +6095,24 @@ long group_norm_util(struct energy_env *eenv, struct sched_group *sg)
 	return util_sum;
 }
 
-static int find_new_capacity(struct energy_env *eenv,
-	const struct sched_group_energy const *sge)
+/*
+ * Finds the lowest capacity state of @sg that fits the max util of its
+ * sg_cap. The search starts from the state found last time for the group,
+ * which stays valid until a cpu's util crosses a capacity state boundary, so
+ * it usually takes no more than a step or two.
+ */
+static int find_new_capacity(struct energy_env *eenv, struct sched_group *sg)
 {
-	int idx;
+	const struct sched_group_energy *sge = sg->sge;
 	unsigned long util = group_max_util(eenv);
+	int idx = min_t(int, READ_ONCE(sg->sgc->cap_idx), sge->nr_cap_states);
 
-	for (idx = 0; idx < sge->nr_cap_states; idx++) {
-		if (sge->cap_states[idx].cap >= util)
-			break;
-	}
+	while (idx > 0 && sge->cap_states[idx - 1].cap >= util)
+		idx--;
+	while (idx < sge->nr_cap_states && sge->cap_states[idx].cap < util)
+		idx++;
 
+	WRITE_ONCE(sg->sgc->cap_idx, idx);
 	eenv->cap_idx = idx;
 
 	return idx;
@@ -6174,7 +6192,7 @@ static int sched_group_energy(struct energy_env *eenv)
 				else
 					eenv->sg_cap = sg;
 
-				cap_idx = find_new_capacity(eenv, sg->sge);
+				cap_idx = find_new_capacity(eenv, sg);
 
 				if (sg->group_weight == 1) {
 					/* Remove capacity of src CPU (before task move) */
@@ -6358,6 +6376,25 @@ energy_diff(struct energy_env *eenv)
 #define energy_diff(eenv) __energy_diff(eenv)
 #endif
 
+/*
+ * Accounts the evaluations of energy_diff() on wakeup and the time they take
+ * to the waking cpu, for /proc/schedstat.
+ */
+static int wake_energy_diff(struct energy_env *eenv)
+{
+#ifdef CONFIG_SCHEDSTATS
+	struct rq *rq = this_rq();
+	u64 start = local_clock();
+	int diff = energy_diff(eenv);
+
+	schedstat_inc(rq, eas_energy_count);
+	schedstat_add(rq, eas_energy_ns, local_clock() - start);
+	return diff;
+#else
+	return energy_diff(eenv);
+#endif
+}
+
 /*
  * Detect M:N waker/wakee relationships via a switching-frequency heuristic.
  * A waker of many should wake a different task than the one last awakened
@@ -7023,7 +7060,7 @@ static int energy_aware_wake_cpu(struct task_struct *p, int target, int sync)
 		if (cpu_overutilized(task_cpu(p)))
 			return target_cpu;
 
-		if (energy_diff(&eenv) >= 0)
+		if (wake_energy_diff(&eenv) >= 0)
 			return task_cpu(p);
 	}
 
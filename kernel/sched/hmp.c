@@ -3281,6 +3281,20 @@ exit_early:
 	}
 }
 
+/*
+ * Returns the demand that the tasks runnable on @cpu are predicted to have
+ * in the next window, from the busy buckets update_history() keeps of their
+ * demand history, in percent of a window at the cpu's max frequency. It is
+ * more than 100 when the cpu cannot meet that demand on its own.
+ */
+unsigned int sched_get_pred_busy(int cpu)
+{
+	u64 pred = READ_ONCE(cpu_rq(cpu)->hmp_stats.pred_demands_sum);
+
+	pred = scale_load_to_cpu(pred, cpu);
+	return div64_u64(pred * 100, sched_ravg_window);
+}
+
 void sched_set_io_is_busy(int val)
 {
 	sched_io_is_busy = val;
@@ -825,6 +825,10 @@ struct rq {
 	/* try_to_wake_up() stats */
 	unsigned int ttwu_count;
 	unsigned int ttwu_local;
+
+	/* energy_aware_wake_cpu() stats */
+	unsigned int eas_energy_count;
+	u64 eas_energy_ns;
 #endif
 
 #ifdef CONFIG_SMP
@@ -1001,6 +1005,11 @@ struct sched_group_capacity {
 	 * Number of busy cpus in this group.
 	 */
 	atomic_t nr_busy_cpus;
+	/*
+	 * Capacity state of the group last found by the energy model, where
+	 * the next search starts.
+	 */
+	int cap_idx;
 
 	unsigned long cpumask[0]; /* iteration mask */
 };
@@ -18,22 +18,72 @@
 #include <linux/hrtimer.h>
 #include <linux/sched.h>
 #include <linux/math64.h>
+#include <linux/seqlock.h>
 
 #include "sched.h"
 #include <trace/events/sched.h>
 
-static DEFINE_PER_CPU(u64, nr_prod_sum);
-static DEFINE_PER_CPU(u64, last_time);
-static DEFINE_PER_CPU(u64, nr_big_prod_sum);
-static DEFINE_PER_CPU(u64, nr);
+/*
+ * Time integrals of the nr_running, nr_big and iowait counts of a cpu since
+ * boot. They are only updated by the cpu's enqueues and dequeues, which the
+ * rq lock serializes, and are read under the seqcount by
+ * sched_get_nr_running_avg(), so sampling them never holds up the scheduler.
+ */
+struct nr_stats {
+	seqcount_t seq;
+	u64 last_time;
+	u64 nr;
+	u64 nr_prod_sum;
+	u64 nr_big_prod_sum;
+	u64 iowait_prod_sum;
+};
+
+static DEFINE_PER_CPU(struct nr_stats, nr_stats) = {
+	.seq = SEQCNT_ZERO(nr_stats.seq),
+};
+
+/* Sums of the integrals of all cpus at the last NR_AVG_HIST polls */
+#define NR_AVG_HIST	16
+
+struct nr_avg_snap {
+	u64 time;
+	u64 nr_prod_sum;
+	u64 nr_big_prod_sum;
+	u64 iowait_prod_sum;
+};
+
+static struct nr_avg_snap nr_avg_hist[NR_AVG_HIST];
+static unsigned int nr_avg_last;
+
+/*
+ * Averages are taken over at least this many ms, or since the last poll if
+ * that is longer. Polls further back than NR_AVG_HIST are not remembered.
+ */
+static unsigned int window_ms;
+module_param(window_ms, uint, 0644);
+
+/* Returns the oldest poll no more than window_ms before @now */
+static struct nr_avg_snap *nr_avg_window_start(u64 now)
+{
+	u64 window = (u64)READ_ONCE(window_ms) * NSEC_PER_MSEC;
+	unsigned int idx = nr_avg_last, prev, n;
+
+	for (n = 1; n < NR_AVG_HIST; n++) {
+		if (now - nr_avg_hist[idx].time >= window)
+			break;
+		prev = (idx + NR_AVG_HIST - 1) % NR_AVG_HIST;
+		if (!nr_avg_hist[prev].time)
+			break;
+		idx = prev;
+	}
 
-static DEFINE_PER_CPU(unsigned long, iowait_prod_sum);
-static DEFINE_PER_CPU(spinlock_t, nr_lock) = __SPIN_LOCK_UNLOCKED(nr_lock);
-static s64 last_get_time;
+	return &nr_avg_hist[idx];
+}
 
 /**
  * sched_get_nr_running_avg
- * @return: Average nr_running, iowait and nr_big_tasks value since last poll.
+ * @return: Average nr_running, iowait and nr_big_tasks value since last poll,
+ *	    or over window_ms if that is longer.
  *	    Returns the avg * 100 to return up to two decimal points
  *	    of accuracy.
  *
@@ -42,51 +92,51 @@ static s64 last_get_time;
  */
 void sched_get_nr_running_avg(int *avg, int *iowait_avg, int *big_avg)
 {
+	struct nr_avg_snap now = { .time = sched_clock() }, *then;
+	u64 diff;
 	int cpu;
-	u64 curr_time = sched_clock();
-	u64 diff = curr_time - last_get_time;
-	u64 tmp_avg = 0, tmp_iowait = 0, tmp_big_avg = 0;
 
 	*avg = 0;
 	*iowait_avg = 0;
 	*big_avg = 0;
 
-	if (!diff)
-		return;
-
-	/* read and reset nr_running counts */
 	for_each_possible_cpu(cpu) {
-		unsigned long flags;
-
-		spin_lock_irqsave(&per_cpu(nr_lock, cpu), flags);
-		curr_time = sched_clock();
-		diff = curr_time - per_cpu(last_time, cpu);
-		BUG_ON((s64)diff < 0);
-
-		tmp_avg += per_cpu(nr_prod_sum, cpu);
-		tmp_avg += per_cpu(nr, cpu) * diff;
-
-		tmp_big_avg += per_cpu(nr_big_prod_sum, cpu);
-		tmp_big_avg += nr_eligible_big_tasks(cpu) * diff;
-
-		tmp_iowait += per_cpu(iowait_prod_sum, cpu);
-		tmp_iowait +=  nr_iowait_cpu(cpu) * diff;
-
-		per_cpu(last_time, cpu) = curr_time;
-
-		per_cpu(nr_prod_sum, cpu) = 0;
-		per_cpu(nr_big_prod_sum, cpu) = 0;
-		per_cpu(iowait_prod_sum, cpu) = 0;
-
-		spin_unlock_irqrestore(&per_cpu(nr_lock, cpu), flags);
+		struct nr_stats *stats = &per_cpu(nr_stats, cpu);
+		u64 last_time, nr, nr_prod, nr_big_prod, iowait_prod;
+		unsigned int seq;
+
+		do {
+			seq = read_seqcount_begin(&stats->seq);
+			last_time = stats->last_time;
+			nr = stats->nr;
+			nr_prod = stats->nr_prod_sum;
+			nr_big_prod = stats->nr_big_prod_sum;
+			iowait_prod = stats->iowait_prod_sum;
+		} while (read_seqcount_retry(&stats->seq, seq));
+
+		/* the cpu may have updated its stats after now was taken */
+		diff = now.time > last_time ? now.time - last_time : 0;
+
+		now.nr_prod_sum += nr_prod + nr * diff;
+		now.nr_big_prod_sum += nr_big_prod +
+				       nr_eligible_big_tasks(cpu) * diff;
+		now.iowait_prod_sum += iowait_prod + nr_iowait_cpu(cpu) * diff;
 	}
 
-	diff = curr_time - last_get_time;
-	last_get_time = curr_time;
+	then = nr_avg_window_start(now.time);
+	diff = now.time - then->time;
+	if (!diff)
+		return;
+
+	*avg = (int)div64_u64((now.nr_prod_sum - then->nr_prod_sum) * 100,
+			      diff);
+	*big_avg = (int)div64_u64((now.nr_big_prod_sum -
+				   then->nr_big_prod_sum) * 100, diff);
+	*iowait_avg = (int)div64_u64((now.iowait_prod_sum -
+				      then->iowait_prod_sum) * 100, diff);
 
-	*avg = (int)div64_u64(tmp_avg * 100, diff);
-	*big_avg = (int)div64_u64(tmp_big_avg * 100, diff);
-	*iowait_avg = (int)div64_u64(tmp_iowait * 100, diff);
+	nr_avg_last = (nr_avg_last + 1) % NR_AVG_HIST;
+	nr_avg_hist[nr_avg_last] = now;
 
 	trace_sched_get_nr_running_avg(*avg, *big_avg, *iowait_avg);
 
@@ -103,27 +153,29 @@ EXPORT_SYMBOL(sched_get_nr_running_avg);
  * @inc: Whether we are increasing or decreasing the count
  * @return: N/A
  *
- * Update average with latest nr_running value for CPU
+ * Update average with latest nr_running value for CPU.
+ * Called with the rq lock of @cpu held.
  */
 void sched_update_nr_prod(int cpu, long delta, bool inc)
 {
+	struct nr_stats *stats = &per_cpu(nr_stats, cpu);
 	u64 diff;
 	u64 curr_time;
-	unsigned long flags, nr_running;
+	unsigned long nr_running;
 
-	spin_lock_irqsave(&per_cpu(nr_lock, cpu), flags);
-	nr_running = per_cpu(nr, cpu);
+	write_seqcount_begin(&stats->seq);
+	nr_running = stats->nr;
 	curr_time = sched_clock();
-	diff = curr_time - per_cpu(last_time, cpu);
+	diff = curr_time - stats->last_time;
 	BUG_ON((s64)diff < 0);
-	per_cpu(last_time, cpu) = curr_time;
-	per_cpu(nr, cpu) = nr_running + (inc ? delta : -delta);
+	stats->last_time = curr_time;
+	stats->nr = nr_running + (inc ? delta : -delta);
 
-	BUG_ON((s64)per_cpu(nr, cpu) < 0);
+	BUG_ON((s64)stats->nr < 0);
 
-	per_cpu(nr_prod_sum, cpu) += nr_running * diff;
-	per_cpu(nr_big_prod_sum, cpu) += nr_eligible_big_tasks(cpu) * diff;
-	per_cpu(iowait_prod_sum, cpu) += nr_iowait_cpu(cpu) * diff;
-	spin_unlock_irqrestore(&per_cpu(nr_lock, cpu), flags);
+	stats->nr_prod_sum += nr_running * diff;
+	stats->nr_big_prod_sum += nr_eligible_big_tasks(cpu) * diff;
+	stats->iowait_prod_sum += nr_iowait_cpu(cpu) * diff;
+	write_seqcount_end(&stats->seq);
 }
 EXPORT_SYMBOL(sched_update_nr_prod);
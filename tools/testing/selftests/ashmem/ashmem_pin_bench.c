@@ -0,0 +1,196 @@
+/*
+ * ashmem pin/unpin benchmark.
+ *
+ * Sets up ashmem areas with every other page unpinned, so that each area
+ * holds a given number of separate unpinned ranges, like the tile cache of
+ * a browser does. Then repeatedly pins one of those pages and unpins it
+ * again, first from a single thread, then from one thread per CPU each
+ * working on its own area. The time per pin/unpin pair and the aggregate
+ * pairs per second are reported for 16 up to max_ranges ranges per area.
+ *
+ * Usage: ashmem_pin_bench [-n max_ranges] [-i iterations]
+ *
+ * The test is skipped when /dev/ashmem cannot be opened.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "ashmem.h"
+
+#include "../kselftest.h"
+
+#define DEFAULT_MAX_RANGES	4096
+#define DEFAULT_ITERATIONS	100000
+
+static long page_size;
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	int ranges;
+	int iterations;
+	int error;
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int pin_op(int fd, unsigned long cmd, int page)
+{
+	struct ashmem_pin pin = {
+		.offset = page * page_size,
+		.len = page_size,
+	};
+
+	return ioctl(fd, cmd, &pin) < 0 ? -1 : 0;
+}
+
+/* Returns an area with @ranges unpinned ranges, or -1 */
+static int setup_area(int ranges)
+{
+	size_t len = 2 * ranges * page_size;
+	void *map;
+	int fd, i;
+
+	fd = open("/dev/ashmem", O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	/* the backing file, which pinning needs, is created by mmap */
+	if (ioctl(fd, ASHMEM_SET_SIZE, len) < 0)
+		goto err;
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto err;
+	munmap(map, len);
+
+	for (i = 0; i < ranges; i++)
+		if (pin_op(fd, ASHMEM_UNPIN, 2 * i + 1))
+			goto err;
+	return fd;
+err:
+	close(fd);
+	return -1;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int seed = w->fd;
+	int i, page;
+
+	for (i = 0; i < w->iterations; i++) {
+		page = 2 * (rand_r(&seed) % w->ranges) + 1;
+		if (pin_op(w->fd, ASHMEM_PIN, page) ||
+		    pin_op(w->fd, ASHMEM_UNPIN, page)) {
+			w->error = 1;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Returns the pin/unpin pairs per second of all threads, or -1 */
+static double run_round(int threads, int ranges, int iterations)
+{
+	struct worker *workers = calloc(threads, sizeof(*workers));
+	double start, elapsed;
+	int i, started, error = 0;
+
+	if (!workers)
+		return -1;
+	for (i = 0; i < threads; i++) {
+		workers[i].ranges = ranges;
+		workers[i].iterations = iterations;
+		workers[i].fd = setup_area(ranges);
+		if (workers[i].fd < 0)
+			error = 1;
+	}
+
+	start = now_ns();
+	for (started = 0; started < threads && !error; started++)
+		if (pthread_create(&workers[started].thread, NULL,
+				   worker_thread, &workers[started]))
+			error = 1;
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		error |= workers[i].error;
+	}
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < threads; i++)
+		if (workers[i].fd >= 0)
+			close(workers[i].fd);
+	free(workers);
+	return error ? -1 : (double)threads * iterations * 1e9 / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	int max_ranges = DEFAULT_MAX_RANGES;
+	int iterations = DEFAULT_ITERATIONS;
+	int nr_cpus, ranges, opt, fd;
+
+	while ((opt = getopt(argc, argv, "n:i:")) != -1) {
+		switch (opt) {
+		case 'n':
+			max_ranges = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n max_ranges] [-i iterations]\n",
+				argv[0]);
+			return ksft_exit_fail();
+		}
+	}
+	if (max_ranges < 1 || iterations < 1) {
+		fprintf(stderr, "invalid range count or iterations\n");
+		return ksft_exit_fail();
+	}
+
+	fd = open("/dev/ashmem", O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		printf("cannot open /dev/ashmem, skipping\n");
+		return ksft_exit_skip();
+	}
+	close(fd);
+
+	page_size = sysconf(_SC_PAGESIZE);
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	printf("%8s %16s %20s\n", "ranges", "1 thread ns/pair",
+	       "all cpus pairs/s");
+	for (ranges = 16; ranges <= max_ranges; ranges *= 4) {
+		double single, all;
+
+		single = run_round(1, ranges, iterations);
+		all = run_round(nr_cpus, ranges, iterations);
+		if (single < 0 || all < 0) {
+			printf("round with %d ranges failed: %s\n", ranges,
+			       strerror(errno));
+			ksft_inc_fail_cnt();
+			break;
+		}
+		printf("%8d %16.0f %20.0f\n", ranges, 1e9 / single, all);
+		ksft_inc_pass_cnt();
+	}
+
+	ksft_print_cnts();
+	return ksft_cnt.ksft_fail ? ksft_exit_fail() : ksft_exit_pass();
+}
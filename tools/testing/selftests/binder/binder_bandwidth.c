@@ -0,0 +1,366 @@
+/*
+ * Binder scatter-gather bandwidth benchmark.
+ *
+ * The parent process registers itself as the context manager of a binder
+ * device and answers every transaction from a looper thread after checking
+ * the payload it received. A forked client sends a single large
+ * BINDER_TYPE_PTR buffer per transaction, once copied by the driver and
+ * once with TF_ZERO_COPY, in which case the driver hands the client's
+ * anonymous pages over to the server instead. The client writes the
+ * payload again for each transaction, which faults in fresh pages after a
+ * handover. The throughput of both paths is reported
+ * for a range of payload sizes.
+ *
+ * Usage: binder_bandwidth [-d device] [-t seconds]
+ *
+ * The test is skipped when the device cannot be opened or another process
+ * already is the context manager.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/android/binder.h>
+
+#include "../kselftest.h"
+
+#define SERVER_MAP_SIZE		(4 * 1024 * 1024)
+#define CLIENT_MAP_SIZE		(128 * 1024)
+#define MAX_PAYLOAD		(1024 * 1024)
+#define READ_BUF_SIZE		256
+#define DEFAULT_SECONDS		2
+
+static const char *device = "/dev/binder";
+
+static int binder_open_map(size_t map_size)
+{
+	struct binder_version version;
+	int fd;
+
+	fd = open(device, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (ioctl(fd, BINDER_VERSION, &version) < 0 ||
+	    version.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION ||
+	    mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0) ==
+	    MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int binder_write_read(int fd, void *wbuf, size_t wsize,
+			     void *rbuf, size_t rsize, size_t *consumed)
+{
+	struct binder_write_read bwr = {
+		.write_size = wsize,
+		.write_buffer = (binder_uintptr_t)(uintptr_t)wbuf,
+		.read_size = rsize,
+		.read_buffer = (binder_uintptr_t)(uintptr_t)rbuf,
+	};
+	int ret;
+
+	do {
+		ret = ioctl(fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	if (consumed)
+		*consumed = bwr.read_consumed;
+	return 0;
+}
+
+/*
+ * The payload carries the transaction code in its first and last byte, so
+ * the server can tell a stale or misplaced mapping from the right data.
+ */
+static uint32_t check_payload(struct binder_transaction_data *tr)
+{
+	struct binder_buffer_object *bp;
+	const uint8_t *buf;
+
+	if (tr->data_size < sizeof(*bp) || tr->offsets_size < sizeof(uint64_t))
+		return 1;
+	bp = (struct binder_buffer_object *)(uintptr_t)tr->data.ptr.buffer;
+	if (bp->hdr.type != BINDER_TYPE_PTR || !bp->length)
+		return 1;
+	buf = (const uint8_t *)(uintptr_t)bp->buffer;
+	return buf[0] != (uint8_t)tr->code ||
+	       buf[bp->length - 1] != (uint8_t)tr->code;
+}
+
+struct __attribute__((packed)) reply_cmds {
+	uint32_t free_cmd;
+	binder_uintptr_t free_ptr;
+	uint32_t reply_cmd;
+	struct binder_transaction_data reply;
+};
+
+static void *server_thread(void *arg)
+{
+	int fd = *(int *)arg;
+	uint32_t enter = BC_ENTER_LOOPER;
+	uint8_t rbuf[READ_BUF_SIZE];
+	struct reply_cmds cmds;
+	uint32_t status;
+
+	if (binder_write_read(fd, &enter, sizeof(enter), NULL, 0, NULL))
+		return NULL;
+
+	for (;;) {
+		size_t consumed, off = 0;
+
+		if (binder_write_read(fd, NULL, 0, rbuf, sizeof(rbuf),
+				      &consumed))
+			return NULL;
+
+		while (off + sizeof(uint32_t) <= consumed) {
+			uint32_t cmd = *(uint32_t *)(rbuf + off);
+			struct binder_transaction_data *tr;
+
+			off += sizeof(uint32_t);
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_SPAWN_LOOPER:
+			case BR_TRANSACTION_COMPLETE:
+				break;
+			case BR_INCREFS:
+			case BR_ACQUIRE:
+			case BR_RELEASE:
+			case BR_DECREFS:
+				off += sizeof(struct binder_ptr_cookie);
+				break;
+			case BR_TRANSACTION:
+				tr = (void *)(rbuf + off);
+				off += sizeof(*tr);
+				status = check_payload(tr);
+				memset(&cmds, 0, sizeof(cmds));
+				cmds.free_cmd = BC_FREE_BUFFER;
+				cmds.free_ptr = tr->data.ptr.buffer;
+				cmds.reply_cmd = BC_REPLY;
+				cmds.reply.data_size = sizeof(status);
+				cmds.reply.data.ptr.buffer =
+					(binder_uintptr_t)(uintptr_t)&status;
+				if (binder_write_read(fd, &cmds, sizeof(cmds),
+						      NULL, 0, NULL))
+					return NULL;
+				break;
+			default:
+				fprintf(stderr, "server: unexpected return %#x\n",
+					cmd);
+				return NULL;
+			}
+		}
+	}
+	return NULL;
+}
+
+struct __attribute__((packed)) txn_cmds {
+	uint32_t free_cmd;
+	binder_uintptr_t free_ptr;
+	uint32_t txn_cmd;
+	struct binder_transaction_data_sg txn;
+};
+
+/* Returns the number of bytes transferred per second, or -1 on error */
+static double run_client(int fd, uint8_t *payload, size_t size,
+			 uint32_t flags, int seconds)
+{
+	struct binder_buffer_object obj;
+	binder_size_t offsets[1] = { 0 };
+	struct txn_cmds cmds;
+	struct timespec start, now;
+	binder_uintptr_t pending = 0;
+	uint8_t rbuf[READ_BUF_SIZE];
+	unsigned long count = 0;
+	double elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		uint8_t code = count + 1;
+		int got_reply = 0;
+		uint8_t *wbuf = (uint8_t *)&cmds;
+		size_t wsize = sizeof(cmds);
+
+		memset(payload, code, size);
+		memset(&obj, 0, sizeof(obj));
+		obj.hdr.type = BINDER_TYPE_PTR;
+		obj.buffer = (binder_uintptr_t)(uintptr_t)payload;
+		obj.length = size;
+
+		memset(&cmds, 0, sizeof(cmds));
+		cmds.free_cmd = BC_FREE_BUFFER;
+		cmds.free_ptr = pending;
+		cmds.txn_cmd = BC_TRANSACTION_SG;
+		cmds.txn.transaction_data.code = code;
+		cmds.txn.transaction_data.flags = flags;
+		cmds.txn.transaction_data.data_size = sizeof(obj);
+		cmds.txn.transaction_data.offsets_size = sizeof(offsets);
+		cmds.txn.transaction_data.data.ptr.buffer =
+			(binder_uintptr_t)(uintptr_t)&obj;
+		cmds.txn.transaction_data.data.ptr.offsets =
+			(binder_uintptr_t)(uintptr_t)offsets;
+		cmds.txn.buffers_size = (size + 7) & ~(size_t)7;
+		if (!pending) {
+			wbuf += offsetof(struct txn_cmds, txn_cmd);
+			wsize -= offsetof(struct txn_cmds, txn_cmd);
+		}
+		if (binder_write_read(fd, wbuf, wsize, NULL, 0, NULL))
+			return -1;
+
+		while (!got_reply) {
+			size_t consumed, off = 0;
+
+			if (binder_write_read(fd, NULL, 0, rbuf, sizeof(rbuf),
+					      &consumed))
+				return -1;
+			while (off + sizeof(uint32_t) <= consumed) {
+				uint32_t cmd = *(uint32_t *)(rbuf + off);
+				struct binder_transaction_data *tr;
+
+				off += sizeof(uint32_t);
+				switch (cmd) {
+				case BR_NOOP:
+				case BR_TRANSACTION_COMPLETE:
+					break;
+				case BR_REPLY:
+					tr = (void *)(rbuf + off);
+					off += sizeof(*tr);
+					pending = tr->data.ptr.buffer;
+					if (*(uint32_t *)(uintptr_t)pending) {
+						fprintf(stderr,
+							"server got corrupt payload\n");
+						return -1;
+					}
+					got_reply = 1;
+					break;
+				default:
+					fprintf(stderr,
+						"client: unexpected return %#x\n",
+						cmd);
+					return -1;
+				}
+			}
+		}
+		count++;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) +
+			  (now.tv_nsec - start.tv_nsec) / 1e9;
+	} while (elapsed < seconds);
+
+	/* hand the last reply back, cmds still starts with BC_FREE_BUFFER */
+	cmds.free_ptr = pending;
+	if (binder_write_read(fd, &cmds, offsetof(struct txn_cmds, txn_cmd),
+			      NULL, 0, NULL))
+		return -1;
+	return count * (double)size / elapsed;
+}
+
+static int run_benchmark(int seconds)
+{
+	static const size_t sizes[] = {
+		64 * 1024, 256 * 1024, MAX_PAYLOAD,
+	};
+	uint8_t *payload;
+	unsigned int i;
+	int fd;
+
+	fd = binder_open_map(CLIENT_MAP_SIZE);
+	if (fd < 0)
+		return 1;
+	/* only private anonymous memory can be mapped zero-copy */
+	payload = mmap(NULL, MAX_PAYLOAD, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (payload == MAP_FAILED)
+		return 1;
+	memset(payload, 0x5a, MAX_PAYLOAD);
+
+	printf("%10s %14s %14s\n", "size", "copy MB/s", "zero-copy MB/s");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		double copy, zero_copy;
+
+		copy = run_client(fd, payload, sizes[i], 0, seconds);
+		zero_copy = run_client(fd, payload, sizes[i], TF_ZERO_COPY,
+				       seconds);
+		if (copy < 0 || zero_copy < 0)
+			return 1;
+		printf("%10zu %14.1f %14.1f\n", sizes[i], copy / 1e6,
+		       zero_copy / 1e6);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int seconds = DEFAULT_SECONDS;
+	pthread_t thread;
+	int server_fd, opt, status;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "d:t:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d device] [-t seconds]\n",
+				argv[0]);
+			return ksft_exit_fail();
+		}
+	}
+	if (seconds < 1) {
+		fprintf(stderr, "invalid duration\n");
+		return ksft_exit_fail();
+	}
+
+	server_fd = binder_open_map(SERVER_MAP_SIZE);
+	if (server_fd < 0) {
+		printf("cannot open %s, skipping\n", device);
+		return ksft_exit_skip();
+	}
+	if (ioctl(server_fd, BINDER_SET_CONTEXT_MGR, 0) < 0) {
+		printf("cannot become context manager of %s (%s), skipping\n",
+		       device, strerror(errno));
+		return ksft_exit_skip();
+	}
+	if (ioctl(server_fd, BINDER_SET_ZERO_COPY, &(uint32_t){ 1 }) < 0) {
+		printf("BINDER_SET_ZERO_COPY not supported, skipping\n");
+		return ksft_exit_skip();
+	}
+	if (pthread_create(&thread, NULL, server_thread, &server_fd)) {
+		perror("pthread_create");
+		return ksft_exit_fail();
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return ksft_exit_fail();
+	}
+	if (pid == 0)
+		_exit(run_benchmark(seconds));
+
+	/* The looper thread blocks in the driver; exit tears it down. */
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status)) {
+		printf("benchmark failed\n");
+		return ksft_exit_fail();
+	}
+	return ksft_exit_pass();
+}
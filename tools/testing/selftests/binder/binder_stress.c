@@ -0,0 +1,357 @@
+/*
+ * Binder transaction throughput stress test.
+ *
+ * The parent process registers itself as the context manager of a binder
+ * device and serves every incoming transaction with an empty reply from a
+ * pool of looper threads. For an increasing number of concurrent client
+ * processes it then measures how many synchronous round-trip transactions
+ * per second the driver sustains, which is a direct measure of contention
+ * on the driver's internal locks.
+ *
+ * Usage: binder_stress [-d device] [-n max_clients] [-t seconds]
+ *
+ * The test is skipped when the device cannot be opened or another process
+ * already is the context manager (e.g. servicemanager on a running Android
+ * system).
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/android/binder.h>
+
+#include "../kselftest.h"
+
+#define BINDER_MAP_SIZE		(128 * 1024)
+#define READ_BUF_SIZE		256
+#define DEFAULT_MAX_CLIENTS	8
+#define DEFAULT_SECONDS		2
+
+static const char *device = "/dev/binder";
+
+struct binder_conn {
+	int fd;
+	void *map;
+};
+
+static int binder_conn_open(struct binder_conn *conn)
+{
+	struct binder_version version;
+
+	conn->fd = open(device, O_RDWR | O_CLOEXEC);
+	if (conn->fd < 0)
+		return -errno;
+	if (ioctl(conn->fd, BINDER_VERSION, &version) < 0 ||
+	    version.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		close(conn->fd);
+		return -EPROTO;
+	}
+	conn->map = mmap(NULL, BINDER_MAP_SIZE, PROT_READ, MAP_PRIVATE,
+			 conn->fd, 0);
+	if (conn->map == MAP_FAILED) {
+		close(conn->fd);
+		return -errno;
+	}
+	return 0;
+}
+
+static void binder_conn_close(struct binder_conn *conn)
+{
+	munmap(conn->map, BINDER_MAP_SIZE);
+	close(conn->fd);
+}
+
+static int binder_write_read(int fd, void *wbuf, size_t wsize,
+			     void *rbuf, size_t rsize, size_t *consumed)
+{
+	struct binder_write_read bwr = {
+		.write_size = wsize,
+		.write_buffer = (binder_uintptr_t)(uintptr_t)wbuf,
+		.read_size = rsize,
+		.read_buffer = (binder_uintptr_t)(uintptr_t)rbuf,
+	};
+	int ret;
+
+	do {
+		ret = ioctl(fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	if (consumed)
+		*consumed = bwr.read_consumed;
+	return 0;
+}
+
+/*
+ * Command stream used by both sides: an optional BC_FREE_BUFFER for the
+ * buffer received last, followed by a transaction or reply with no payload.
+ */
+struct __attribute__((packed)) txn_cmds {
+	uint32_t free_cmd;
+	binder_uintptr_t free_ptr;
+	uint32_t txn_cmd;
+	struct binder_transaction_data txn;
+};
+
+static size_t txn_cmds_prepare(struct txn_cmds *cmds, uint32_t cmd,
+			       binder_uintptr_t to_free)
+{
+	memset(cmds, 0, sizeof(*cmds));
+	cmds->free_cmd = BC_FREE_BUFFER;
+	cmds->free_ptr = to_free;
+	cmds->txn_cmd = cmd;
+	cmds->txn.target.handle = 0;
+	cmds->txn.code = 1;
+	return sizeof(*cmds);
+}
+
+static void *server_thread(void *arg)
+{
+	int fd = *(int *)arg;
+	uint32_t enter = BC_ENTER_LOOPER;
+	uint8_t rbuf[READ_BUF_SIZE];
+	struct txn_cmds cmds;
+
+	if (binder_write_read(fd, &enter, sizeof(enter), NULL, 0, NULL))
+		return NULL;
+
+	for (;;) {
+		size_t consumed, off = 0;
+
+		if (binder_write_read(fd, NULL, 0, rbuf, sizeof(rbuf),
+				      &consumed))
+			return NULL;
+
+		while (off + sizeof(uint32_t) <= consumed) {
+			uint32_t cmd = *(uint32_t *)(rbuf + off);
+
+			off += sizeof(uint32_t);
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_SPAWN_LOOPER:
+			case BR_TRANSACTION_COMPLETE:
+				break;
+			case BR_INCREFS:
+			case BR_ACQUIRE:
+			case BR_RELEASE:
+			case BR_DECREFS:
+				off += sizeof(struct binder_ptr_cookie);
+				break;
+			case BR_TRANSACTION: {
+				struct binder_transaction_data *tr =
+					(void *)(rbuf + off);
+				size_t size;
+
+				off += sizeof(*tr);
+				size = txn_cmds_prepare(&cmds, BC_REPLY,
+							tr->data.ptr.buffer);
+				if (binder_write_read(fd, &cmds, size,
+						      NULL, 0, NULL))
+					return NULL;
+				break;
+			}
+			default:
+				fprintf(stderr, "server: unexpected return %#x\n",
+					cmd);
+				return NULL;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Returns the number of completed round trips, or -1 on error */
+static long run_client(int seconds)
+{
+	struct binder_conn conn;
+	struct txn_cmds cmds;
+	struct timespec now, end;
+	binder_uintptr_t pending = 0;
+	uint8_t rbuf[READ_BUF_SIZE];
+	long count = 0;
+
+	if (binder_conn_open(&conn))
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += seconds;
+	do {
+		int got_reply = 0;
+		size_t size;
+		uint8_t *wbuf;
+
+		size = txn_cmds_prepare(&cmds, BC_TRANSACTION, pending);
+		wbuf = (uint8_t *)&cmds;
+		if (!pending) {
+			/* nothing to free on the first iteration */
+			wbuf += offsetof(struct txn_cmds, txn_cmd);
+			size -= offsetof(struct txn_cmds, txn_cmd);
+		}
+		if (binder_write_read(conn.fd, wbuf, size, NULL, 0, NULL))
+			goto err;
+
+		while (!got_reply) {
+			size_t consumed, off = 0;
+
+			if (binder_write_read(conn.fd, NULL, 0, rbuf,
+					      sizeof(rbuf), &consumed))
+				goto err;
+			while (off + sizeof(uint32_t) <= consumed) {
+				uint32_t cmd = *(uint32_t *)(rbuf + off);
+				struct binder_transaction_data *tr;
+
+				off += sizeof(uint32_t);
+				switch (cmd) {
+				case BR_NOOP:
+				case BR_TRANSACTION_COMPLETE:
+					break;
+				case BR_REPLY:
+					tr = (void *)(rbuf + off);
+					off += sizeof(*tr);
+					pending = tr->data.ptr.buffer;
+					got_reply = 1;
+					break;
+				default:
+					fprintf(stderr,
+						"client: unexpected return %#x\n",
+						cmd);
+					goto err;
+				}
+			}
+		}
+		count++;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (now.tv_sec < end.tv_sec ||
+		 (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec));
+
+	binder_conn_close(&conn);
+	return count;
+err:
+	binder_conn_close(&conn);
+	return -1;
+}
+
+static int run_round(int clients, int seconds, long *results)
+{
+	pid_t *pids;
+	int i, ret = 0;
+
+	pids = calloc(clients, sizeof(*pids));
+	if (!pids)
+		return -1;
+
+	for (i = 0; i < clients; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			ret = -1;
+			clients = i;
+			break;
+		}
+		if (pids[i] == 0) {
+			results[i] = run_client(seconds);
+			_exit(results[i] < 0);
+		}
+	}
+	for (i = 0; i < clients; i++) {
+		int status;
+
+		if (waitpid(pids[i], &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status))
+			ret = -1;
+	}
+	free(pids);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct binder_conn server;
+	pthread_t *threads;
+	long *results;
+	int max_clients = DEFAULT_MAX_CLIENTS;
+	int seconds = DEFAULT_SECONDS;
+	int clients, i, opt;
+
+	while ((opt = getopt(argc, argv, "d:n:t:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'n':
+			max_clients = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"usage: %s [-d device] [-n max_clients] [-t seconds]\n",
+				argv[0]);
+			return ksft_exit_fail();
+		}
+	}
+	if (max_clients < 1 || seconds < 1) {
+		fprintf(stderr, "invalid client count or duration\n");
+		return ksft_exit_fail();
+	}
+
+	if (binder_conn_open(&server)) {
+		printf("cannot open %s, skipping\n", device);
+		return ksft_exit_skip();
+	}
+	if (ioctl(server.fd, BINDER_SET_CONTEXT_MGR, 0) < 0) {
+		printf("cannot become context manager of %s (%s), skipping\n",
+		       device, strerror(errno));
+		binder_conn_close(&server);
+		return ksft_exit_skip();
+	}
+
+	threads = calloc(max_clients, sizeof(*threads));
+	results = mmap(NULL, max_clients * sizeof(*results),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		       -1, 0);
+	if (!threads || results == MAP_FAILED) {
+		perror("alloc");
+		return ksft_exit_fail();
+	}
+	for (i = 0; i < max_clients; i++) {
+		if (pthread_create(&threads[i], NULL, server_thread,
+				   &server.fd)) {
+			perror("pthread_create");
+			return ksft_exit_fail();
+		}
+	}
+
+	printf("%8s %16s %16s\n", "clients", "transactions/s", "per client");
+	for (clients = 1; clients <= max_clients; clients *= 2) {
+		long total = 0;
+
+		memset(results, 0, max_clients * sizeof(*results));
+		if (run_round(clients, seconds, results)) {
+			printf("round with %d clients failed\n", clients);
+			ksft_inc_fail_cnt();
+			break;
+		}
+		for (i = 0; i < clients; i++)
+			total += results[i];
+		printf("%8d %16ld %16ld\n", clients, total / seconds,
+		       total / seconds / clients);
+		ksft_inc_pass_cnt();
+	}
+
+	/* The looper threads block in the driver; exit tears them down. */
+	ksft_print_cnts();
+	return ksft_cnt.ksft_fail ? ksft_exit_fail() : ksft_exit_pass();
+}
@@ -0,0 +1,229 @@
+/*
+ * f2fs multi-threaded random read benchmark.
+ *
+ * Writes a file on an f2fs mount and then overwrites every other chunk of
+ * it, so that its blocks are split over many extents and its extent tree
+ * holds many nodes. Then, for 1, 2, 4... up to max_threads threads, drops
+ * the file from the page cache and reads all of its blocks in random
+ * order, each thread taking its share of one shuffled list. Every read
+ * misses the page cache and so looks the block up in the extent tree.
+ * The reads per second and the throughput of each round are reported.
+ *
+ * Usage: f2fs_read_bench [-d dir] [-s size_mb] [-t max_threads]
+ *
+ * The test is skipped when dir is not on f2fs.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/statfs.h>
+
+#include "../kselftest.h"
+
+#define F2FS_SUPER_MAGIC	0xF2F52010
+#define DEFAULT_DIR		"/data/local/tmp"
+#define DEFAULT_SIZE_MB		64
+#define BLOCK_SIZE		4096
+/* blocks per chunk, every other one of which is rewritten */
+#define CHUNK_BLOCKS		64
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	unsigned int *blocks;
+	unsigned int nr_blocks;
+	int error;
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int write_blocks(int fd, unsigned int start, unsigned int count,
+			char *buf)
+{
+	unsigned int i;
+
+	for (i = start; i < start + count; i++) {
+		memset(buf, i, BLOCK_SIZE);
+		if (pwrite(fd, buf, BLOCK_SIZE, (off_t)i * BLOCK_SIZE) !=
+		    BLOCK_SIZE)
+			return -1;
+	}
+	return 0;
+}
+
+/* Returns the fd of a file of @nr_blocks blocks in many extents, or -1 */
+static int setup_file(const char *path, unsigned int nr_blocks)
+{
+	char buf[BLOCK_SIZE];
+	unsigned int i;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -1;
+	if (write_blocks(fd, 0, nr_blocks, buf) || fsync(fd))
+		goto err;
+	/* out-of-place updates move the rewritten chunks elsewhere */
+	for (i = 0; i < nr_blocks; i += 2 * CHUNK_BLOCKS)
+		if (write_blocks(fd, i, i + CHUNK_BLOCKS > nr_blocks ?
+				 nr_blocks - i : CHUNK_BLOCKS, buf))
+			goto err;
+	if (fsync(fd))
+		goto err;
+	return fd;
+err:
+	close(fd);
+	return -1;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	char buf[BLOCK_SIZE];
+	unsigned int i;
+
+	for (i = 0; i < w->nr_blocks; i++) {
+		if (pread(w->fd, buf, BLOCK_SIZE,
+			  (off_t)w->blocks[i] * BLOCK_SIZE) != BLOCK_SIZE) {
+			w->error = 1;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Returns the reads per second of all threads, or -1 */
+static double run_round(int fd, int threads, unsigned int *blocks,
+			unsigned int nr_blocks)
+{
+	struct worker *workers = calloc(threads, sizeof(*workers));
+	unsigned int share = nr_blocks / threads;
+	double start, elapsed;
+	int i, started, error = 0;
+
+	if (!workers)
+		return -1;
+	if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) ||
+	    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM))
+		error = 1;
+	for (i = 0; i < threads; i++) {
+		workers[i].fd = fd;
+		workers[i].blocks = blocks + i * share;
+		workers[i].nr_blocks = share;
+	}
+
+	start = now_ns();
+	for (started = 0; started < threads && !error; started++)
+		if (pthread_create(&workers[started].thread, NULL,
+				   worker_thread, &workers[started]))
+			error = 1;
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		error |= workers[i].error;
+	}
+	elapsed = now_ns() - start;
+
+	free(workers);
+	return error ? -1 : (double)share * threads * 1e9 / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = DEFAULT_DIR;
+	int size_mb = DEFAULT_SIZE_MB;
+	int max_threads = 0;
+	unsigned int *blocks, nr_blocks, i, j, tmp;
+	unsigned int seed = 1;
+	char path[4096];
+	struct statfs sfs;
+	int threads, opt, fd;
+
+	while ((opt = getopt(argc, argv, "d:s:t:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 's':
+			size_mb = atoi(optarg);
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d dir] [-s size_mb] [-t max_threads]\n",
+				argv[0]);
+			return ksft_exit_fail();
+		}
+	}
+	if (!max_threads)
+		max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (size_mb < 1 || max_threads < 1) {
+		fprintf(stderr, "invalid file size or thread count\n");
+		return ksft_exit_fail();
+	}
+
+	if (statfs(dir, &sfs) || sfs.f_type != F2FS_SUPER_MAGIC) {
+		printf("%s is not on f2fs, skipping\n", dir);
+		return ksft_exit_skip();
+	}
+
+	nr_blocks = size_mb * (1024 * 1024 / BLOCK_SIZE);
+	blocks = calloc(nr_blocks, sizeof(*blocks));
+	if (!blocks) {
+		perror("calloc");
+		return ksft_exit_fail();
+	}
+	for (i = 0; i < nr_blocks; i++)
+		blocks[i] = i;
+	for (i = nr_blocks - 1; i > 0; i--) {
+		j = rand_r(&seed) % (i + 1);
+		tmp = blocks[i];
+		blocks[i] = blocks[j];
+		blocks[j] = tmp;
+	}
+
+	snprintf(path, sizeof(path), "%s/f2fs_read_bench.%d", dir, getpid());
+	fd = setup_file(path, nr_blocks);
+	if (fd < 0) {
+		fprintf(stderr, "cannot set up %s: %s\n", path,
+			strerror(errno));
+		unlink(path);
+		free(blocks);
+		return ksft_exit_fail();
+	}
+
+	printf("%d MB file, %d block chunks\n", size_mb, CHUNK_BLOCKS);
+	printf("%8s %14s %10s\n", "threads", "reads/s", "MB/s");
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		double rate = run_round(fd, threads, blocks, nr_blocks);
+
+		if (rate < 0) {
+			printf("round with %d threads failed: %s\n", threads,
+			       strerror(errno));
+			ksft_inc_fail_cnt();
+			break;
+		}
+		printf("%8d %14.0f %10.1f\n", threads, rate,
+		       rate * BLOCK_SIZE / (1024 * 1024));
+		ksft_inc_pass_cnt();
+	}
+
+	close(fd);
+	unlink(path);
+	free(blocks);
+	ksft_print_cnts();
+	return ksft_cnt.ksft_fail ? ksft_exit_fail() : ksft_exit_pass();
+}
@@ -0,0 +1,336 @@
+/*
+ * FUSE request dispatch throughput benchmark.
+ *
+ * Mounts a minimal FUSE filesystem served by this process, in which every
+ * lookup fails and nothing is cached, so each stat() of a missing name is
+ * one LOOKUP round trip through the daemon. One client thread per CPU
+ * stats in a loop while 1 to 64 daemon threads serve the requests, either
+ * all reading the mount's device fd or each reading its own clone of it
+ * (FUSE_DEV_IOC_CLONE) made on the CPU the thread is pinned to. The
+ * aggregate lookups per second are reported for both setups.
+ *
+ * Usage: fuse_mq_bench [-n max_threads] [-t seconds]
+ *
+ * The test is skipped when /dev/fuse cannot be opened or the filesystem
+ * cannot be mounted (e.g. not running as root).
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <linux/fuse.h>
+
+#include "../kselftest.h"
+
+#define READ_BUF_SIZE		(64 * 1024)
+#define MAX_WRITE		4096
+#define DEFAULT_MAX_THREADS	64
+#define DEFAULT_SECONDS		2
+
+static int nr_cpus;
+
+struct daemon {
+	pthread_t thread;
+	int fd;
+	int cpu;
+	int clone;
+	int error;
+};
+
+struct client {
+	pthread_t thread;
+	const char *path;
+	int cpu;
+	int seconds;
+	unsigned long ops;
+};
+
+static void pin_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu % nr_cpus, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static int reply(int fd, uint64_t unique, int error, const void *arg,
+		 size_t size)
+{
+	struct {
+		struct fuse_out_header out;
+		char arg[sizeof(struct fuse_attr_out)];
+	} buf;
+
+	buf.out.len = sizeof(buf.out) + size;
+	buf.out.error = error;
+	buf.out.unique = unique;
+	if (size)
+		memcpy(buf.arg, arg, size);
+	if (write(fd, &buf, buf.out.len) == buf.out.len)
+		return 0;
+	/* The request may have been interrupted meanwhile */
+	return errno == ENOENT ? 0 : -1;
+}
+
+/* Returns 1 once the connection is gone, -1 on error */
+static int serve_one(int fd, char *buf)
+{
+	struct fuse_in_header *in = (struct fuse_in_header *)buf;
+	struct fuse_attr_out attr;
+	ssize_t len;
+
+	len = read(fd, buf, READ_BUF_SIZE);
+	if (len < 0)
+		return errno == ENODEV ? 1 : (errno == EINTR ? 0 : -1);
+	if (len < (ssize_t)sizeof(*in))
+		return -1;
+
+	switch (in->opcode) {
+	case FUSE_FORGET:
+	case FUSE_BATCH_FORGET:
+	case FUSE_INTERRUPT:
+		return 0;
+	case FUSE_LOOKUP:
+		return reply(fd, in->unique, -ENOENT, NULL, 0);
+	case FUSE_GETATTR:
+		memset(&attr, 0, sizeof(attr));
+		attr.attr.ino = FUSE_ROOT_ID;
+		attr.attr.mode = S_IFDIR | 0755;
+		attr.attr.nlink = 2;
+		return reply(fd, in->unique, 0, &attr, sizeof(attr));
+	case FUSE_DESTROY:
+		reply(fd, in->unique, 0, NULL, 0);
+		return 1;
+	default:
+		return reply(fd, in->unique, -ENOSYS, NULL, 0);
+	}
+}
+
+static void *daemon_thread(void *arg)
+{
+	struct daemon *d = arg;
+	int fd = d->fd;
+	char *buf;
+	int ret;
+
+	pin_cpu(d->cpu);
+	if (d->clone) {
+		uint32_t oldfd = d->fd;
+
+		fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+		if (fd < 0 || ioctl(fd, FUSE_DEV_IOC_CLONE, &oldfd) < 0) {
+			d->error = 1;
+			return NULL;
+		}
+	}
+
+	buf = malloc(READ_BUF_SIZE);
+	if (!buf) {
+		d->error = 1;
+		return NULL;
+	}
+	do {
+		ret = serve_one(fd, buf);
+	} while (!ret);
+	if (ret < 0)
+		d->error = 1;
+
+	free(buf);
+	if (d->clone)
+		close(fd);
+	return NULL;
+}
+
+static void *client_thread(void *arg)
+{
+	struct client *c = arg;
+	struct timespec now, end;
+	struct stat st;
+
+	pin_cpu(c->cpu);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += c->seconds;
+	do {
+		if (stat(c->path, &st) == 0 || errno != ENOENT)
+			break;
+		c->ops++;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (now.tv_sec < end.tv_sec ||
+		 (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec));
+	return NULL;
+}
+
+/* Answers the INIT request the kernel queues at mount time */
+static int fuse_handshake(int fd)
+{
+	char *buf = malloc(READ_BUF_SIZE);
+	struct fuse_in_header *in = (struct fuse_in_header *)buf;
+	struct fuse_init_in *init = (struct fuse_init_in *)(in + 1);
+	struct {
+		struct fuse_out_header out;
+		struct fuse_init_out init;
+	} rep;
+	int ret = -1;
+
+	if (!buf)
+		return -1;
+	if (read(fd, buf, READ_BUF_SIZE) < (ssize_t)(sizeof(*in) +
+						       sizeof(*init)) ||
+	    in->opcode != FUSE_INIT)
+		goto out;
+
+	memset(&rep, 0, sizeof(rep));
+	/* The oldest reply layout is understood by every kernel */
+	rep.out.len = sizeof(rep.out) + FUSE_COMPAT_22_INIT_OUT_SIZE;
+	rep.out.unique = in->unique;
+	rep.init.major = FUSE_KERNEL_VERSION;
+	rep.init.minor = init->minor < FUSE_KERNEL_MINOR_VERSION ?
+			 init->minor : FUSE_KERNEL_MINOR_VERSION;
+	rep.init.max_write = MAX_WRITE;
+	if (write(fd, &rep, rep.out.len) == rep.out.len)
+		ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+/* Returns the lookups per second, or -1 on error */
+static double run_round(const char *mnt, int threads, int clone, int seconds,
+			int *skip)
+{
+	struct daemon *daemons = calloc(threads, sizeof(*daemons));
+	struct client *clients = calloc(nr_cpus, sizeof(*clients));
+	char opts[128], path[256];
+	unsigned long long total = 0;
+	int fd, i, started = 0, error = 0;
+
+	if (!daemons || !clients)
+		return -1;
+
+	fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		*skip = 1;
+		return -1;
+	}
+	snprintf(opts, sizeof(opts),
+		 "fd=%d,rootmode=40000,user_id=%d,group_id=%d", fd, getuid(),
+		 getgid());
+	if (mount("fuse_mq_bench", mnt, "fuse", MS_NOSUID | MS_NODEV, opts)) {
+		*skip = 1;
+		close(fd);
+		return -1;
+	}
+	if (fuse_handshake(fd)) {
+		error = 1;
+		goto out_umount;
+	}
+
+	for (started = 0; started < threads; started++) {
+		daemons[started].fd = fd;
+		daemons[started].cpu = started;
+		daemons[started].clone = clone;
+		if (pthread_create(&daemons[started].thread, NULL,
+				   daemon_thread, &daemons[started])) {
+			error = 1;
+			goto out_umount;
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/missing", mnt);
+	for (i = 0; i < nr_cpus; i++) {
+		clients[i].path = path;
+		clients[i].cpu = i;
+		clients[i].seconds = seconds;
+		if (pthread_create(&clients[i].thread, NULL, client_thread,
+				   &clients[i])) {
+			error = 1;
+			break;
+		}
+	}
+	while (i--) {
+		pthread_join(clients[i].thread, NULL);
+		total += clients[i].ops;
+	}
+
+out_umount:
+	/* Unmounting aborts the connection, which ends the daemon threads */
+	umount2(mnt, MNT_DETACH);
+	for (i = 0; i < started; i++) {
+		pthread_join(daemons[i].thread, NULL);
+		error |= daemons[i].error;
+	}
+	close(fd);
+	free(daemons);
+	free(clients);
+	return error ? -1 : (double)total / seconds;
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = DEFAULT_MAX_THREADS;
+	int seconds = DEFAULT_SECONDS;
+	char mnt[] = "/tmp/fuse_mq_bench.XXXXXX";
+	int threads, opt, skip = 0;
+
+	while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+		switch (opt) {
+		case 'n':
+			max_threads = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n max_threads] [-t seconds]\n",
+				argv[0]);
+			return ksft_exit_fail();
+		}
+	}
+	if (max_threads < 1 || seconds < 1) {
+		fprintf(stderr, "invalid thread count or duration\n");
+		return ksft_exit_fail();
+	}
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (!mkdtemp(mnt)) {
+		perror("mkdtemp");
+		return ksft_exit_fail();
+	}
+
+	printf("%8s %16s %16s\n", "threads", "shared fd ops/s",
+	       "cloned fds ops/s");
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		double shared, cloned;
+
+		shared = run_round(mnt, threads, 0, seconds, &skip);
+		if (skip) {
+			printf("cannot mount a fuse filesystem, skipping\n");
+			rmdir(mnt);
+			return ksft_exit_skip();
+		}
+		cloned = run_round(mnt, threads, 1, seconds, &skip);
+		if (shared < 0 || cloned < 0) {
+			printf("round with %d threads failed\n", threads);
+			ksft_inc_fail_cnt();
+			break;
+		}
+		printf("%8d %16.0f %16.0f\n", threads, shared, cloned);
+		ksft_inc_pass_cnt();
+	}
+
+	rmdir(mnt);
+	ksft_print_cnts();
+	return ksft_cnt.ksft_fail ? ksft_exit_fail() : ksft_exit_pass();
+}
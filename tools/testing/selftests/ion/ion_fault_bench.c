@@ -0,0 +1,146 @@
+/*
+ * ION user mapping fault benchmark.
+ *
+ * Allocates buffers of increasing size from an ION heap, cached and
+ * uncached, and has the ion-test driver map each one into this process and
+ * touch every page (ION_IOC_TEST_USER_FAULT). Cached buffers are faulted in
+ * on access, uncached ones are mapped whole at mmap time, so the number of
+ * faults and the time reported for both show what faulting in a buffer
+ * costs.
+ *
+ * Usage: ion_fault_bench [-H heap_id] [-m max_size_mb] [-r]
+ *
+ * Pages are written to unless -r is given. The test is skipped when
+ * /dev/ion or /dev/ion-test cannot be opened.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "ion.h"
+#include "ion_test.h"
+
+#include "../kselftest.h"
+
+#define DEFAULT_MAX_SIZE_MB	32
+/* from msm_ion.h, which is not usable from userspace as it is */
+#define ION_SYSTEM_HEAP_ID	25
+#define ION_HEAP(bit)		(1U << (bit))
+
+static int ion_fd, test_fd;
+
+/* Returns a dma-buf fd for a new buffer, or -1 */
+static int alloc_buffer(size_t len, unsigned int heap_id, unsigned int flags)
+{
+	struct ion_allocation_data alloc = {
+		.len = len,
+		.align = 4096,
+		.heap_id_mask = ION_HEAP(heap_id),
+		.flags = flags,
+	};
+	struct ion_fd_data share;
+	struct ion_handle_data free_data;
+	int ret;
+
+	if (ioctl(ion_fd, ION_IOC_ALLOC, &alloc) < 0)
+		return -1;
+	share.handle = alloc.handle;
+	ret = ioctl(ion_fd, ION_IOC_SHARE, &share);
+	/* the dma-buf keeps the buffer alive */
+	free_data.handle = alloc.handle;
+	ioctl(ion_fd, ION_IOC_FREE, &free_data);
+
+	return ret < 0 ? -1 : share.fd;
+}
+
+static int run_one(size_t len, unsigned int heap_id, unsigned int flags,
+		   int write, struct ion_test_fault_data *data)
+{
+	int fd, ret;
+
+	fd = alloc_buffer(len, heap_id, flags);
+	if (fd < 0) {
+		fprintf(stderr, "cannot allocate %zu bytes: %s\n", len,
+			strerror(errno));
+		return -1;
+	}
+
+	memset(data, 0, sizeof(*data));
+	data->write = write;
+	ret = ioctl(test_fd, ION_IOC_TEST_SET_FD, fd);
+	if (!ret)
+		ret = ioctl(test_fd, ION_IOC_TEST_USER_FAULT, data);
+	if (ret)
+		fprintf(stderr, "fault test failed: %s\n", strerror(errno));
+
+	ioctl(test_fd, ION_IOC_TEST_SET_FD, -1);
+	close(fd);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int heap_id = ION_SYSTEM_HEAP_ID;
+	int max_size_mb = DEFAULT_MAX_SIZE_MB;
+	int write = 1;
+	int size_mb, opt;
+
+	while ((opt = getopt(argc, argv, "H:m:r")) != -1) {
+		switch (opt) {
+		case 'H':
+			heap_id = atoi(optarg);
+			break;
+		case 'm':
+			max_size_mb = atoi(optarg);
+			break;
+		case 'r':
+			write = 0;
+			break;
+		default:
+			fprintf(stderr,
+				"usage: %s [-H heap_id] [-m max_size_mb] [-r]\n",
+				argv[0]);
+			return ksft_exit_fail();
+		}
+	}
+	if (max_size_mb < 1 || heap_id > 31) {
+		fprintf(stderr, "invalid size or heap id\n");
+		return ksft_exit_fail();
+	}
+
+	ion_fd = open("/dev/ion", O_RDONLY | O_CLOEXEC);
+	test_fd = open("/dev/ion-test", O_RDWR | O_CLOEXEC);
+	if (ion_fd < 0 || test_fd < 0) {
+		printf("cannot open /dev/ion or /dev/ion-test, skipping\n");
+		return ksft_exit_skip();
+	}
+
+	printf("%8s %10s %12s %10s %12s\n", "size MB", "cached", "cached us",
+	       "uncached", "uncached us");
+	for (size_mb = 1; size_mb <= max_size_mb; size_mb *= 2) {
+		struct ion_test_fault_data cached, uncached;
+		size_t len = (size_t)size_mb << 20;
+
+		if (run_one(len, heap_id, ION_FLAG_CACHED, write, &cached) ||
+		    run_one(len, heap_id, 0, write, &uncached)) {
+			ksft_inc_fail_cnt();
+			break;
+		}
+		printf("%8d %10llu %12.1f %10llu %12.1f\n", size_mb,
+		       (unsigned long long)cached.faults, cached.time_ns / 1e3,
+		       (unsigned long long)uncached.faults,
+		       uncached.time_ns / 1e3);
+		ksft_inc_pass_cnt();
+	}
+
+	close(test_fd);
+	close(ion_fd);
+	ksft_print_cnts();
+	return ksft_cnt.ksft_fail ? ksft_exit_fail() : ksft_exit_pass();
+}
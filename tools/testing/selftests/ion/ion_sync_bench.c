@@ -0,0 +1,196 @@
+/*
+ * ION partial cache maintenance benchmark.
+ *
+ * Allocates a cached buffer laid out as a 32-bit image and maps it. For an
+ * increasing number of rows, writes those rows through the mapping and
+ * then syncs the buffer for the device, once for the whole buffer
+ * (ION_IOC_SYNC) and once for just the rows written (ION_IOC_SYNC_RANGES,
+ * one range per row). The average time of both is reported.
+ *
+ * Usage: ion_sync_bench [-H heap_id] [-w width] [-h height] [-i iterations]
+ *
+ * The test is skipped when /dev/ion cannot be opened or the kernel does
+ * not know ION_IOC_SYNC_RANGES.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "ion.h"
+
+#include "../kselftest.h"
+
+#define DEFAULT_WIDTH		1920
+#define DEFAULT_HEIGHT		1080
+#define DEFAULT_ITERATIONS	20
+#define BYTES_PER_PIXEL		4
+/* from msm_ion.h, which is not usable from userspace as it is */
+#define ION_SYSTEM_HEAP_ID	25
+#define ION_HEAP(bit)		(1U << (bit))
+
+static int ion_fd;
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Returns a dma-buf fd for a new buffer, or -1 */
+static int alloc_buffer(size_t len, unsigned int heap_id, unsigned int flags)
+{
+	struct ion_allocation_data alloc = {
+		.len = len,
+		.align = 4096,
+		.heap_id_mask = ION_HEAP(heap_id),
+		.flags = flags,
+	};
+	struct ion_fd_data share;
+	struct ion_handle_data free_data;
+	int ret;
+
+	if (ioctl(ion_fd, ION_IOC_ALLOC, &alloc) < 0)
+		return -1;
+	share.handle = alloc.handle;
+	ret = ioctl(ion_fd, ION_IOC_SHARE, &share);
+	/* the dma-buf keeps the buffer alive */
+	free_data.handle = alloc.handle;
+	ioctl(ion_fd, ION_IOC_FREE, &free_data);
+
+	return ret < 0 ? -1 : share.fd;
+}
+
+/* Writes @rows rows spread evenly over the image */
+static void write_rows(char *map, struct ion_sync_range *ranges, int rows,
+		       int height, size_t stride, int pass)
+{
+	int i;
+
+	for (i = 0; i < rows; i++) {
+		size_t row = (size_t)i * height / rows;
+
+		memset(map + row * stride, pass, stride);
+		ranges[i].offset = row * stride;
+		ranges[i].len = stride;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int heap_id = ION_SYSTEM_HEAP_ID;
+	int width = DEFAULT_WIDTH, height = DEFAULT_HEIGHT;
+	int iterations = DEFAULT_ITERATIONS;
+	struct ion_sync_ranges_data sync_ranges;
+	struct ion_sync_range *ranges;
+	struct ion_fd_data sync;
+	size_t stride, len;
+	int buf_fd, rows, opt, i;
+	char *map;
+
+	while ((opt = getopt(argc, argv, "H:w:h:i:")) != -1) {
+		switch (opt) {
+		case 'H':
+			heap_id = atoi(optarg);
+			break;
+		case 'w':
+			width = atoi(optarg);
+			break;
+		case 'h':
+			height = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"usage: %s [-H heap_id] [-w width] [-h height] [-i iterations]\n",
+				argv[0]);
+			return ksft_exit_fail();
+		}
+	}
+	if (width < 1 || height < 1 || iterations < 1 || heap_id > 31) {
+		fprintf(stderr, "invalid image size, iterations or heap id\n");
+		return ksft_exit_fail();
+	}
+
+	ion_fd = open("/dev/ion", O_RDONLY | O_CLOEXEC);
+	if (ion_fd < 0) {
+		printf("cannot open /dev/ion, skipping\n");
+		return ksft_exit_skip();
+	}
+
+	stride = (size_t)width * BYTES_PER_PIXEL;
+	len = stride * height;
+	buf_fd = alloc_buffer(len, heap_id, ION_FLAG_CACHED);
+	if (buf_fd < 0) {
+		fprintf(stderr, "cannot allocate %zu bytes: %s\n", len,
+			strerror(errno));
+		return ksft_exit_fail();
+	}
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, buf_fd, 0);
+	ranges = calloc(ION_SYNC_MAX_RANGES, sizeof(*ranges));
+	if (map == MAP_FAILED || !ranges) {
+		perror("mmap");
+		return ksft_exit_fail();
+	}
+
+	memset(&sync_ranges, 0, sizeof(sync_ranges));
+	sync_ranges.fd = buf_fd;
+	sync_ranges.flags = ION_SYNC_FOR_DEVICE;
+	sync_ranges.ranges = (uintptr_t)ranges;
+	sync_ranges.nr_ranges = 1;
+	write_rows(map, ranges, 1, height, stride, 0);
+	if (ioctl(ion_fd, ION_IOC_SYNC_RANGES, &sync_ranges) < 0 &&
+	    errno == ENOTTY) {
+		printf("ION_IOC_SYNC_RANGES not supported, skipping\n");
+		return ksft_exit_skip();
+	}
+	sync.fd = buf_fd;
+
+	printf("%zu KB buffer, %zu byte rows\n", len >> 10, stride);
+	printf("%8s %14s %14s\n", "rows", "full sync us", "range sync us");
+	for (rows = 1; rows <= height && rows <= ION_SYNC_MAX_RANGES;
+	     rows *= 4) {
+		double full = 0, range = 0, start;
+		int ret = 0;
+
+		sync_ranges.nr_ranges = rows;
+		for (i = 0; i < iterations && !ret; i++) {
+			write_rows(map, ranges, rows, height, stride, i);
+			start = now_us();
+			ret = ioctl(ion_fd, ION_IOC_SYNC, &sync);
+			full += now_us() - start;
+
+			write_rows(map, ranges, rows, height, stride, i);
+			start = now_us();
+			ret |= ioctl(ion_fd, ION_IOC_SYNC_RANGES, &sync_ranges);
+			range += now_us() - start;
+		}
+		if (ret) {
+			fprintf(stderr, "sync failed: %s\n", strerror(errno));
+			ksft_inc_fail_cnt();
+			break;
+		}
+		printf("%8d %14.1f %14.1f\n", rows, full / iterations,
+		       range / iterations);
+		ksft_inc_pass_cnt();
+	}
+
+	munmap(map, len);
+	close(buf_fd);
+	close(ion_fd);
+	free(ranges);
+	ksft_print_cnts();
+	return ksft_cnt.ksft_fail ? ksft_exit_fail() : ksft_exit_pass();
+}
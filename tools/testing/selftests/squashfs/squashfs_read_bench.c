@@ -0,0 +1,148 @@
+/*
+ * Squashfs sequential read throughput benchmark.
+ *
+ * Evicts a file on a squashfs mount from the page cache and reads it
+ * sequentially, once with readahead datablocks decompressed one at a time
+ * by the reading task and once with them decompressed in parallel, by
+ * toggling the squashfs.parallel_readahead module parameter. The
+ * throughput of both paths is reported. The file should be larger than a
+ * few datablocks and stored without a fragment for meaningful numbers.
+ *
+ * Usage: squashfs_read_bench -f file [-r rounds]
+ *
+ * The test is skipped when no file is given, it is not on squashfs or the
+ * module parameter cannot be written (not root, or a kernel without
+ * CONFIG_SQUASHFS_FILE_DIRECT).
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/vfs.h>
+
+#include "../kselftest.h"
+
+#define SQUASHFS_MAGIC		0x73717368
+#define READ_BUF_SIZE		(1024 * 1024)
+#define DEFAULT_ROUNDS		3
+
+static const char *param =
+	"/sys/module/squashfs/parameters/parallel_readahead";
+
+static int set_parallel(int on)
+{
+	int fd, ret;
+
+	fd = open(param, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, on ? "Y" : "N", 1) == 1 ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+/* Returns the read throughput in bytes per second, or -1 on error */
+static double read_file(const char *path, char *buf)
+{
+	struct timespec start, end;
+	unsigned long long total = 0;
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	/* squashfs pages are never dirty, so this drops all of them */
+	if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED)) {
+		close(fd);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((len = read(fd, buf, READ_BUF_SIZE)) > 0)
+		total += len;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	close(fd);
+
+	if (len < 0 || !total)
+		return -1;
+	return total / ((end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = NULL;
+	int rounds = DEFAULT_ROUNDS;
+	struct statfs sfs;
+	int i, opt, ret;
+	char *buf;
+
+	while ((opt = getopt(argc, argv, "f:r:")) != -1) {
+		switch (opt) {
+		case 'f':
+			path = optarg;
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s -f file [-r rounds]\n",
+				argv[0]);
+			return ksft_exit_fail();
+		}
+	}
+	if (rounds < 1) {
+		fprintf(stderr, "invalid round count\n");
+		return ksft_exit_fail();
+	}
+
+	if (!path) {
+		printf("no squashfs file given, skipping\n");
+		return ksft_exit_skip();
+	}
+	if (statfs(path, &sfs) < 0 || sfs.f_type != SQUASHFS_MAGIC) {
+		printf("%s is not on squashfs, skipping\n", path);
+		return ksft_exit_skip();
+	}
+	if (set_parallel(1)) {
+		printf("cannot write %s (%s), skipping\n", param,
+		       strerror(errno));
+		return ksft_exit_skip();
+	}
+
+	buf = malloc(READ_BUF_SIZE);
+	if (!buf) {
+		perror("malloc");
+		return ksft_exit_fail();
+	}
+
+	printf("%8s %14s %14s %10s\n", "round", "serial MB/s", "parallel MB/s",
+	       "speedup");
+	for (i = 1; i <= rounds; i++) {
+		double serial, parallel;
+
+		ret = set_parallel(0);
+		serial = ret ? -1 : read_file(path, buf);
+		ret = set_parallel(1);
+		parallel = ret ? -1 : read_file(path, buf);
+		if (serial < 0 || parallel < 0) {
+			printf("round %d failed\n", i);
+			ksft_inc_fail_cnt();
+			break;
+		}
+		printf("%8d %14.1f %14.1f %9.2fx\n", i, serial / 1e6,
+		       parallel / 1e6, parallel / serial);
+		ksft_inc_pass_cnt();
+	}
+
+	free(buf);
+	set_parallel(1);
+	ksft_print_cnts();
+	return ksft_cnt.ksft_fail ? ksft_exit_fail() : ksft_exit_pass();
+}
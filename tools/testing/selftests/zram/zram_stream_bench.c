@@ -0,0 +1,199 @@
+/*
+ * zram write throughput scaling benchmark.
+ *
+ * Starts one writer thread per CPU, each pinned to its own CPU and writing
+ * semi-compressible pages with O_DIRECT to a disjoint region of a zram
+ * device, so every write goes through the driver's compression path. The
+ * aggregate throughput is reported for 1..N concurrent writers, which shows
+ * how well compression streams scale with the number of CPUs.
+ *
+ * Usage: zram_stream_bench [-d device] [-n max_threads] [-t seconds]
+ *
+ * The device must already be initialized (disksize set). The test is
+ * skipped when it cannot be opened.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "../kselftest.h"
+
+#define PAGE_BYTES		4096
+#define DEFAULT_SECONDS		2
+
+static const char *device = "/dev/zram0";
+
+struct writer {
+	pthread_t thread;
+	int cpu;
+	off_t start;
+	off_t len;
+	int seconds;
+	unsigned long long bytes;
+	int error;
+};
+
+/* Roughly half of each page is random, the rest is a repeating pattern */
+static void fill_page(uint8_t *page, unsigned int *seed)
+{
+	int i;
+
+	for (i = 0; i < PAGE_BYTES; i++)
+		page[i] = (i & 1) ? rand_r(seed) : (uint8_t)(i >> 4);
+}
+
+static void *writer_thread(void *arg)
+{
+	struct writer *w = arg;
+	struct timespec now, end;
+	unsigned int seed = w->cpu + 1;
+	cpu_set_t set;
+	uint8_t *page;
+	off_t off = 0;
+	int fd;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	fd = open(device, O_WRONLY | O_DIRECT);
+	if (fd < 0 || posix_memalign((void **)&page, PAGE_BYTES, PAGE_BYTES)) {
+		w->error = 1;
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += w->seconds;
+	do {
+		fill_page(page, &seed);
+		if (pwrite(fd, page, PAGE_BYTES, w->start + off) != PAGE_BYTES) {
+			w->error = 1;
+			break;
+		}
+		w->bytes += PAGE_BYTES;
+		off += PAGE_BYTES;
+		if (off >= w->len)
+			off = 0;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (now.tv_sec < end.tv_sec ||
+		 (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec));
+
+	free(page);
+	close(fd);
+	return NULL;
+}
+
+/* Returns the aggregate throughput in bytes per second, or -1 on error */
+static double run_round(struct writer *writers, int threads,
+			unsigned long long disksize, int seconds)
+{
+	unsigned long long total = 0;
+	off_t region;
+	int i, error = 0;
+
+	region = disksize / threads / PAGE_BYTES * PAGE_BYTES;
+	if (region < PAGE_BYTES)
+		return -1;
+
+	for (i = 0; i < threads; i++) {
+		memset(&writers[i], 0, sizeof(writers[i]));
+		writers[i].cpu = i;
+		writers[i].start = region * i;
+		writers[i].len = region;
+		writers[i].seconds = seconds;
+		if (pthread_create(&writers[i].thread, NULL, writer_thread,
+				   &writers[i])) {
+			threads = i;
+			error = 1;
+			break;
+		}
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(writers[i].thread, NULL);
+		error |= writers[i].error;
+		total += writers[i].bytes;
+	}
+	return error ? -1 : (double)total / seconds;
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int seconds = DEFAULT_SECONDS;
+	unsigned long long disksize;
+	struct writer *writers;
+	double single = 0;
+	int threads, fd, opt;
+
+	while ((opt = getopt(argc, argv, "d:n:t:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'n':
+			max_threads = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"usage: %s [-d device] [-n max_threads] [-t seconds]\n",
+				argv[0]);
+			return ksft_exit_fail();
+		}
+	}
+	if (max_threads < 1 || seconds < 1) {
+		fprintf(stderr, "invalid thread count or duration\n");
+		return ksft_exit_fail();
+	}
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		printf("cannot open %s, skipping\n", device);
+		return ksft_exit_skip();
+	}
+	if (ioctl(fd, BLKGETSIZE64, &disksize) < 0 || !disksize) {
+		printf("%s is not initialized, skipping\n", device);
+		close(fd);
+		return ksft_exit_skip();
+	}
+	close(fd);
+
+	writers = calloc(max_threads, sizeof(*writers));
+	if (!writers) {
+		perror("calloc");
+		return ksft_exit_fail();
+	}
+
+	printf("%8s %12s %10s\n", "threads", "MB/s", "scaling");
+	for (threads = 1; threads <= max_threads; threads++) {
+		double rate = run_round(writers, threads, disksize, seconds);
+
+		if (rate < 0) {
+			printf("round with %d threads failed\n", threads);
+			ksft_inc_fail_cnt();
+			break;
+		}
+		if (threads == 1)
+			single = rate;
+		printf("%8d %12.1f %9.2fx\n", threads, rate / 1e6,
+		       single ? rate / single : 0);
+		ksft_inc_pass_cnt();
+	}
+
+	free(writers);
+	ksft_print_cnts();
+	return ksft_cnt.ksft_fail ? ksft_exit_fail() : ksft_exit_pass();
+}